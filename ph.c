@@ -2,15 +2,37 @@
 #include	<stdlib.h>
 #include	<stdint.h>
 #include	<string.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#ifdef __PH_LATENCY
+#include	<time.h>
+#endif
 #include	"ph.h"
 
 // Uncomment (or define at compile time) to turn on use of recursive pair merging
 // instead of the (slightly) faster iterative pair merging
 // #define __PH_USE_RECURSIVE_MERGE
 
-// Uncomment (or define at compile time) to turn on use of recursive tree destroy
-// Recommended to use the recursive destroy, unless running into stack memory issues
-#define __PH_USE_RECURSIVE_DESTROY
+// Uncomment (or define at compile time) to leave out the vectorised pairing pass for
+// integer keys, and always use the scalar one
+// #define __PH_NO_SIMD
+
+// The vectorised pairing pass is a variant of the iterative one, and needs x86-64
+// with a compiler that can build functions for instruction sets beyond its default
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__PH_USE_RECURSIVE_MERGE) && !defined(__PH_NO_SIMD)
+#define	__PH_SIMD
+#include	<immintrin.h>
+#endif
+
+// Uncomment (or define at compile time) to turn on the structural statistics
+// counters that are returned by pheap_stats().  They cost nothing when off
+// #define __PH_STATS
+
+// Uncomment (or define at compile time) to time every insert, delete min, delete,
+// change key and destroy call into the histograms returned by pheap_latency_snapshot()
+// #define __PH_LATENCY
 
 struct heap {
 	struct heap	*next;			// Next sibling
@@ -20,11 +42,175 @@ struct heap {
 	void		*data;			// The associated data with this entry
 };
 
+// Nodes of heaps made by pheap_create_prefixed() carry an order preserving 64-bit
+// prefix of their key, so most comparisons never have to look at the key itself
+struct heap_pfx {
+	struct heap	h;
+	uint64_t	pfx;			// The prefix of h.key
+};
+
+#define	HEAP_PFX(n)	(((struct heap_pfx *)(n))->pfx)
+
+// Nodes of heaps made by pheap_create_bounded() know where they are in the max
+// ordered companion heap that tracks the worst node (see heap_bound_insert())
+struct heap_bnd {
+	struct heap	h;
+	size_t		pos;			// Index of the node in ph->bheap[]
+};
+
+#define	HEAP_BPOS(n)	(((struct heap_bnd *)(n))->pos)
+
+// Node pool.  Nodes are carved out of slabs which are chained together through
+// their first word.  Released nodes go onto a free list that is threaded through
+// their next pointers, and are handed out again before any new slab space is used
+#define	PH_SLAB_MIN	256		// Nodes in the first slab a pool allocates
+#define	PH_SLAB_MAX	65536		// Slabs stop doubling in size at this many nodes
+
+struct heap_slab {
+	struct heap_slab	*next;		// Next slab owned by the same pool
+	size_t			nodes;		// Number of nodes in the slab
+};
+
+struct heap_pool {
+	struct heap_slab	*slabs;		// All slabs owned by this pool
+	struct heap		*free;		// Free list of released nodes
+	struct heap		*bump;		// Next never-used node in the newest slab
+	struct heap		*bend;		// End of the newest slab
+	size_t			nfree;		// Length of the free list
+	size_t			nslab;		// Number of nodes to put in the next slab
+	size_t			size;		// Size of each node in bytes
+	size_t			ncap;		// Number of nodes in all slabs
+};
+
+// State of a pheap_compact_step() run.  Nodes are moved into the heap's pool, which
+// is started afresh with a slab big enough for them all, in the order of a pre-order
+// walk.  Nodes that were allocated before the run began are the old nodes
+struct heap_compact {
+	struct heap_pool	old;		// The pool moved out of, if the heap was pooled
+	struct heap_slab	*slab;		// The slab that the nodes are moved into
+	struct heap		*pos;		// Last node the walk reached, or NULL to restart
+	size_t			left;		// Old nodes still to be moved
+	int			pooled;		// Set if the old nodes are in old's slabs
+};
+
 struct pheap {
 	int 		(*cmp)(void *, void *);	// User supplied compare function
 	struct heap	*root;			// The root of the actual heap
+	int		opts;			// PH_OPT_* flags given to pheap_create_ex()
+	struct heap_pool pool;			// Node pool, used if PH_OPT_POOL is set
+	struct heap	*pending;		// Unpaired inserts, if PH_OPT_INSBUF is set
+	struct heap	*inbox;			// Lock-free pushes, if PH_OPT_INBOX is set
+	uint64_t	(*prefix)(void *);	// Key prefix function, for prefixed heaps
+	size_t		nodesize;		// Size of each node in bytes
+	struct heap	**bheap;		// Max ordered binary heap, if bounded
+	size_t		bound;			// Most nodes a bounded heap may hold
+	size_t		bcount;			// Nodes in bheap[]
+	void		*map;			// Snapshot mapped by pheap_restore()
+	size_t		maplen;			// Length of the mapping
+	struct heap_compact *compact;		// Set while pheap_compact_step() is underway
+#ifdef __PH_STATS
+	struct pheap_stats stats;		// Counters returned by pheap_stats()
+#endif
+#ifdef __PH_LATENCY
+	struct pheap_latency *lat;		// Histograms for pheap_latency_snapshot()
+#endif
 };
 
+#ifdef __PH_STATS
+#define	PH_STAT(ph, field, n)	((ph)->stats.field += (n))
+
+// The pairing passes aren't told which heap they are working on, so they count
+// into these, and heap_merge_pairs_as() adds what a pass counted to its heap
+static __thread uint64_t	ph_pass_merges;		// Compare and merge of two trees
+static __thread uint64_t	ph_pass_msn_hits;	// Chunks cut short at MSN trees
+#define	PH_PASS_STAT(field, n)	(ph_pass_##field += (n))
+#else
+#define	PH_STAT(ph, field, n)
+#define	PH_PASS_STAT(field, n)
+#endif
+
+#ifdef __PH_LATENCY
+// Histograms of every heap destroyed so far, and of the destroys themselves
+static struct pheap_latency	ph_lat_all;
+
+static inline uint64_t
+heap_lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // heap_lat_now
+
+
+// Returns the histogram bucket that a latency of ns nanoseconds falls into
+static inline unsigned
+heap_lat_bucket(uint64_t ns)
+{
+	unsigned b;
+
+	if (ns < 4)
+		return ns;
+	b = 63 - __builtin_clzll(ns);
+	return (b - 1) * 4 + ((ns >> (b - 2)) & 3);
+} // heap_lat_bucket
+
+
+static inline void
+heap_lat_record(struct pheap_latency *lat, int op, uint64_t start)
+{
+	uint64_t ns = heap_lat_now() - start;
+
+	if (lat == NULL)
+		return;
+	lat->count[op]++;
+	lat->total_ns[op] += ns;
+	if (ns > lat->max_ns[op])
+		lat->max_ns[op] = ns;
+	lat->hist[op][heap_lat_bucket(ns)]++;
+} // heap_lat_record
+
+
+// Adds the histograms in lat into those of all destroyed heaps.  Heaps may be
+// destroyed by any thread, so the adds are atomic
+static void
+heap_lat_fold(struct pheap_latency *lat)
+{
+	uint64_t max;
+	int op, i;
+
+	if (lat == NULL)
+		return;
+	for (op = 0; op < PH_LAT_OPS; op++) {
+		if (lat->count[op] == 0)
+			continue;
+		__atomic_fetch_add(&ph_lat_all.count[op], lat->count[op], __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ph_lat_all.total_ns[op], lat->total_ns[op], __ATOMIC_RELAXED);
+		max = __atomic_load_n(&ph_lat_all.max_ns[op], __ATOMIC_RELAXED);
+		while ((lat->max_ns[op] > max) &&
+		       !__atomic_compare_exchange_n(&ph_lat_all.max_ns[op], &max, lat->max_ns[op], 0,
+						    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		for (i = 0; i < PH_LAT_BUCKETS; i++)
+			if (lat->hist[op][i])
+				__atomic_fetch_add(&ph_lat_all.hist[op][i], lat->hist[op][i], __ATOMIC_RELAXED);
+	}
+} // heap_lat_fold
+
+#define	PH_LAT_START(t)		uint64_t t = heap_lat_now()
+#define	PH_LAT_END(ph, op, t)	heap_lat_record((ph)->lat, (op), (t))
+#else
+#define	PH_LAT_START(t)
+#define	PH_LAT_END(ph, op, t)
+#endif
+
+// Per-thread cache of released nodes for non-pooled heaps created with
+// PH_OPT_TLCACHE.  Nodes in here were individually malloc'd, so they may
+// be recycled by any such heap that is used by the same thread
+#define	PH_TLC_MAX	4096		// Most nodes a thread will keep cached
+
+static __thread struct heap	*ph_tlc;	// Cached nodes, linked by next
+static __thread size_t		ph_tlc_len;	// Number of cached nodes
+
 
 // Default compare function that treats the void *key pointers as intptr_t
 // integers. This allows for quick integer key queue sorting implementations
@@ -41,9 +227,289 @@ static inline int heap_int_cmp(register void *a, register void *b)
 } // heap_int_cmp
 
 
+// Compare functions for the PH_KEY_* built-in key types.  Like heap_int_cmp()
+// above they treat equality as less than.  They are never called through a
+// pointer on the hot paths, as the pairing pass gets its own copy for each of
+// them with the comparison inlined (see PH_KEY_SPECIALISE() below)
+static inline int heap_u32_cmp(register void *a, register void *b)
+{
+	return ((uint32_t)(uintptr_t)a > (uint32_t)(uintptr_t)b ? 1 : -1);
+} // heap_u32_cmp
+
+static inline int heap_u64_cmp(register void *a, register void *b)
+{
+	return ((uint64_t)(uintptr_t)a > (uint64_t)(uintptr_t)b ? 1 : -1);
+} // heap_u64_cmp
+
+static inline int heap_i64_cmp(register void *a, register void *b)
+{
+	return ((int64_t)(intptr_t)a > (int64_t)(intptr_t)b ? 1 : -1);
+} // heap_i64_cmp
+
+static inline int heap_double_cmp(register void *a, register void *b)
+{
+	return (pheap_key_double(a) > pheap_key_double(b) ? 1 : -1);
+} // heap_double_cmp
+
+// Loads up to the first 8 bytes of a string as a big-endian integer, so that
+// comparing two prefixes as integers orders them the same way as strcmp()
+static inline uint64_t heap_str_prefix(register const unsigned char *s)
+{
+	register uint64_t p = 0;
+	register int i;
+
+	for (i = 0; (i < 8) && s[i]; i++)
+		p |= (uint64_t)s[i] << (56 - (i << 3));
+	return p;
+} // heap_str_prefix
+
+static inline int heap_strpfx_cmp(register void *a, register void *b)
+{
+	register uint64_t pa = heap_str_prefix(a), pb = heap_str_prefix(b);
+
+	if (pa != pb)
+		return (pa > pb ? 1 : -1);
+	return (strcmp(a, b) > 0 ? 1 : -1);
+} // heap_strpfx_cmp
+
+
+// Moves the nodes not yet handed out from the pool's newest slab onto its free list
+static void
+heap_pool_spill(struct heap_pool *pool)
+{
+	while (pool->bump < pool->bend) {
+		pool->bump->next = pool->free;
+		pool->free = pool->bump;
+		pool->bump = (struct heap *)((char *)pool->bump + pool->size);
+		pool->nfree++;
+	}
+} // heap_pool_spill
+
+
+// Adds a new slab of at least n nodes to the pool.  Returns 0 if out of memory
+static int
+heap_pool_grow(struct heap_pool *pool, size_t n)
+{
+	struct heap_slab *s;
+
+	if (n < pool->nslab)
+		n = pool->nslab;
+	if (n >= SIZE_MAX / pool->size)
+		return 0;
+
+	// The slab header is padded out to a whole node so that nodes stay aligned
+	s = (struct heap_slab *)malloc(pool->size * (n + 1));
+	if (s == NULL)
+		return 0;
+	s->next = pool->slabs;
+	s->nodes = n;
+	pool->slabs = s;
+
+	// Any space left in the old slab is moved onto the free list
+	heap_pool_spill(pool);
+	pool->bump = (struct heap *)((char *)s + pool->size);
+	pool->bend = (struct heap *)((char *)pool->bump + pool->size * n);
+	pool->ncap += n;
+
+	if (pool->nslab < PH_SLAB_MAX)
+		pool->nslab <<= 1;
+	return 1;
+} // heap_pool_grow
+
+
+// Releases every slab owned by the pool in one go, along with every node in them
+static void
+heap_pool_release(struct heap_pool *pool)
+{
+	struct heap_slab *s;
+
+	while ((s = pool->slabs)) {
+		pool->slabs = s->next;
+		free(s);
+	}
+	pool->free = pool->bump = pool->bend = NULL;
+	pool->nfree = pool->ncap = 0;
+} // heap_pool_release
+
+
+// Takes back every node of an arena, keeping its memory.  An arena with more than
+// one slab is swapped for a single slab that holds as many nodes, so that every
+// rewind after the first one takes O(1) time
+static void
+heap_pool_rewind(struct heap_pool *pool)
+{
+	size_t ncap = pool->ncap;
+
+	if (pool->slabs == NULL)
+		return;
+	if (pool->slabs->next) {
+		heap_pool_release(pool);
+		heap_pool_grow(pool, ncap);	// Just left empty if out of memory
+		return;
+	}
+	pool->bump = (struct heap *)((char *)pool->slabs + pool->size);
+	pool->free = NULL;
+	pool->nfree = 0;
+} // heap_pool_rewind
+
+
+// Returns non-zero if the node is a new one.  Nearly every new node is in the slab
+// made for the run, and so is found with a range check.  Only if inserts made in
+// between steps have used that slab up are the slabs added since then looked at
+static inline int
+heap_compact_owns(struct pheap *ph, struct heap *n)
+{
+	struct heap_compact *c = ph->compact;
+	struct heap_slab *s;
+	size_t size = ph->pool.size;
+
+	if (((char *)n > (char *)c->slab) && ((char *)n <= (char *)c->slab + size * c->slab->nodes))
+		return 1;
+	for (s = ph->pool.slabs; s != c->slab; s = s->next)
+		if (((char *)n > (char *)s) && ((char *)n <= (char *)s + size * s->nodes))
+			return 1;
+	return 0;
+} // heap_compact_owns
+
+
+// Called on every node freed while the heap is being compacted.  An old node is
+// freed if it came from malloc, or is left for its slab to be released with.
+// Returns 1 if the node was an old one, and 0 if it goes back to the pool as usual
+static int
+heap_compact_free(struct pheap *ph, struct heap *n)
+{
+	struct heap_compact *c = ph->compact;
+
+	if (n == c->pos)
+		c->pos = NULL;
+	if (heap_compact_owns(ph, n))
+		return 0;
+	c->left--;
+	if (!c->pooled)
+		free(n);
+	return 1;
+} // heap_compact_free
+
+
+// Ends a compaction run, releasing the old pool's slabs.  Any old nodes that are
+// still in the heap must be done with first
+static void
+heap_compact_end(struct pheap *ph)
+{
+	if (ph->compact) {
+		heap_pool_release(&ph->compact->old);
+		free(ph->compact);
+		ph->compact = NULL;
+	}
+} // heap_compact_end
+
+
+// The layout of struct pheap_node in ph.h must stay in step with struct heap
+_Static_assert(sizeof(struct pheap_node) == sizeof(struct heap), "struct pheap_node size mismatch");
+
+// Allocates a zeroed node for the given heap, from wherever its options say
+static inline struct heap *
+heap_node_alloc(struct pheap *ph)
+{
+	struct heap *n;
+
+	// Intrusive heaps only ever hold nodes that the caller owns
+	if (ph->opts & PH_OPT_INTRUSIVE)
+		return NULL;
+
+	if (ph->opts & PH_OPT_POOL) {
+		struct heap_pool *pool = &ph->pool;
+
+		if ((n = pool->free)) {
+			pool->free = n->next;
+			pool->nfree--;
+		} else {
+			if ((pool->bump == pool->bend) && !heap_pool_grow(pool, 0))
+				return NULL;
+			n = pool->bump;
+			pool->bump = (struct heap *)((char *)n + pool->size);
+		}
+		n->next = n->prev = n->sub = NULL;
+		return n;
+	}
+
+	if ((ph->opts & PH_OPT_TLCACHE) && (n = ph_tlc)) {
+		ph_tlc = n->next;
+		ph_tlc_len--;
+		n->next = NULL;
+		return n;
+	}
+
+	return (struct heap *)calloc(ph->nodesize, 1);
+} // heap_node_alloc
+
+
+static void heap_bound_remove(struct pheap *ph, struct heap *n);
+
+// Returns a node to wherever the given heap allocated it from
+static inline void
+heap_node_free(struct pheap *ph, struct heap *n)
+{
+	PH_STAT(ph, nodes, -1);
+	if (ph->bheap)
+		heap_bound_remove(ph, n);
+
+	// Caller owned nodes are just unlinked.  The key and data are left in
+	// place so the caller can still look at them after the node is removed
+	if (ph->opts & PH_OPT_INTRUSIVE) {
+		n->next = n->prev = n->sub = NULL;
+		return;
+	}
+
+	memset(n, 0, ph->nodesize);
+
+	// Old nodes of a heap being compacted don't go back into its new pool
+	if (ph->compact && heap_compact_free(ph, n))
+		return;
+
+	if (ph->opts & PH_OPT_POOL) {
+		n->next = ph->pool.free;
+		ph->pool.free = n;
+		ph->pool.nfree++;
+		return;
+	}
+
+	if ((ph->opts & PH_OPT_TLCACHE) && (ph_tlc_len < PH_TLC_MAX)) {
+		n->next = ph_tlc;
+		ph_tlc = n;
+		ph_tlc_len++;
+		return;
+	}
+
+	free(n);
+} // heap_node_free
+
+
+// Returns a chain of n nodes, linked through next from first to last, to wherever
+// the heap allocated them from.  Pooled nodes go onto the free list in one go
+static void
+heap_node_free_chain(struct pheap *ph, struct heap *first, struct heap *last, size_t n)
+{
+	struct heap *nn;
+
+	if (((ph->opts & (PH_OPT_POOL | PH_OPT_INTRUSIVE)) == PH_OPT_POOL) && (ph->bheap == NULL) && (ph->compact == NULL)) {
+		PH_STAT(ph, nodes, -n);
+		last->next = ph->pool.free;
+		ph->pool.free = first;
+		ph->pool.nfree += n;
+		return;
+	}
+
+	for (; first; first = nn) {
+		nn = first->next;
+		heap_node_free(ph, first);
+	}
+} // heap_node_free_chain
+
+
 // Joins two root nodes together, assuming that node 'a' has priority
 // A root-type node is a node that has no siblings, but may have children
-static struct heap *
+static inline struct heap *
 heap_join(register struct heap *a, register struct heap *b)
 {
 	if ((b->next = a->sub))
@@ -56,9 +522,21 @@ heap_join(register struct heap *a, register struct heap *b)
 } // heap_join
 
 
+// Compares two nodes.  With pfx set the nodes are struct heap_pfx's, and cmp is
+// only called on their keys when their prefixes are the same
+static inline __attribute__((always_inline)) int
+heap_node_cmp(int (*cmp)(void *, void *), int pfx, register struct heap *a, register struct heap *b)
+{
+	if (pfx && (HEAP_PFX(a) != HEAP_PFX(b)))
+		return (HEAP_PFX(a) > HEAP_PFX(b) ? 1 : -1);
+	return cmp(a->key, b->key);
+} // heap_node_cmp
+
+
 // Merges two root-type nodes together in an heap ordered manner
-static struct heap *
-heap_merge(int (*cmp)(void *, void *), register struct heap *a, register struct heap *b)
+// Always inlined, so that a constant cmp and pfx may be folded into the caller
+static inline __attribute__((always_inline)) struct heap *
+heap_merge(int (*cmp)(void *, void *), int pfx, register struct heap *a, register struct heap *b)
 {
 	if (a == NULL) {
 		b->prev = b->next = NULL;
@@ -68,7 +546,8 @@ heap_merge(int (*cmp)(void *, void *), register struct heap *a, register struct
 		a->prev = a->next = NULL;
 		return a;
 	}
-	if (cmp(a->key, b->key) < 0)
+	PH_PASS_STAT(merges, 1);
+	if (heap_node_cmp(cmp, pfx, a, b) < 0)
 		return heap_join(a, b);
 	return heap_join(b, a);
 } // heap_merge
@@ -79,7 +558,7 @@ heap_merge(int (*cmp)(void *, void *), register struct heap *a, register struct
 // items.  For large numbers of items, or if memory sensitive, use the
 // strictly memory constrained heap_merge_pairs_iterative() below
 static struct heap *
-heap_merge_pairs_recursive(register int (*cmp)(), register struct heap *r)
+heap_merge_pairs_recursive(register int (*cmp)(void *, void *), int pfx, register struct heap *r)
 {
 	register struct heap *np;
 
@@ -88,7 +567,7 @@ heap_merge_pairs_recursive(register int (*cmp)(), register struct heap *r)
 		return r;
 	// Need to record r->next->next now, as r->next will change after a heap_merge()
 	np = r->next->next;
-	return heap_merge(cmp, heap_merge(cmp, r, r->next), (np ? heap_merge_pairs_recursive(cmp, np) : NULL));
+	return heap_merge(cmp, pfx, heap_merge(cmp, pfx, r, r->next), (np ? heap_merge_pairs_recursive(cmp, pfx, np) : NULL));
 } // heap_merge_pairs_recursive
 
 #else
@@ -102,8 +581,8 @@ heap_merge_pairs_recursive(register int (*cmp)(), register struct heap *r)
 // merge pairing algorithm (see heap_merge_pairs_recursive() above) by around
 // 10% in practise
 #define	MSN	240	// Number of node pointers we'll allocate on the stack
-static struct heap *
-heap_merge_pairs_iterative(register int (*cmp)(void *, void *), register struct heap *r)
+static inline __attribute__((always_inline)) struct heap *
+heap_merge_pairs_iterative(register int (*cmp)(void *, void *), int pfx, register struct heap *r)
 {
 	struct heap	*sn[MSN];
 	register struct heap	*n, *p, **m = sn, **l = sn + MSN;
@@ -111,33 +590,426 @@ heap_merge_pairs_iterative(register int (*cmp)(void *, void *), register struct
 	// Isolate the sub-chain from the parent.  Append any remainder with each pass
 	for(r->prev = NULL, p = r->next; p; p->next = r, r = p, p = p->next) {
 		// Do initial left-to-right pairing pass, then a reduction pairing pass right to left
-		for(n = p->next; r && (m < l); *m++ = heap_merge(cmp, r, p), (r = n) && (p = r->next) ? (n = p->next) : (n = p));
-		for(p = *--m; m > sn; p = heap_merge(cmp, *--m, p));
+		for(n = p->next; r && (m < l); *m++ = heap_merge(cmp, pfx, r, p), (r = n) && (p = r->next) ? (n = p->next) : (n = p));
+		PH_PASS_STAT(msn_hits, (r != NULL));
+		for(p = *--m; m > sn; p = heap_merge(cmp, pfx, *--m, p));
 	}
 	return r;
 } // heap_merge_pairs_iterative
 
 #endif
 
-// Wrapper that selects which type of merging (recursive or iterative) to use based
-// upon compile time options
+// The pairing strategies below may be picked per heap with the PH_PAIR_* options
+// None of them needs more than a fixed amount of memory, as the trees waiting to
+// be merged are kept in a list threaded through their own next pointers
+
+// The original two-pass pairing.  Pairs the trees up from left to right, and then
+// merges the pairs into one from right to left
+static inline __attribute__((always_inline)) struct heap *
+heap_merge_pairs_twopass(register int (*cmp)(void *, void *), int pfx, register struct heap *r)
+{
+	register struct heap *a, *n, *acc = NULL;
+
+	// First pass.  Each pair is pushed onto acc, which so ends up right to left
+	for (r->prev = NULL; (a = r); acc = a) {
+		r = a->next ? a->next->next : NULL;
+		a = heap_merge(cmp, pfx, a, a->next);
+		a->next = acc;
+	}
+	// Second pass, from the rightmost pair back to the leftmost
+	r = acc;
+	acc = r->next;
+	for (r->next = NULL; acc; acc = n) {
+		n = acc->next;
+		r = heap_merge(cmp, pfx, acc, r);
+	}
+	return r;
+} // heap_merge_pairs_twopass
+
+
+// Pairs the trees up from left to right, over and over, until one tree is left
+static inline __attribute__((always_inline)) struct heap *
+heap_merge_pairs_multipass(register int (*cmp)(void *, void *), int pfx, struct heap *r)
+{
+	register struct heap *a, *n, **tail;
+
+	for (r->prev = NULL; r->next; ) {
+		for (a = r, tail = &r; a; a = n) {
+			n = a->next ? a->next->next : NULL;
+			*tail = a = heap_merge(cmp, pfx, a, a->next);
+			tail = &a->next;
+		}
+	}
+	return r;
+} // heap_merge_pairs_multipass
+
+
+// Pairs the trees up from left to right, and then merges the pairs into one from
+// left to right as well
+static inline __attribute__((always_inline)) struct heap *
+heap_merge_pairs_frontback(register int (*cmp)(void *, void *), int pfx, struct heap *r)
+{
+	register struct heap *a, *n, **tail;
+
+	r->prev = NULL;
+	for (a = r, tail = &r; a; a = n) {
+		n = a->next ? a->next->next : NULL;
+		*tail = a = heap_merge(cmp, pfx, a, a->next);
+		tail = &a->next;
+	}
+	for (a = r->next, r->next = NULL; a; a = n) {
+		n = a->next;
+		r = heap_merge(cmp, pfx, r, a);
+	}
+	return r;
+} // heap_merge_pairs_frontback
+
+
+// Runs the merge pairs pass of the given PH_PAIR_* strategy.  The default is the
+// chunked iterative pass, or the recursive one if that was chosen at compile time
+static inline __attribute__((always_inline)) struct heap *
+heap_merge_pairs_with(int (*cmp)(void *, void *), int pfx, int pairing, struct heap *r)
+{
+	switch (pairing) {
+	case PH_PAIR_TWOPASS:
+	case PH_PAIR_AUXTWOPASS:
+		return heap_merge_pairs_twopass(cmp, pfx, r);
+	case PH_PAIR_MULTIPASS:
+		return heap_merge_pairs_multipass(cmp, pfx, r);
+	case PH_PAIR_FRONTBACK:
+		return heap_merge_pairs_frontback(cmp, pfx, r);
+	default:
+#ifdef __PH_USE_RECURSIVE_MERGE
+		return heap_merge_pairs_recursive(cmp, pfx, r);
+#else
+		return heap_merge_pairs_iterative(cmp, pfx, r);
+#endif
+	}
+} // heap_merge_pairs_with
+
+// Generates copies of heap_merge() and the pairing passes for one of the built-in
+// key types, with its compare function inlined into them
+#define	PH_KEY_SPECIALISE_PAIRS(type)					\
+static struct heap *							\
+heap_merge_pairs_##type(int pairing, struct heap *r)			\
+{									\
+	return heap_merge_pairs_with(heap_##type##_cmp, 0, pairing, r);	\
+}
+
+#define	PH_KEY_SPECIALISE(type)						\
+static struct heap *							\
+heap_merge_##type(struct heap *a, struct heap *b)			\
+{									\
+	return heap_merge(heap_##type##_cmp, 0, a, b);			\
+}									\
+PH_KEY_SPECIALISE_PAIRS(type)
+
+PH_KEY_SPECIALISE(int)
+PH_KEY_SPECIALISE(u32)
+PH_KEY_SPECIALISE(u64)
+PH_KEY_SPECIALISE(i64)
+PH_KEY_SPECIALISE(double)
+PH_KEY_SPECIALISE(strpfx)
+
+#ifdef __PH_SIMD
+
+// Vectorised pairing pass for the integer keys of heap_int_cmp() and PH_KEY_I64.  It
+// makes exactly the same merges as heap_merge_pairs_iterative(), in the same order, so
+// the heap ends up the same shape.  The siblings of a chunk are gathered into arrays
+// of nodes and keys, and once a chain is long enough the winners of its pairs are
+// picked a vector of keys at a time with packed compares, without the hard to predict
+// branch per pair.  The joins themselves are still made one at a time.  Short chains,
+// which are most of them in a heap that is in steady use, gain nothing from this, and
+// neither does the right to left reduction, whose branch is rarely taken and so is
+// well predicted.  Both are left to scalar code
+
+#define	PH_SIMD_TARGET_sse42	"sse4.2"
+#define	PH_SIMD_TARGET_avx2	"avx2"
+#define	PH_SIMD_TARGET_avx512	"avx512f"
+
+// Number of pairs that each instruction set's pair kernel merges at once
+#define	PH_SIMD_PAIRS_sse42	2
+#define	PH_SIMD_PAIRS_avx2	4
+#define	PH_SIMD_PAIRS_avx512	8
+
+// Number of siblings at the start of each pass that are paired by scalar code
+#define	PH_SIMD_MIN	32
+
+// Joins the pair of nodes at nd[2 * i] and nd[2 * i + 1], with the second one winning
+// if b is set, and leaves the winner in nd[i]
+static inline __attribute__((always_inline)) void
+heap_simd_join(struct heap **nd, size_t i, unsigned b)
+{
+	PH_PASS_STAT(merges, 1);
+	nd[i] = heap_join(nd[2 * i + b], nd[2 * i + 1 - b]);
+} // heap_simd_join
+
+
+// Merges the pairs of nodes in nd[], whose keys are in k[], from pair i up to np, leaving
+// the winner of each pair j and its key in nd[j] and k[j].  As with heap_int_cmp() the
+// first of a pair wins if the keys are equal.  The vectorised pair kernels below do the
+// same for a fixed number of pairs at once
+static inline __attribute__((always_inline)) void
+heap_simd_pair_tail(struct heap **nd, int64_t *k, size_t i, size_t np)
+{
+	for (; i < np; i++) {
+		if (k[2 * i] > k[2 * i + 1]) {
+			k[i] = k[2 * i + 1];
+			heap_simd_join(nd, i, 1);
+		} else {
+			k[i] = k[2 * i];
+			heap_simd_join(nd, i, 0);
+		}
+	}
+} // heap_simd_pair_tail
+
+
+static inline __attribute__((always_inline, target("sse4.2"))) void
+heap_simd_pair_sse42(struct heap **nd, int64_t *k, size_t i)
+{
+	register __m128i a, b, lo, hi, gt;
+	register unsigned bits;
+
+	// k[] holds k0 k1 k2 k3, so lo is k0 k2 and hi k1 k3
+	a = _mm_loadu_si128((__m128i *)(k + 2 * i));
+	b = _mm_loadu_si128((__m128i *)(k + 2 * i + 2));
+	lo = _mm_unpacklo_epi64(a, b);
+	hi = _mm_unpackhi_epi64(a, b);
+	gt = _mm_cmpgt_epi64(lo, hi);
+	_mm_storeu_si128((__m128i *)(k + i), _mm_blendv_epi8(lo, hi, gt));
+	bits = _mm_movemask_pd(_mm_castsi128_pd(gt));
+	heap_simd_join(nd, i, bits & 1);
+	heap_simd_join(nd, i + 1, bits >> 1);
+} // heap_simd_pair_sse42
+
+
+static inline __attribute__((always_inline, target("avx2"))) void
+heap_simd_pair_avx2(struct heap **nd, int64_t *k, size_t i)
+{
+	register __m256i a, b, lo, hi, gt;
+	register unsigned bits;
+
+	// The unpacks work within each 128 bit lane, so lo is k0 k4 k2 k6 and hi is
+	// k1 k5 k3 k7, and the results are put back in order with a permute
+	a = _mm256_loadu_si256((__m256i *)(k + 2 * i));
+	b = _mm256_loadu_si256((__m256i *)(k + 2 * i + 4));
+	lo = _mm256_unpacklo_epi64(a, b);
+	hi = _mm256_unpackhi_epi64(a, b);
+	gt = _mm256_cmpgt_epi64(lo, hi);
+	a = _mm256_blendv_epi8(lo, hi, gt);
+	_mm256_storeu_si256((__m256i *)(k + i), _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3, 1, 2, 0)));
+	gt = _mm256_permute4x64_epi64(gt, _MM_SHUFFLE(3, 1, 2, 0));
+	bits = _mm256_movemask_pd(_mm256_castsi256_pd(gt));
+	heap_simd_join(nd, i, bits & 1);
+	heap_simd_join(nd, i + 1, (bits >> 1) & 1);
+	heap_simd_join(nd, i + 2, (bits >> 2) & 1);
+	heap_simd_join(nd, i + 3, bits >> 3);
+} // heap_simd_pair_avx2
+
+
+static inline __attribute__((always_inline, target("avx512f"))) void
+heap_simd_pair_avx512(struct heap **nd, int64_t *k, size_t i)
+{
+	register __m512i a, b, lo, hi;
+	register __mmask8 gt;
+	size_t j;
+
+	a = _mm512_loadu_si512((void *)(k + 2 * i));
+	b = _mm512_loadu_si512((void *)(k + 2 * i + 8));
+	lo = _mm512_permutex2var_epi64(a, _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0), b);
+	hi = _mm512_permutex2var_epi64(a, _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1), b);
+	gt = _mm512_cmpgt_epi64_mask(lo, hi);
+	_mm512_storeu_si512((void *)(k + i), _mm512_mask_blend_epi64(gt, lo, hi));
+	for (j = 0; j < 8; j++)
+		heap_simd_join(nd, i + j, (gt >> j) & 1);
+} // heap_simd_pair_avx512
+
+
+// Generates the vectorised pairing pass for one instruction set.  The siblings are
+// gathered and paired a kernel's worth at a time, so that the joins can overlap with
+// the walk down the chain, as they do in heap_merge_pairs_iterative().  A chunk takes
+// in the result of the chunk before it as its first tree, just as that does too
+#define	PH_SIMD_PAIRS(isa)							\
+static __attribute__((target(PH_SIMD_TARGET_##isa))) struct heap *		\
+heap_merge_pairs_##isa(struct heap *r)						\
+{										\
+	struct heap	*nd[2 * MSN], *rest, *acc;				\
+	int64_t		k[2 * MSN], ka;						\
+	size_t		c, e, m, i, t = PH_SIMD_MIN;				\
+										\
+	for (r->prev = NULL; r->next; r = acc, t = 0) {				\
+		for (c = m = 0, rest = r; rest && (c < 2 * MSN); m = c / 2) {	\
+			for (e = c + 2 * PH_SIMD_PAIRS_##isa; rest && (c < e); rest = rest->next, c++) {	\
+				nd[c] = rest;					\
+				k[c] = (intptr_t)rest->key;			\
+			}							\
+			if ((c == e) && (c > t))				\
+				heap_simd_pair_##isa(nd, k, m);			\
+			else							\
+				heap_simd_pair_tail(nd, k, m, c / 2);		\
+		}								\
+		if (c & 1) {							\
+			nd[m] = nd[c - 1];					\
+			k[m++] = k[c - 1];					\
+			nd[m - 1]->prev = nd[m - 1]->next = NULL;		\
+		}								\
+		PH_PASS_STAT(msn_hits, (rest != NULL));				\
+		PH_PASS_STAT(merges, m - 1);					\
+		for (acc = nd[i = m - 1], ka = k[i]; i-- > 0; ) {		\
+			if (k[i] <= ka) {					\
+				acc = heap_join(nd[i], acc);			\
+				ka = k[i];					\
+			} else							\
+				heap_join(acc, nd[i]);				\
+		}								\
+		acc->next = rest;						\
+	}									\
+	return r;								\
+}
+
+PH_SIMD_PAIRS(sse42)
+PH_SIMD_PAIRS(avx2)
+PH_SIMD_PAIRS(avx512)
+
+static int	ph_simd_max = PH_SIMD_NONE;	// Widest level the CPU supports
+static int	ph_simd_level = PH_SIMD_NONE;	// Level in use
+static struct heap	*(*heap_simd_pairs)(struct heap *);	// Its pass, or NULL for none
+
+static void __attribute__((constructor))
+heap_simd_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		ph_simd_max = PH_SIMD_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		ph_simd_max = PH_SIMD_AVX2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		ph_simd_max = PH_SIMD_SSE42;
+	pheap_simd_level(ph_simd_max);
+} // heap_simd_init
+
+#endif
+
+// Compares two keys, calling the built-in key type compare functions directly
+static inline int
+heap_key_cmp(struct pheap *ph, void *a, void *b)
+{
+	int (*cmp)(void *, void *) = ph->cmp;
+
+	if (ph->prefix) {
+		uint64_t pa = ph->prefix(a), pb = ph->prefix(b);
+
+		if (pa != pb)
+			return (pa > pb ? 1 : -1);
+		return cmp(a, b);
+	}
+	if (cmp == heap_int_cmp)
+		return heap_int_cmp(a, b);
+	if (cmp == heap_u64_cmp)
+		return heap_u64_cmp(a, b);
+	if (cmp == heap_i64_cmp)
+		return heap_i64_cmp(a, b);
+	if (cmp == heap_double_cmp)
+		return heap_double_cmp(a, b);
+	if (cmp == heap_u32_cmp)
+		return heap_u32_cmp(a, b);
+	if (cmp == heap_strpfx_cmp)
+		return heap_strpfx_cmp(a, b);
+	return cmp(a, b);
+} // heap_key_cmp
+
+// Merges two root-type nodes, using the specialised merge for built-in key types
+static inline struct heap *
+heap_merge_key(struct pheap *ph, struct heap *a, struct heap *b)
+{
+	int (*cmp)(void *, void *) = ph->cmp;
+
+	if (ph->prefix)
+		return heap_merge(cmp, 1, a, b);
+	if (cmp == heap_int_cmp)
+		return heap_merge_int(a, b);
+	if (cmp == heap_u64_cmp)
+		return heap_merge_u64(a, b);
+	if (cmp == heap_i64_cmp)
+		return heap_merge_i64(a, b);
+	if (cmp == heap_double_cmp)
+		return heap_merge_double(a, b);
+	if (cmp == heap_u32_cmp)
+		return heap_merge_u32(a, b);
+	if (cmp == heap_strpfx_cmp)
+		return heap_merge_strpfx(a, b);
+	return heap_merge(cmp, 0, a, b);
+} // heap_merge_key
+
+// Runs the merge pairs pass of the given strategy, using the specialised pass for
+// the built-in key types
+static struct heap *
+heap_merge_pairs_pass(struct pheap *ph, int pairing, struct heap *r)
+{
+	int (*cmp)(void *, void *) = ph->cmp;
+
+	if (ph->prefix)
+		return heap_merge_pairs_with(cmp, 1, pairing, r);
+#ifdef __PH_SIMD
+	if ((pairing == PH_PAIR_CHUNKED) && heap_simd_pairs && ((cmp == heap_int_cmp) || (cmp == heap_i64_cmp)))
+		return heap_simd_pairs(r);
+#endif
+	if (cmp == heap_int_cmp)
+		return heap_merge_pairs_int(pairing, r);
+	if (cmp == heap_u64_cmp)
+		return heap_merge_pairs_u64(pairing, r);
+	if (cmp == heap_i64_cmp)
+		return heap_merge_pairs_i64(pairing, r);
+	if (cmp == heap_double_cmp)
+		return heap_merge_pairs_double(pairing, r);
+	if (cmp == heap_u32_cmp)
+		return heap_merge_pairs_u32(pairing, r);
+	if (cmp == heap_strpfx_cmp)
+		return heap_merge_pairs_strpfx(pairing, r);
+	return heap_merge_pairs_with(cmp, 0, pairing, r);
+} // heap_merge_pairs_pass
+
+// Wrapper that selects which merge pairs pass to use, from the heap's PH_PAIR_*
+// strategy and compile time options, and the specialised pass for built-in key types
 static struct heap *
-heap_merge_pairs(int (*cmp)(void *, void *), struct heap *r)
+heap_merge_pairs_as(struct pheap *ph, int pairing, struct heap *r)
 {
+#ifdef __PH_STATS
+	uint64_t merges = ph_pass_merges, hits = ph_pass_msn_hits, len;
+	struct heap *n;
+
 	if (r == NULL)
 		return NULL;
-#ifdef __PH_USE_RECURSIVE_MERGE
-	return heap_merge_pairs_recursive(cmp, r);
+	for (len = 0, n = r; n; n = n->next)
+		len++;
+	if (len > ph->stats.longest_chain)
+		ph->stats.longest_chain = len;
+	ph->stats.pair_passes++;
+	r = heap_merge_pairs_pass(ph, pairing, r);
+	merges = ph_pass_merges - merges;
+	ph->stats.comparisons += merges;
+	ph->stats.merges += merges;
+	ph->stats.msn_limit_hits += ph_pass_msn_hits - hits;
+	return r;
 #else
-	return heap_merge_pairs_iterative(cmp, r);
+	if (r == NULL)
+		return NULL;
+	return heap_merge_pairs_pass(ph, pairing, r);
 #endif
+} // heap_merge_pairs_as
+
+
+static inline struct heap *
+heap_merge_pairs(struct pheap *ph, struct heap *r)
+{
+	return heap_merge_pairs_as(ph, ph->opts & PH_PAIR_MASK, r);
 } // heap_merge_pairs
 
 
 // Unhook and free the root-type node that was passed to us. Return a new
 // root-type node determined from any children of the node passed to us
 static struct heap *
-heap_delete_min(int (*cmp)(void *, void *), struct heap *d, void (*kd_free)(void *, void *))
+heap_delete_min(struct pheap *ph, struct heap *d, void (*kd_free)(void *, void *))
 {
 	struct heap *nr;
 
@@ -149,26 +1021,25 @@ heap_delete_min(int (*cmp)(void *, void *), struct heap *d, void (*kd_free)(void
 	if (kd_free) {
 		kd_free(d->key, d->data);
 	}
-	memset(d, 0, sizeof(struct heap));
-	free(d);
+	heap_node_free(ph, d);
 
 	if (nr == NULL)
 		return NULL;
 
-	return heap_merge_pairs(cmp, nr);
+	return heap_merge_pairs(ph, nr);
 } // heap_delete_min
 
 
 // Detaches the node from the heap.  d MUST NOT be the root node
 static void
-heap_detach(int (*cmp)(void *, void *), register struct heap *d)
+heap_detach(struct pheap *ph, register struct heap *d)
 {
 	register struct heap *s;
 
 	// d->prev can never be NULL, since we are not the root node
 	// We can eliminate some checking for speed as a result
 	if (d->sub) {
-		s = heap_merge_pairs(cmp, d->sub);
+		s = heap_merge_pairs(ph, d->sub);
 		s->prev = d->prev;
 		if ((s->next = d->next))
 			s->next->prev = s;
@@ -186,74 +1057,387 @@ heap_detach(int (*cmp)(void *, void *), register struct heap *d)
 
 // Deletes a node from the given paired heap in-place.
 static void
-heap_delete(int (*cmp)(void *, void *), struct pheap *ph, struct heap *d, void (*kd_free)(void *, void *))
+heap_delete(struct pheap *ph, struct heap *d, void (*kd_free)(void *, void *))
 {
 	if (d == ph->root) { 	// We are the root node
-		ph->root = heap_delete_min(ph->cmp, ph->root, kd_free);
+		ph->root = heap_delete_min(ph, ph->root, kd_free);
 		return;
 	}
 
-	heap_detach(cmp, d);
+	heap_detach(ph, d);
 
 	if (kd_free) {
 		kd_free(d->key, d->data);
 	}
-	memset(d, 0, sizeof(struct heap));
-	free(d);
+	heap_node_free(ph, d);
 } // heap_delete
 
 
-// Inserts the user supplied key/data tuple into the paired heap.  Returns
-// an opaque pointer to the heap node that is associated with the user
-// data, that the user may pass to pheap_delete() later as required
-void *
-pheap_insert(void *oph, void *key, void *data)
+// Pairs up every pending insert along with the root in a single merge pairs
+// pass, and makes the result the new root.  See heap_settle() below
+static void
+heap_settle_pending(struct pheap *ph)
 {
-	struct pheap *ph = (struct pheap *)oph;
-	struct heap *n;
+	struct heap *r, *n;
+
+	// Take everything that producers have pushed so far in one go, and put
+	// it in front of the pending inserts
+	if ((ph->opts & PH_OPT_INBOX) && (r = __atomic_exchange_n(&ph->inbox, NULL, __ATOMIC_ACQUIRE))) {
+		for (n = r; n->next; n = n->next)
+			PH_STAT(ph, nodes, 1);
+		PH_STAT(ph, nodes, 1);
+		n->next = ph->pending;
+		ph->pending = r;
+	}
 
-	// First create the new node
-	n = (struct heap *)calloc(sizeof(struct heap), 1);
-	if (n == NULL)
-		return NULL;
+	r = ph->pending;
+	ph->pending = NULL;
+	if (r == NULL)
+		return;
+
+	// Auxiliary two-pass combines the inserts with multipass, and only then
+	// merges them into the main tree
+	if ((ph->opts & PH_PAIR_MASK) == PH_PAIR_AUXTWOPASS) {
+		r = heap_merge_pairs_as(ph, PH_PAIR_MULTIPASS, r);
+		if (ph->root) {
+			PH_STAT(ph, comparisons, 1);
+			PH_STAT(ph, merges, 1);
+		}
+		ph->root = heap_merge_key(ph, ph->root, r);
+		return;
+	}
+	if (ph->root) {
+		ph->root->next = r;
+		r = ph->root;
+	}
+	ph->root = heap_merge_pairs(ph, r);
+} // heap_settle_pending
+
+
+// Brings the heap up to date with any pending inserts, and anything waiting in
+// the inbox.  Must be called before anything looks at or modifies the structure
+// of the heap, other than inserts
+static inline void
+heap_settle(struct pheap *ph)
+{
+	if (ph->pending || ((ph->opts & PH_OPT_INBOX) && __atomic_load_n(&ph->inbox, __ATOMIC_RELAXED)))
+		heap_settle_pending(ph);
+} // heap_settle
+
+
+// Pushes a root-type node onto the heap's inbox.  Safe to call from any number
+// of threads at once, and never touches anything other than the inbox head
+static inline void
+heap_inbox_push(struct pheap *ph, struct heap *n)
+{
+	n->next = __atomic_load_n(&ph->inbox, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ph->inbox, &n->next, n, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+} // heap_inbox_push
+
+
+// Sets the key of a node, along with its key prefix if the heap is prefixed
+static inline void
+heap_set_key(struct pheap *ph, struct heap *n, void *key)
+{
 	n->key = key;
-	n->data = data;
+	if (ph->prefix)
+		HEAP_PFX(n) = ph->prefix(key);
+} // heap_set_key
+
+
+// Inserts an initialised root-type node into the heap.  With PH_OPT_INSBUF the
+// node just goes onto the pending list, and isn't paired until it's needed
+static inline void
+heap_insert(struct pheap *ph, struct heap *n)
+{
+	PH_STAT(ph, nodes, 1);
+	if (ph->opts & PH_OPT_INSBUF) {
+		n->next = ph->pending;
+		ph->pending = n;
+		return;
+	}
 
 	if (ph->root == NULL) {
 		ph->root = n;
-		return (void *)n;
+		return;
 	}
 
-	ph->root = heap_merge(ph->cmp, n, ph->root);
+	PH_STAT(ph, comparisons, 1);
+	PH_STAT(ph, merges, 1);
+	ph->root = heap_merge_key(ph, n, ph->root);
+} // heap_insert
 
-	return n;
-} // pheap_insert
 
-#ifdef __PH_USE_RECURSIVE_DESTROY
-
-// Much faster breadth-iterative recursive-sub tree destroy operation
-// May be stack memory sensitive for extremely deep trees, but these
-// are very unlikely to develop in regular operation
-// Recommend to use this, and only switch to the slower (but stack
-// memory conservative heap_delete_min()) if required
+// Moves the node at bheap[i] up the companion heap until its parent is no less
 static void
-pheap_destroy_recursive(struct heap *n, void (*kd_free)(void *, void *))
+heap_bound_up(struct pheap *ph, size_t i)
 {
-	struct heap *ns = NULL;	// Next scan pointer
-
-	while (n) {
-		ns = n->next;
-		pheap_destroy_recursive(n->sub, kd_free);
-		if (kd_free) {
-			kd_free(n->key, n->data);
-		}
-		memset(n, 0, sizeof(struct heap));
-		free(n);
-		n = ns;
+	struct heap **bh = ph->bheap, *n = bh[i];
+	size_t p;
+
+	for (; i > 0; i = p) {
+		p = (i - 1) >> 1;
+		if (heap_key_cmp(ph, bh[p]->key, n->key) >= 0)
+			break;
+		bh[i] = bh[p];
+		HEAP_BPOS(bh[i]) = i;
 	}
-} // pheap_destroy_recursive
+	bh[i] = n;
+	HEAP_BPOS(n) = i;
+} // heap_bound_up
 
-#endif
+
+// Moves the node at bheap[i] down the companion heap until no child is greater
+static void
+heap_bound_down(struct pheap *ph, size_t i)
+{
+	struct heap **bh = ph->bheap, *n = bh[i];
+	size_t c, cnt = ph->bcount;
+
+	while ((c = (i << 1) + 1) < cnt) {
+		if ((c + 1 < cnt) && (heap_key_cmp(ph, bh[c + 1]->key, bh[c]->key) > 0))
+			c++;
+		if (heap_key_cmp(ph, bh[c]->key, n->key) <= 0)
+			break;
+		bh[i] = bh[c];
+		HEAP_BPOS(bh[i]) = i;
+		i = c;
+	}
+	bh[i] = n;
+	HEAP_BPOS(n) = i;
+} // heap_bound_down
+
+
+// Takes a node that is leaving a bounded heap out of the companion heap
+static void
+heap_bound_remove(struct pheap *ph, struct heap *n)
+{
+	size_t i = HEAP_BPOS(n);
+
+	if (i >= --ph->bcount)
+		return;
+	n = ph->bheap[i] = ph->bheap[ph->bcount];
+	heap_bound_up(ph, i);
+	if (HEAP_BPOS(n) == i)
+		heap_bound_down(ph, i);
+} // heap_bound_remove
+
+
+// Inserts into a bounded heap.  Until the heap is full this is a normal insert
+// that also adds the node to the companion heap.  Once full, the new key is only
+// compared against the worst key, found at the top of the companion heap, and is
+// rejected straight away if it's no better.  Otherwise the worst node is cut out
+// of the heap and reused for the new key.  The evicted key and data are stored
+// into ekey and edata if they are non-NULL.  Returns the node, or NULL if the key
+// was rejected or memory ran out
+static struct heap *
+heap_bound_insert(struct pheap *ph, void *key, void *data, void **ekey, void **edata)
+{
+	struct heap *n;
+
+	if (ekey)
+		*ekey = NULL;
+	if (edata)
+		*edata = NULL;
+
+	if (ph->bcount == ph->bound) {
+		n = ph->bheap[0];
+		PH_STAT(ph, comparisons, 1);
+		if (heap_key_cmp(ph, key, n->key) >= 0)
+			return NULL;
+		if (ekey)
+			*ekey = n->key;
+		if (edata)
+			*edata = n->data;
+
+		if (n == ph->root)
+			ph->root = heap_merge_pairs(ph, n->sub);
+		else
+			heap_detach(ph, n);
+		n->next = n->prev = n->sub = NULL;
+		n->key = key;
+		n->data = data;
+		heap_bound_down(ph, 0);
+
+		if (ph->root) {
+			PH_STAT(ph, comparisons, 1);
+			PH_STAT(ph, merges, 1);
+		}
+		ph->root = heap_merge_key(ph, ph->root, n);
+		return n;
+	}
+
+	if ((n = heap_node_alloc(ph)) == NULL)
+		return NULL;
+	n->key = key;
+	n->data = data;
+	ph->bheap[ph->bcount] = n;
+	heap_bound_up(ph, ph->bcount++);
+	heap_insert(ph, n);
+	return n;
+} // heap_bound_insert
+
+
+// Inserts the user supplied key/data tuple into the paired heap.  Returns
+// an opaque pointer to the heap node that is associated with the user
+// data, that the user may pass to pheap_delete() later as required
+void *
+pheap_insert(void *oph, void *key, void *data)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n;
+	PH_LAT_START(start);
+
+	if (ph->bheap) {
+		n = heap_bound_insert(ph, key, data, NULL, NULL);
+	} else if ((n = heap_node_alloc(ph))) {	// First create the new node
+		heap_set_key(ph, n, key);
+		n->data = data;
+
+		heap_insert(ph, n);
+	}
+
+	PH_LAT_END(ph, PH_LAT_INSERT, start);
+	return n;
+} // pheap_insert
+
+
+// Inserts n key/data tuples into the paired heap in one go.  The new nodes are
+// paired up amongst themselves and with the root in a single merge pairs pass
+// (or just added to the pending list with PH_OPT_INSBUF).  If data is NULL the
+// nodes get NULL data.  If handles is non-NULL, it is filled in with the nodes
+// Returns the number of tuples inserted, which is less than n if out of memory
+size_t
+pheap_insert_batch(void *oph, void **keys, void **data, size_t n, void **handles)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *hn, *first = NULL, *last = NULL;
+	size_t i;
+
+	if (ph == NULL)
+		return 0;
+
+	// Each tuple in turn is either kept, or rejected, by a bounded heap
+	if (ph->bheap) {
+		size_t kept = 0;
+
+		for (i = 0; i < n; i++) {
+			hn = heap_bound_insert(ph, keys[i], data ? data[i] : NULL, NULL, NULL);
+			if (handles)
+				handles[i] = hn;
+			kept += (hn != NULL);
+		}
+		return kept;
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((hn = heap_node_alloc(ph)) == NULL)
+			break;
+		heap_set_key(ph, hn, keys[i]);
+		hn->data = data ? data[i] : NULL;
+		if (handles)
+			handles[i] = hn;
+		if (last)
+			last->next = hn;
+		else
+			first = hn;
+		last = hn;
+	}
+	if (first == NULL)
+		return 0;
+
+	PH_STAT(ph, nodes, i);
+	last->next = ph->pending;
+	ph->pending = first;
+	if (!(ph->opts & PH_OPT_INSBUF))
+		heap_settle_pending(ph);
+	return i;
+} // pheap_insert_batch
+
+
+// Inserts a caller owned node into the heap with the given key.  The node's
+// data pointer is left as it is, and no memory is allocated.  Only heaps made
+// with PH_OPT_INTRUSIVE take caller owned nodes, as any other heap would hand
+// the node to free() or its pool when it leaves.  Returns 1 on success, or 0
+int
+pheap_insert_node(void *oph, struct pheap_node *opn, void *key)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n = (struct heap *)opn;
+	PH_LAT_START(start);
+
+	if ((ph == NULL) || (n == NULL) || !(ph->opts & PH_OPT_INTRUSIVE))
+		return 0;
+	n->next = n->prev = n->sub = NULL;
+	n->key = key;
+
+	heap_insert(ph, n);
+	PH_LAT_END(ph, PH_LAT_INSERT, start);
+	return 1;
+} // pheap_insert_node
+
+// Inserts a key/data tuple into a PH_OPT_INBOX heap from any thread, without
+// taking a lock.  The node is allocated straight from the system allocator, as
+// pools and node caches belong to the consumer thread.  Returns the new node,
+// or NULL if out of memory or the heap has pooled or caller owned nodes
+void *
+pheap_inbox_insert(void *oph, void *key, void *data)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n;
+
+	if ((ph->opts & (PH_OPT_INBOX | PH_OPT_POOL | PH_OPT_INTRUSIVE)) != PH_OPT_INBOX)
+		return NULL;
+	if ((n = (struct heap *)calloc(ph->nodesize, 1)) == NULL)
+		return NULL;
+	heap_set_key(ph, n, key);
+	n->data = data;
+	heap_inbox_push(ph, n);
+	return n;
+} // pheap_inbox_insert
+
+
+// Pushes a caller owned node onto a PH_OPT_INBOX heap from any thread, without
+// taking a lock.  Without an inbox the node would never be seen, and without
+// PH_OPT_INTRUSIVE it would be freed, so both are needed.  Returns 1, or 0
+int
+pheap_inbox_push(void *oph, struct pheap_node *opn, void *key)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n = (struct heap *)opn;
+	const int need = PH_OPT_INBOX | PH_OPT_INTRUSIVE;
+
+	if ((ph == NULL) || (n == NULL) || ((ph->opts & need) != need))
+		return 0;
+	n->prev = n->sub = NULL;
+	n->key = key;
+	heap_inbox_push(ph, n);
+	return 1;
+} // pheap_inbox_push
+
+// Walks the tree rooted at n, passing each node's key and data to kd_free() if
+// it isn't NULL, and releasing the nodes as well if release is set.  The walk
+// uses no stack, as each node's children are put in front of its siblings as
+// the node is left behind.  Every node is only ever walked past twice
+static void
+heap_destroy_walk(struct pheap *ph, struct heap *n, int release, void (*kd_free)(void *, void *))
+{
+	struct heap *nn, *l;
+
+	while (n) {
+		if ((nn = n->sub)) {
+			for (l = nn; l->next; l = l->next);
+			l->next = n->next;
+		} else {
+			nn = n->next;
+		}
+		if (kd_free)
+			kd_free(n->key, n->data);
+		if (release)
+			heap_node_free(ph, n);
+		n = nn;
+	}
+} // heap_destroy_walk
 
 // Releases an entire paired heap tree from memory, and the anchor node as well
 // oph must not be used afterwards (and its contents are zeroed out)
@@ -265,12 +1449,34 @@ void
 pheap_destroy(void *oph, void (*kd_free)(void *, void *))
 {
 	struct pheap *ph = (struct pheap *)oph;
+	int release;
 
 	if (ph) {
-#ifdef __PH_USE_RECURSIVE_DESTROY
-		pheap_destroy_recursive(ph->root, kd_free);
-#else
-		while((ph->root = heap_delete_min(ph->cmp, ph->root, kd_free)));
+		PH_LAT_START(start);
+
+		heap_settle(ph);
+
+		// No need to keep the companion heap in order while nodes go
+		if (ph->bheap) {
+			free(ph->bheap);
+			ph->bheap = NULL;
+		}
+
+		// Pooled nodes all go back with their slabs, so only visit
+		// them if the caller needs to see every key and data, or if a
+		// compaction still has old nodes from malloc to be freed
+		release = !(ph->opts & PH_OPT_POOL) || (ph->compact && !ph->compact->pooled);
+		if ((release && !(ph->opts & PH_OPT_INTRUSIVE)) || kd_free)
+			heap_destroy_walk(ph, ph->root, release, kd_free);
+		heap_compact_end(ph);
+		if (ph->opts & PH_OPT_POOL)
+			heap_pool_release(&ph->pool);
+		if (ph->map)
+			munmap(ph->map, ph->maplen);
+#ifdef __PH_LATENCY
+		heap_lat_record(ph->lat, PH_LAT_DESTROY, start);
+		heap_lat_fold(ph->lat);
+		free(ph->lat);
 #endif
 		memset(ph, 0, sizeof(struct pheap));
 		free(ph);
@@ -278,6 +1484,43 @@ pheap_destroy(void *oph, void (*kd_free)(void *, void *))
 } // pheap_destroy
 
 
+// Deletes every node from the heap, leaving it empty and ready for reuse
+void
+pheap_clear(void *oph, void (*kd_free)(void *, void *))
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap **bheap;
+	int release;
+
+	if (ph == NULL)
+		return;
+	heap_settle(ph);
+
+	// The companion heap of a bounded heap is simply emptied
+	bheap = ph->bheap;
+	ph->bheap = NULL;
+	ph->bcount = 0;
+
+	release = !(ph->opts & PH_OPT_POOL) || (ph->compact && !ph->compact->pooled);
+	if ((release && !(ph->opts & PH_OPT_INTRUSIVE)) || kd_free)
+		heap_destroy_walk(ph, ph->root, release, kd_free);
+	heap_compact_end(ph);
+	if (ph->opts & PH_OPT_ARENA)
+		heap_pool_rewind(&ph->pool);
+	else if (ph->opts & PH_OPT_POOL)
+		heap_pool_release(&ph->pool);
+	ph->root = NULL;
+	ph->bheap = bheap;
+#ifdef __PH_STATS
+	ph->stats.nodes = 0;
+#endif
+
+	// A bounded heap always keeps room for all of its nodes
+	if (bheap)
+		pheap_reserve(ph, ph->bound);
+} // pheap_clear
+
+
 void *
 pheap_get_key(void *ohn)
 {
@@ -304,6 +1547,7 @@ pheap_get_min_node(void *oph, void **key, void **data)
 	struct pheap *ph = (struct pheap *)oph;
 
 	if (ph) {
+		heap_settle(ph);
 		if (ph->root) {
 			if (key)
 				*key = ph->root->key;
@@ -327,10 +1571,13 @@ pheap_get_min_node(void *oph, void **key, void **data)
 int
 pheap_delete_min(void *oph, void **key, void **data)
 {
+	PH_LAT_START(start);
+
 	if (pheap_get_min_node(oph, key, data)) {
 		struct pheap *ph = (struct pheap *)oph;
 
-		ph->root = heap_delete_min(ph->cmp, ph->root, NULL);
+		ph->root = heap_delete_min(ph, ph->root, NULL);
+		PH_LAT_END(ph, PH_LAT_DELETE_MIN, start);
 		return 1;
 	}
 	return 0;
@@ -346,6 +1593,7 @@ pheap_delete(void *oph, void *opd, void **key, void **data)
 {
 	register struct pheap *ph = (struct pheap *)oph;
 	register struct heap *pd = (struct heap *)opd;
+	PH_LAT_START(start);
 
 	// Don't try to delete a NULL node
 	if (pd == NULL)
@@ -355,28 +1603,176 @@ pheap_delete(void *oph, void *opd, void **key, void **data)
 	if (data)
 		*data = pd->data;
 	// Don't try to delete from an empty or non-existent heap
-	if ((ph == NULL) || (ph->root == NULL))
+	if (ph == NULL)
+		return 0;
+	heap_settle(ph);
+	if (ph->root == NULL)
 		return 0;
 
-	heap_delete(ph->cmp, ph, pd, NULL);
+	heap_delete(ph, pd, NULL);
+	PH_LAT_END(ph, PH_LAT_DELETE, start);
 	return 1;
 } // pheap_delete
 
 
-// Changes the key of the given node that is a member of the given heap.
+// Deletes up to k of the least nodes from the heap, in order, stopping early at
+// the first key greater than limit if until is set.  The keys and data of the
+// deleted nodes are stored into keys[] and data[] when they are non-NULL.  The
+// whole run is done under one settle, and the deleted nodes are all freed in
+// one go at the end.  Returns the number of nodes deleted
+static size_t
+heap_delete_run(struct pheap *ph, size_t k, int until, void *limit, void **keys, void **data)
+{
+	struct heap *r, *first = NULL, *last = NULL;
+	uint64_t lpfx = 0;
+	size_t i;
+	int res;
+
+	heap_settle(ph);
+	if (until && ph->prefix)
+		lpfx = ph->prefix(limit);
+
+	for (i = 0; (i < k) && (r = ph->root); i++) {
+		if (until) {
+			if (ph->prefix && (HEAP_PFX(r) != lpfx))
+				res = (HEAP_PFX(r) > lpfx) ? 1 : -1;
+			else if (ph->prefix)
+				res = ph->cmp(r->key, limit);
+			else
+				res = heap_key_cmp(ph, r->key, limit);
+			PH_STAT(ph, comparisons, 1);
+			if (res > 0)
+				break;
+		}
+		if (keys)
+			keys[i] = r->key;
+		if (data)
+			data[i] = r->data;
+		ph->root = heap_merge_pairs(ph, r->sub);
+		r->next = first;
+		first = r;
+		if (last == NULL)
+			last = r;
+	}
+	if (first)
+		heap_node_free_chain(ph, first, last, i);
+	return i;
+} // heap_delete_run
+
+
+// Deletes up to k of the least nodes from the given heap, in order
+// Returns the number of nodes deleted
+size_t
+pheap_delete_min_n(void *oph, size_t k, void **keys, void **data)
+{
+	struct pheap *ph = (struct pheap *)oph;
+
+	if (ph == NULL)
+		return 0;
+	return heap_delete_run(ph, k, 0, NULL, keys, data);
+} // pheap_delete_min_n
+
+
+// Deletes up to max of the least nodes from the given heap, in order, so long
+// as their keys are less than or equal to limit.  Returns the number deleted
+size_t
+pheap_delete_until(void *oph, void *limit, void **keys, void **data, size_t max)
+{
+	struct pheap *ph = (struct pheap *)oph;
+
+	if (ph == NULL)
+		return 0;
+	return heap_delete_run(ph, max, 1, limit, keys, data);
+} // pheap_delete_until
+
+
+// Inserts into a bounded heap, handing back the key and data of any node that
+// had to be evicted to make room.  Returns the node, or NULL if rejected
+void *
+pheap_insert_evict(void *oph, void *key, void *data, void **ekey, void **edata)
+{
+	struct pheap *ph = (struct pheap *)oph;
+
+	if ((ph == NULL) || (ph->bheap == NULL))
+		return NULL;
+	return heap_bound_insert(ph, key, data, ekey, edata);
+} // pheap_insert_evict
+
+
+// Returns handle to the greatest node in a bounded heap
+// Sets key and data if they are non-NULL
+void *
+pheap_get_worst_node(void *oph, void **key, void **data)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n = NULL;
+
+	if (ph && ph->bheap && ph->bcount)
+		n = ph->bheap[0];
+	if (key)
+		*key = n ? n->key : NULL;
+	if (data)
+		*data = n ? n->data : NULL;
+	return n;
+} // pheap_get_worst_node
+
+
+// Removes the least node from the given heap and hands it back to the caller
+// Returns NULL if the heap was empty
+struct pheap_node *
+pheap_delete_min_node(void *oph)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n;
+	PH_LAT_START(start);
+
+	if (ph == NULL)
+		return NULL;
+	heap_settle(ph);
+	if ((n = ph->root) == NULL)
+		return NULL;
+
+	ph->root = heap_delete_min(ph, n, NULL);
+	PH_LAT_END(ph, PH_LAT_DELETE_MIN, start);
+	return (struct pheap_node *)n;
+} // pheap_delete_min_node
+
+
+// Removes a caller owned node from the given heap in-place
+// Returns 1 if the node was removed, and 0 on invalid parameters
+int
+pheap_delete_node(void *oph, struct pheap_node *opn)
+{
+	return pheap_delete(oph, opn, NULL, NULL);
+} // pheap_delete_node
+
+
+// Changes the key of a caller owned node that is a member of the given heap
 void
-pheap_change_key(void *oph, void *opd, void *newkey)
+pheap_change_key_node(void *oph, struct pheap_node *opn, void *newkey)
+{
+	pheap_change_key(oph, opn, newkey);
+} // pheap_change_key_node
+
+
+// Changes the key of the node pd, which is a member of the non-empty settled heap
+static void
+heap_change_key(register struct pheap *ph, register struct heap *pd, void *newkey)
 {
-	register struct pheap *ph = (struct pheap *)oph;
-	register struct heap *pd = (struct heap *)opd;
 	register int res;
 
-	// Don't try to modify an empty or non-existent heap
-	// Don't try to modify a NULL node
-	if ((oph == NULL) || (opd == NULL) || (ph->root == NULL))
-		return;
+	if (ph->prefix) {
+		uint64_t pfx = ph->prefix(newkey);
 
-	res = ph->cmp(newkey, pd->key);		// Record the key change type
+		if (pfx != HEAP_PFX(pd))
+			res = (pfx > HEAP_PFX(pd) ? 1 : -1);
+		else
+			res = ph->cmp(newkey, pd->key);
+		HEAP_PFX(pd) = pfx;
+	} else {
+		res = heap_key_cmp(ph, newkey, pd->key);	// Record the key change type
+	}
+	PH_STAT(ph, comparisons, 1);
 
 	// Set key to newkey, in case the user modifies the memory
 	// presently associated with pd->key after return
@@ -395,19 +1791,851 @@ pheap_change_key(void *oph, void *opd, void *newkey)
 			return;
 
 		// Detach the root node and update the root pointer with new root
-		ph->root = heap_merge_pairs(ph->cmp, pd->sub);
+		ph->root = heap_merge_pairs(ph, pd->sub);
 	} else {
 		// Increase or decrease key, doesn't matter, it's the same operation
-		heap_detach(ph->cmp, pd);		// detach the node from the heap
+		heap_detach(ph, pd);			// detach the node from the heap
 	}
 
 	pd->next = pd->prev = pd->sub = NULL;		// pd references nothing else now
 
 	// Merge pd with the root node
-	ph->root = heap_merge(ph->cmp, ph->root, pd);
+	if (ph->root) {
+		PH_STAT(ph, comparisons, 1);
+		PH_STAT(ph, merges, 1);
+	}
+	ph->root = heap_merge_key(ph, ph->root, pd);
+
+	// A bounded heap's companion heap has to follow the key change too
+	if (ph->bheap) {
+		if (res > 0)
+			heap_bound_up(ph, HEAP_BPOS(pd));
+		else
+			heap_bound_down(ph, HEAP_BPOS(pd));
+	}
+} // heap_change_key
+
+
+// Changes the key of the given node that is a member of the given heap.
+void
+pheap_change_key(void *oph, void *opd, void *newkey)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	PH_LAT_START(start);
+
+	// Don't try to modify an empty or non-existent heap
+	// Don't try to modify a NULL node
+	if ((oph == NULL) || (opd == NULL))
+		return;
+	heap_settle(ph);
+	if (ph->root == NULL)
+		return;
+
+	heap_change_key(ph, (struct heap *)opd, newkey);
+	PH_LAT_END(ph, PH_LAT_CHANGE_KEY, start);
 } // pheap_change_key
 
 
+// Moves every node in src into dst in constant time, by merging the two roots
+// Returns 1 on success, and 0 if the heaps don't use the same compare function
+// or don't allocate their nodes the same way
+int
+pheap_meld(void *odst, void *osrc)
+{
+	struct pheap *dst = (struct pheap *)odst;
+	struct pheap *src = (struct pheap *)osrc;
+	const int amask = PH_OPT_POOL | PH_OPT_INTRUSIVE;
+	struct heap *n;
+
+	if ((dst == NULL) || (src == NULL) || (dst == src))
+		return 0;
+	if (dst->bheap || src->bheap || dst->compact || src->compact)
+		return 0;
+	// Keys of a restored heap may point into its snapshot, which goes with it
+	if (src->map)
+		return 0;
+	if ((dst->cmp != src->cmp) || (dst->prefix != src->prefix) || ((dst->opts & amask) != (src->opts & amask)))
+		return 0;
+
+	// The pool's slabs, and so src's nodes, now belong to dst.  Only one of
+	// the two slabs being handed out from can stay that way, so the one with
+	// fewer nodes left goes onto the free lists.  Whichever free list is the
+	// shorter is then walked to join them together
+	if (src->opts & PH_OPT_POOL) {
+		struct heap_pool *dp = &dst->pool, *sp = &src->pool;
+		struct heap_slab *sl;
+		struct heap *bump, *bend;
+
+		if (((char *)sp->bend - (char *)sp->bump) > ((char *)dp->bend - (char *)dp->bump)) {
+			bump = dp->bump;
+			bend = dp->bend;
+			dp->bump = sp->bump;
+			dp->bend = sp->bend;
+			sp->bump = bump;
+			sp->bend = bend;
+		}
+		heap_pool_spill(sp);
+		if ((sl = sp->slabs)) {
+			while (sl->next)
+				sl = sl->next;
+			sl->next = dp->slabs;
+			dp->slabs = sp->slabs;
+		}
+		if (sp->nfree > dp->nfree) {
+			n = dp->free;
+			dp->free = sp->free;
+			sp->free = n;
+		}
+		while ((n = sp->free)) {
+			sp->free = n->next;
+			n->next = dp->free;
+			dp->free = n;
+		}
+		dp->nfree += sp->nfree;
+		dp->ncap += sp->ncap;
+		sp->ncap = 0;
+		sp->slabs = NULL;
+		sp->bump = sp->bend = NULL;
+		sp->nfree = 0;
+	}
+
+	// A buffered dst just takes src's root as another pending insert
+	heap_settle(src);
+	if ((n = src->root)) {
+		if (dst->opts & PH_OPT_INSBUF) {
+			n->next = dst->pending;
+			dst->pending = n;
+		} else {
+			if (dst->root) {
+				PH_STAT(dst, comparisons, 1);
+				PH_STAT(dst, merges, 1);
+			}
+			dst->root = heap_merge_key(dst, dst->root, n);
+		}
+	}
+#ifdef __PH_STATS
+	dst->stats.nodes += src->stats.nodes;
+	src->stats.nodes = 0;
+#endif
+	src->root = src->pending = NULL;
+	return 1;
+} // pheap_meld
+
+
+// Fills in out with the heap's statistics counters
+// Returns 1 on success, or 0 (with out zeroed) if they weren't compiled in
+int
+pheap_stats(void *oph, struct pheap_stats *out)
+{
+	memset(out, 0, sizeof(struct pheap_stats));
+#ifdef __PH_STATS
+	struct pheap *ph = (struct pheap *)oph;
+
+	if (ph) {
+		struct heap *n;
+
+		*out = ph->stats;
+		out->root_children = 0;
+		for (n = ph->root ? ph->root->sub : NULL; n; n = n->next)
+			out->root_children++;
+		return 1;
+	}
+#else
+	(void)oph;
+#endif
+	return 0;
+} // pheap_stats
+
+
+// Zeroes the heap's statistics event counters.  The node count is kept
+void
+pheap_stats_reset(void *oph)
+{
+#ifdef __PH_STATS
+	struct pheap *ph = (struct pheap *)oph;
+	uint64_t nodes;
+
+	if (ph) {
+		nodes = ph->stats.nodes;
+		memset(&ph->stats, 0, sizeof(struct pheap_stats));
+		ph->stats.nodes = nodes;
+	}
+#else
+	(void)oph;
+#endif
+} // pheap_stats_reset
+
+
+// Fills in out with the latency histograms of the heap, or of all destroyed heaps
+// Returns 1 on success, or 0 (with out zeroed) if they weren't compiled in
+int
+pheap_latency_snapshot(void *oph, struct pheap_latency *out)
+{
+#ifdef __PH_LATENCY
+	struct pheap *ph = (struct pheap *)oph;
+#endif
+
+	memset(out, 0, sizeof(struct pheap_latency));
+#ifdef __PH_LATENCY
+	if (ph == NULL) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		*out = ph_lat_all;
+		return 1;
+	}
+	if (ph->lat)
+		*out = *ph->lat;
+	return 1;
+#else
+	(void)oph;
+	return 0;
+#endif
+} // pheap_latency_snapshot
+
+
+// Zeroes the latency histograms of the heap, or of all destroyed heaps
+void
+pheap_latency_reset(void *oph)
+{
+#ifdef __PH_LATENCY
+	struct pheap *ph = (struct pheap *)oph;
+
+	if (ph == NULL)
+		memset(&ph_lat_all, 0, sizeof(struct pheap_latency));
+	else if (ph->lat)
+		memset(ph->lat, 0, sizeof(struct pheap_latency));
+#else
+	(void)oph;
+#endif
+} // pheap_latency_reset
+
+
+// Returns the lowest latency that falls into bucket i.  See heap_lat_bucket()
+uint64_t
+pheap_latency_bucket_ns(unsigned i)
+{
+	if (i < 4)
+		return i;
+	if (i >= 252)
+		return UINT64_MAX;
+	return (uint64_t)(4 + (i & 3)) << (i / 4 - 1);
+} // pheap_latency_bucket_ns
+
+
+// Returns the latency that pct percent of the calls to op came in under
+uint64_t
+pheap_latency_percentile(const struct pheap_latency *lat, int op, double pct)
+{
+	uint64_t want, seen = 0, top;
+	double rank;
+	unsigned i;
+
+	if ((op < 0) || (op >= PH_LAT_OPS) || (lat->count[op] == 0))
+		return 0;
+	// The rank of the call wanted, rounded up
+	rank = lat->count[op] * pct / 100.0;
+	if ((want = (uint64_t)rank) < rank)
+		want++;
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < PH_LAT_BUCKETS; i++) {
+		if ((seen += lat->hist[op][i]) >= want)
+			break;
+	}
+	top = (i + 1 < PH_LAT_BUCKETS) ? pheap_latency_bucket_ns(i + 1) - 1 : UINT64_MAX;
+	return (top < lat->max_ns[op]) ? top : lat->max_ns[op];
+} // pheap_latency_percentile
+
+
+// Steps to the next node of a pre-order walk over the tree that n is part of,
+// keeping track of the depth.  Returns NULL once the whole tree is walked.  No
+// memory is used, as the parent of a sibling chain is the prev of its first
+// node, so the walk is stack safe no matter what shape the tree is in
+static inline struct heap *
+heap_walk_next(register struct heap *n, size_t *depth)
+{
+	if (n->sub) {
+		(*depth)++;
+		return n->sub;
+	}
+	while (n->next == NULL) {
+		// Back up to the first sibling, whose prev is the parent
+		while (n->prev && (n->prev->sub != n))
+			n = n->prev;
+		if ((n = n->prev) == NULL)
+			return NULL;
+		(*depth)--;
+	}
+	return n->next;
+} // heap_walk_next
+
+
+// Walks the whole heap, counting nodes by depth and by number of children
+// Counts beyond the last of the nbuckets buckets are added into the last one
+// Either histogram may be NULL.  Returns the number of nodes in the heap
+size_t
+pheap_stats_shape(void *oph, size_t *depth_hist, size_t *degree_hist, size_t nbuckets)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n, *c;
+	size_t count = 0, depth = 0, deg;
+
+	if (depth_hist)
+		memset(depth_hist, 0, nbuckets * sizeof(size_t));
+	if (degree_hist)
+		memset(degree_hist, 0, nbuckets * sizeof(size_t));
+	if ((ph == NULL) || (nbuckets == 0))
+		return 0;
+	heap_settle(ph);
+
+	for (n = ph->root; n; n = heap_walk_next(n, &depth)) {
+		count++;
+		if (depth_hist)
+			depth_hist[(depth < nbuckets) ? depth : nbuckets - 1]++;
+		if (degree_hist) {
+			for (deg = 0, c = n->sub; c; c = c->next)
+				deg++;
+			degree_hist[(deg < nbuckets) ? deg : nbuckets - 1]++;
+		}
+	}
+	return count;
+} // pheap_stats_shape
+
+
+size_t
+pheap_foreach(void *oph, int (*fn)(void *opn, void *key, void *data, void *ctx), void *ctx)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *n;
+	size_t count = 0, depth = 0;
+
+	if ((ph == NULL) || (fn == NULL))
+		return 0;
+	heap_settle(ph);
+
+	for (n = ph->root; n; n = heap_walk_next(n, &depth)) {
+		count++;
+		if (fn(n, n->key, n->data, ctx))
+			break;
+	}
+	return count;
+} // pheap_foreach
+
+
+// A sorted cursor holds a binary min heap of the frontier of nodes that have
+// not been read yet, but whose parents have been
+struct heap_cursor {
+	struct pheap	*ph;
+	int		(*cmp)(void *, void *);	// The heap's compare function
+	int		pfx;			// Set if the heap's nodes are prefixed
+	struct heap	**fh;			// The frontier
+	size_t		cnt, cap;
+	int		nomem;			// Set if the last read ran out of memory
+};
+
+
+// Makes room in the cursor's frontier for at least need nodes
+static int
+heap_cursor_grow(struct heap_cursor *c, size_t need)
+{
+	struct heap **fh;
+	size_t cap = c->cap;
+
+	while (cap < need)
+		cap *= 2;
+	if (cap == c->cap)
+		return 1;
+	if ((fh = (struct heap **)realloc(c->fh, cap * sizeof(struct heap *))) == NULL)
+		return 0;
+	c->fh = fh;
+	c->cap = cap;
+	return 1;
+} // heap_cursor_grow
+
+
+// Adds a node to the cursor's frontier, which must have room for it
+static void
+heap_cursor_push(struct heap_cursor *c, struct heap *n)
+{
+	size_t i, p;
+
+	for (i = c->cnt++; i > 0; i = p) {
+		p = (i - 1) >> 1;
+		if (heap_node_cmp(c->cmp, c->pfx, c->fh[p], n) <= 0)
+			break;
+		c->fh[i] = c->fh[p];
+	}
+	c->fh[i] = n;
+} // heap_cursor_push
+
+
+// Removes the least node from the cursor's frontier
+static struct heap *
+heap_cursor_pop(struct heap_cursor *c)
+{
+	struct heap **fh = c->fh, *min, *n;
+	size_t i = 0, k;
+
+	if (c->cnt == 0)
+		return NULL;
+	min = fh[0];
+	n = fh[--c->cnt];
+	while ((k = (i << 1) + 1) < c->cnt) {
+		if ((k + 1 < c->cnt) && (heap_node_cmp(c->cmp, c->pfx, fh[k + 1], fh[k]) < 0))
+			k++;
+		if (heap_node_cmp(c->cmp, c->pfx, fh[k], n) >= 0)
+			break;
+		fh[i] = fh[k];
+		i = k;
+	}
+	fh[i] = n;
+	return min;
+} // heap_cursor_pop
+
+
+void *
+pheap_cursor_open(void *oph)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap_cursor *c;
+
+	if (ph == NULL)
+		return NULL;
+	if ((c = (struct heap_cursor *)calloc(sizeof(struct heap_cursor), 1)) == NULL)
+		return NULL;
+	c->ph = ph;
+	c->cmp = ph->cmp;
+	c->pfx = (ph->prefix != NULL);
+	c->cap = 64;
+	if ((c->fh = (struct heap **)malloc(c->cap * sizeof(struct heap *))) == NULL) {
+		free(c);
+		return NULL;
+	}
+	heap_settle(ph);
+	if (ph->root)
+		heap_cursor_push(c, ph->root);
+	return c;
+} // pheap_cursor_open
+
+
+void *
+pheap_cursor_next(void *cur, void **key, void **data)
+{
+	struct heap_cursor *c = (struct heap_cursor *)cur;
+	struct heap *n = NULL, *s;
+	size_t kids = 0;
+
+	// Every child of a node is at least as great as it, so the children only
+	// need to be looked at once it has been read.  The siblings are in no
+	// order amongst themselves, so all of them go into the frontier, and the
+	// heap itself is never touched.  Room for them is made before the node is
+	// taken off the frontier, so running out of memory loses nothing
+	if (c && c->cnt) {
+		for (s = c->fh[0]->sub; s; s = s->next)
+			kids++;
+		c->nomem = !heap_cursor_grow(c, c->cnt - 1 + kids);
+		if (!c->nomem) {
+			n = heap_cursor_pop(c);
+			for (s = n->sub; s; s = s->next)
+				heap_cursor_push(c, s);
+		}
+	}
+	if (key)
+		*key = n ? n->key : NULL;
+	if (data)
+		*data = n ? n->data : NULL;
+	return n;
+} // pheap_cursor_next
+
+
+int
+pheap_cursor_failed(void *cur)
+{
+	struct heap_cursor *c = (struct heap_cursor *)cur;
+
+	return c ? c->nomem : 0;
+} // pheap_cursor_failed
+
+
+void
+pheap_cursor_close(void *cur)
+{
+	struct heap_cursor *c = (struct heap_cursor *)cur;
+
+	if (c == NULL)
+		return;
+	free(c->fh);
+	free(c);
+} // pheap_cursor_close
+
+
+// Starts a compaction run, moving the heap's pool aside and starting a new one
+// with a slab big enough for every node.  A heap that isn't pooled is walked to
+// count its nodes, and becomes a pooled heap.  Returns 0 if out of memory
+static int
+heap_compact_start(struct pheap *ph)
+{
+	struct heap_compact *c;
+	struct heap_pool *pool = &ph->pool;
+	struct heap *n;
+	size_t live = 0, depth = 0, want;
+
+	if ((c = (struct heap_compact *)calloc(sizeof(struct heap_compact), 1)) == NULL)
+		return 0;
+	if (ph->opts & PH_OPT_POOL) {
+		live = pool->ncap - pool->nfree - ((char *)pool->bend - (char *)pool->bump) / pool->size;
+		c->old = *pool;
+		c->pooled = 1;
+	} else {
+		for (n = ph->root; n; n = heap_walk_next(n, &depth))
+			live++;
+	}
+
+	// Leave some room for inserts made between steps.  A bounded heap keeps
+	// room for all of its nodes, as pheap_create_bounded() reserved for it
+	want = live + live / 16;
+	if (ph->bheap && (want < ph->bound))
+		want = ph->bound;
+	memset(pool, 0, sizeof(struct heap_pool));
+	pool->size = ph->nodesize;
+	pool->nslab = PH_SLAB_MIN;
+	if (!heap_pool_grow(pool, want)) {
+		*pool = c->old;
+		free(c);
+		return 0;
+	}
+	c->slab = pool->slabs;
+	c->left = live;
+	ph->compact = c;
+	ph->opts |= PH_OPT_POOL;
+	return 1;
+} // heap_compact_start
+
+
+// Moves an old node into the next free node of the new pool, and points
+// everything that pointed at it to its new place.  Returns the moved node,
+// or NULL if out of memory
+static struct heap *
+heap_compact_move(struct pheap *ph, struct heap *n, void (*relocate)(void *, void *, void *))
+{
+	struct heap_pool *pool = &ph->pool;
+	struct heap *m;
+
+	// Take the next node in order, unless inserts have used them all up
+	if (pool->bump < pool->bend) {
+		m = pool->bump;
+		pool->bump = (struct heap *)((char *)m + pool->size);
+	} else if ((m = heap_node_alloc(ph)) == NULL) {
+		return NULL;
+	}
+	memcpy(m, n, ph->nodesize);
+	if (n->prev == NULL)
+		ph->root = m;
+	else if (n->prev->sub == n)
+		n->prev->sub = m;
+	else
+		n->prev->next = m;
+	if (n->next)
+		n->next->prev = m;
+	if (n->sub)
+		n->sub->prev = m;
+	if (ph->bheap)
+		ph->bheap[HEAP_BPOS(m)] = m;
+	if (relocate)
+		relocate(n, m, m->data);
+
+	ph->compact->left--;
+	if (!ph->compact->pooled)
+		free(n);
+	return m;
+} // heap_compact_move
+
+
+size_t
+pheap_compact_step(void *oph, size_t budget, void (*relocate)(void *oldh, void *newh, void *data))
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap_compact *c;
+	struct heap *n;
+	size_t depth = 0;
+	int top = 0;
+
+	if ((ph == NULL) || (ph->opts & (PH_OPT_INTRUSIVE | PH_OPT_INBOX)))
+		return 0;
+	heap_settle(ph);
+	if ((ph->compact == NULL) && ((ph->root == NULL) || !heap_compact_start(ph)))
+		return 0;
+	c = ph->compact;
+
+	// Carry on the walk from where the last step got to.  Changes made to
+	// the heap in between may have put some old nodes behind that point,
+	// which are picked up by walking the heap again from the top.  Nothing
+	// changes during a step, so a second walk from the top finds nothing
+	n = c->pos ? heap_walk_next(c->pos, &depth) : NULL;
+	while (c->left && budget) {
+		if (n == NULL) {
+			if (top++) {
+				c->left = 0;
+				break;
+			}
+			n = ph->root;
+			continue;
+		}
+		if (!heap_compact_owns(ph, n) && ((n = heap_compact_move(ph, n, relocate)) == NULL))
+			return c->left;
+		c->pos = n;
+		n = heap_walk_next(n, &depth);
+		budget--;
+	}
+	if (c->left)
+		return c->left;
+	heap_compact_end(ph);
+	return 0;
+} // pheap_compact_step
+
+
+int
+pheap_compact(void *oph, void (*relocate)(void *oldh, void *newh, void *data))
+{
+	struct pheap *ph = (struct pheap *)oph;
+
+	if ((ph == NULL) || (ph->opts & (PH_OPT_INTRUSIVE | PH_OPT_INBOX)))
+		return 0;
+	heap_settle(ph);
+	if ((ph->compact == NULL) && ph->root && !heap_compact_start(ph))
+		return 0;
+	pheap_compact_step(ph, SIZE_MAX, relocate);
+	return (ph->compact == NULL);
+} // pheap_compact
+
+
+// Snapshot file layout.  The header is followed by one record per node in the
+// pre-order of heap_walk_next(), each being a struct heap_snap_rec and then the
+// serialized key and data, padded out to a multiple of 8 bytes
+#define	PH_SNAP_MAGIC	"PHSNAP01"
+#define	PH_SNAP_SUB	0x1		// The node has children, the first being next
+#define	PH_SNAP_NEXT	0x2		// The node has a next sibling
+#define	PH_SNAP_WBUF	(1 << 20)	// Size of the pheap_snapshot() write buffer
+
+struct heap_snap_hdr {
+	char		magic[8];
+	uint64_t	nodes;			// Number of node records
+	uint64_t	bytes;			// Total size of the node records
+};
+
+struct heap_snap_rec {
+	uint32_t	len;			// Bytes of serialized key and data
+	uint32_t	flags;			// PH_SNAP_* flags
+};
+
+#define	PH_SNAP_PAD(len)	(((len) + 7) & ~(size_t)7)
+
+
+// The default serializer, which saves the key and data pointers as they are
+static size_t
+heap_snap_raw(void *key, void *data, void *buf, size_t len)
+{
+	if (len >= 2 * sizeof(void *)) {
+		((void **)buf)[0] = key;
+		((void **)buf)[1] = data;
+	}
+	return 2 * sizeof(void *);
+} // heap_snap_raw
+
+
+// Writes len bytes to fd.  Returns 1 on success
+static int
+heap_snap_write(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+} // heap_snap_write
+
+
+// Writes the heap's tree to fd, in the pre-order that pheap_restore() rebuilds it from
+// Returns 1 on success, and 0 on failure
+int
+pheap_snapshot(void *oph, int fd, size_t (*key_serializer)(void *key, void *data, void *buf, size_t len))
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap_snap_hdr hdr;
+	struct heap_snap_rec *rec;
+	struct heap *n;
+	size_t depth = 0, used = 0, need, len, room, cap = PH_SNAP_WBUF;
+	char *buf;
+	int ok = 1;
+
+	if (ph == NULL)
+		return 0;
+	if (key_serializer == NULL)
+		key_serializer = heap_snap_raw;
+	heap_settle(ph);
+
+	// The first walk sizes the records for the header
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PH_SNAP_MAGIC, sizeof(hdr.magic));
+	for (n = ph->root; n; n = heap_walk_next(n, &depth)) {
+		if ((len = key_serializer(n->key, n->data, NULL, 0)) > UINT32_MAX)
+			return 0;
+		hdr.nodes++;
+		hdr.bytes += sizeof(struct heap_snap_rec) + PH_SNAP_PAD(len);
+	}
+	if (((buf = (char *)malloc(cap)) == NULL) || !heap_snap_write(fd, &hdr, sizeof(hdr))) {
+		free(buf);
+		return 0;
+	}
+
+	for (n = ph->root; ok && n; n = heap_walk_next(n, &depth)) {
+		// Serialize straight into the buffer, flushing it first if it's too full
+		for (;;) {
+			rec = (struct heap_snap_rec *)(buf + used);
+			room = (cap - used > sizeof(struct heap_snap_rec)) ? cap - used - sizeof(struct heap_snap_rec) : 0;
+			if ((len = key_serializer(n->key, n->data, rec + 1, room)) > UINT32_MAX) {
+				ok = 0;		// rec->len only has 32 bits
+				break;
+			}
+			if ((need = sizeof(struct heap_snap_rec) + PH_SNAP_PAD(len)) <= cap - used)
+				break;
+			if (!(ok = heap_snap_write(fd, buf, used)))
+				break;
+			used = 0;
+			// A record bigger than the whole buffer gets a buffer of its own
+			if (need > cap) {
+				free(buf);
+				if ((buf = (char *)malloc(cap = need)) == NULL)
+					return 0;
+			}
+		}
+		if (!ok)
+			break;
+		memset((char *)(rec + 1) + len, 0, PH_SNAP_PAD(len) - len);
+		rec->len = len;
+		rec->flags = (n->sub ? PH_SNAP_SUB : 0) | (n->next ? PH_SNAP_NEXT : 0);
+		used += need;
+	}
+	if (ok && used)
+		ok = heap_snap_write(fd, buf, used);
+	free(buf);
+	return ok;
+} // pheap_snapshot
+
+
+// Rebuilds a heap from a snapshot that pheap_snapshot() wrote to fd
+// Returns an opaque handle to the new heap, or NULL on failure
+void *
+pheap_restore(int fd, int (*cmp)(void *, void *), int opts,
+	      void (*key_deserializer)(const void *rec, size_t len, void **key, void **data))
+{
+	struct heap_snap_hdr *hdr;
+	struct heap_snap_rec *rec;
+	struct heap *n, *last = NULL, *wait = NULL;
+	struct pheap *ph;
+	struct stat st;
+	char *p, *end;
+	uint64_t i;
+
+	if (opts & (PH_OPT_INTRUSIVE | PH_OPT_INSBUF | PH_OPT_INBOX | PH_OPT_TLCACHE))
+		return NULL;
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(struct heap_snap_hdr)))
+		return NULL;
+	if ((ph = (struct pheap *)pheap_create_ex(cmp, opts | PH_OPT_POOL)) == NULL)
+		return NULL;
+	ph->maplen = st.st_size;
+	if ((ph->map = mmap(NULL, ph->maplen, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		ph->map = NULL;
+		goto restore_fail;
+	}
+	madvise(ph->map, ph->maplen, MADV_SEQUENTIAL);
+
+	hdr = (struct heap_snap_hdr *)ph->map;
+	p = (char *)(hdr + 1);
+	end = (char *)ph->map + ph->maplen;
+	if (memcmp(hdr->magic, PH_SNAP_MAGIC, sizeof(hdr->magic)) || (hdr->bytes != (uint64_t)(end - p)))
+		goto restore_fail;
+
+	// Every node comes out of one slab.  Each has a record of at least the record
+	// header, so a node count that the records can't hold is refused before it is
+	// trusted with the size of the slab
+	if (hdr->nodes > hdr->bytes / sizeof(struct heap_snap_rec))
+		goto restore_fail;
+	if (hdr->nodes && !heap_pool_grow(&ph->pool, hdr->nodes))
+		goto restore_fail;
+
+	// Each node is the first child of the last node if that has children, or
+	// else the next sibling of the latest node still waiting for one.  Nodes
+	// waiting for a sibling are kept on a list through their own next pointers
+	for (i = 0; i < hdr->nodes; i++) {
+		rec = (struct heap_snap_rec *)p;
+		if ((p + sizeof(struct heap_snap_rec) > end) ||
+		    ((p += sizeof(struct heap_snap_rec) + PH_SNAP_PAD(rec->len)) > end))
+			goto restore_fail;
+		n = ph->pool.bump;
+		ph->pool.bump = (struct heap *)((char *)n + ph->pool.size);
+		n->next = n->sub = NULL;
+		if (key_deserializer) {
+			key_deserializer(rec + 1, rec->len, &n->key, &n->data);
+		} else {
+			if (rec->len != 2 * sizeof(void *))
+				goto restore_fail;
+			n->key = ((void **)(rec + 1))[0];
+			n->data = ((void **)(rec + 1))[1];
+		}
+
+		if (last == NULL) {
+			n->prev = NULL;
+			ph->root = n;
+		} else if (last->sub == last) {
+			last->sub = n;
+			n->prev = last;
+		} else {
+			if (wait == NULL)
+				goto restore_fail;
+			last = wait;
+			wait = wait->next;
+			last->next = n;
+			n->prev = last;
+		}
+		if (rec->flags & PH_SNAP_SUB)
+			n->sub = n;		// Marks that the next node is a child
+		if (rec->flags & PH_SNAP_NEXT) {
+			n->next = wait;
+			wait = n;
+		}
+		last = n;
+		PH_STAT(ph, nodes, 1);
+	}
+	if (wait || (last && (last->sub == last)))
+		goto restore_fail;
+	return ph;
+
+restore_fail:
+	// The nodes all go with the pool, without a walk
+	ph->root = NULL;
+	pheap_destroy(ph, NULL);
+	return NULL;
+} // pheap_restore
+
+
+// Compares two keys in the same way that the given heap does
+int
+pheap_key_cmp(void *oph, void *key1, void *key2)
+{
+	struct pheap *ph = (struct pheap *)oph;
+
+	return heap_key_cmp(ph, key1, key2);
+} // pheap_key_cmp
+
+
 // Sets the data pointer associated with some node to the new supplied value
 void
 pheap_set_data(void *opd, void *newdata)
@@ -418,19 +2646,188 @@ pheap_set_data(void *opd, void *newdata)
 } // pheap_set_data
 
 
-// Creates a paired-heap anchor node, around which a set of user data may be grouped under
+// Makes sure that at least n more nodes can be inserted into the given heap
+// without it having to go to the system memory allocator
+// Returns 1 on success, and 0 if the heap has no node cache or on no memory
+int
+pheap_reserve(void *oph, size_t n)
+{
+	struct pheap *ph = (struct pheap *)oph;
+	struct heap *hn;
+
+	if (ph == NULL)
+		return 0;
+
+	if (ph->opts & PH_OPT_POOL) {
+		size_t avail = ph->pool.nfree + ((char *)ph->pool.bend - (char *)ph->pool.bump) / ph->pool.size;
+
+		if (avail >= n)
+			return 1;
+		return heap_pool_grow(&ph->pool, n - avail);
+	}
+
+	if (ph->opts & PH_OPT_TLCACHE) {
+		while (ph_tlc_len < n) {
+			if ((hn = (struct heap *)calloc(sizeof(struct heap), 1)) == NULL)
+				return 0;
+			hn->next = ph_tlc;
+			ph_tlc = hn;
+			ph_tlc_len++;
+		}
+		return 1;
+	}
+	return 0;
+} // pheap_reserve
+
+
+// Releases all nodes held in the calling thread's node cache
+void
+pheap_tlcache_flush(void)
+{
+	struct heap *n;
+
+	while ((n = ph_tlc)) {
+		ph_tlc = n->next;
+		free(n);
+	}
+	ph_tlc_len = 0;
+} // pheap_tlcache_flush
+
+
+// Picks the vectorised pairing pass for the given level, capped at what the CPU has
+int
+pheap_simd_level(int level)
+{
+#ifdef __PH_SIMD
+	if (level < 0)
+		return ph_simd_level;
+	if (level > ph_simd_max)
+		level = ph_simd_max;
+	switch (level) {
+	case PH_SIMD_AVX512:
+		heap_simd_pairs = heap_merge_pairs_avx512;
+		break;
+	case PH_SIMD_AVX2:
+		heap_simd_pairs = heap_merge_pairs_avx2;
+		break;
+	case PH_SIMD_SSE42:
+		heap_simd_pairs = heap_merge_pairs_sse42;
+		break;
+	default:
+		heap_simd_pairs = NULL;
+		level = PH_SIMD_NONE;
+		break;
+	}
+	return (ph_simd_level = level);
+#else
+	return PH_SIMD_NONE;
+#endif
+} // pheap_simd_level
+
+
+// Creates a paired-heap anchor node with the given PH_OPT_* options
 // Returns an opaque handle to the heap, which the user may pass for other operations
 void *
-pheap_create(int (*cmp)(void *, void *))
+pheap_create_ex(int (*cmp)(void *, void *), int opts)
 {
 	struct pheap *ph;
 
 	ph = (struct pheap *)calloc(sizeof(struct pheap), 1);
 	if (ph == NULL)
 		return NULL;
-	if (cmp == NULL)
-		ph->cmp = heap_int_cmp;
-	else
-		ph->cmp = cmp;
+
+	// A built-in key type takes precedence over any supplied cmp
+	switch (opts & PH_KEY_MASK) {
+	case PH_KEY_U32:
+		ph->cmp = heap_u32_cmp;
+		break;
+	case PH_KEY_U64:
+		ph->cmp = heap_u64_cmp;
+		break;
+	case PH_KEY_I64:
+		ph->cmp = heap_i64_cmp;
+		break;
+	case PH_KEY_DOUBLE:
+		ph->cmp = heap_double_cmp;
+		break;
+	case PH_KEY_STRPFX:
+		ph->cmp = heap_strpfx_cmp;
+		break;
+	default:
+		ph->cmp = (cmp == NULL) ? heap_int_cmp : cmp;
+		break;
+	}
+#ifdef __PH_LATENCY
+	// Without histograms the heap still works, and just isn't timed
+	ph->lat = (struct pheap_latency *)calloc(sizeof(struct pheap_latency), 1);
+#endif
+	// Auxiliary two-pass keeps its inserts aside until the heap is next looked at
+	if ((opts & PH_PAIR_MASK) == PH_PAIR_AUXTWOPASS)
+		opts |= PH_OPT_INSBUF;
+	if (opts & PH_OPT_ARENA)
+		opts |= PH_OPT_POOL;
+	ph->opts = opts;
+	ph->nodesize = sizeof(struct heap);
+	ph->pool.nslab = PH_SLAB_MIN;
+	ph->pool.size = ph->nodesize;
 	return (void *)ph;
+} // pheap_create_ex
+
+
+// Creates a paired-heap anchor node that holds no more than the k least nodes
+// Returns an opaque handle to the heap, or NULL on failure
+void *
+pheap_create_bounded(int (*cmp)(void *, void *), size_t k)
+{
+	struct pheap *ph;
+
+	if (k == 0)
+		return NULL;
+	if ((ph = (struct pheap *)pheap_create_ex(cmp, PH_OPT_POOL)) == NULL)
+		return NULL;
+	ph->nodesize = sizeof(struct heap_bnd);
+	ph->pool.size = ph->nodesize;
+	ph->bound = k;
+	if (((ph->bheap = (struct heap **)malloc(k * sizeof(struct heap *))) == NULL) || !pheap_reserve(ph, k)) {
+		pheap_destroy(ph, NULL);
+		return NULL;
+	}
+	return (void *)ph;
+} // pheap_create_bounded
+
+
+// Creates a paired-heap anchor node whose nodes keep the prefix(key) of their key
+// Returns an opaque handle to the heap, or NULL on failure or unsupported options
+void *
+pheap_create_prefixed(int (*cmp)(void *, void *), uint64_t (*prefix)(void *), int opts)
+{
+	struct pheap *ph;
+
+	// Caller owned and per-thread cached nodes are too small to hold a prefix
+	if ((cmp == NULL) || (prefix == NULL) || (opts & (PH_OPT_INTRUSIVE | PH_OPT_TLCACHE)))
+		return NULL;
+	if ((ph = (struct pheap *)pheap_create_ex(cmp, opts & ~PH_KEY_MASK)) == NULL)
+		return NULL;
+	ph->prefix = prefix;
+	ph->nodesize = sizeof(struct heap_pfx);
+	ph->pool.size = ph->nodesize;
+	return (void *)ph;
+} // pheap_create_prefixed
+
+
+// Creates a paired-heap anchor node for one of the built-in PH_KEY_* key types
+// Returns an opaque handle to the heap, which the user may pass for other operations
+void *
+pheap_create_typed(int ktype)
+{
+	return pheap_create_ex(NULL, ktype & PH_KEY_MASK);
+} // pheap_create_typed
+
+
+// Creates a paired-heap anchor node, around which a set of user data may be grouped under
+// Returns an opaque handle to the heap, which the user may pass for other operations
+void *
+pheap_create(int (*cmp)(void *, void *))
+{
+	return pheap_create_ex(cmp, 0);
 } // pheap_create
@@ -1,5 +1,151 @@
 // Stew's paired heap implementation
 
+#ifndef __PH_H
+#define __PH_H
+
+#include	<stddef.h>
+#include	<stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Options that may be given to pheap_create_ex()
+//
+// PH_OPT_POOL gives the heap its own node pool.  Nodes are carved out of large slabs and
+// released nodes are kept on a free list for reuse, so inserts and deletes don't need to
+// call into the system allocator.  Destroying a pooled heap without a kd_free() releases
+// all of its nodes with the slabs, without visiting them.  Node memory is only given back
+// to the system when the heap is destroyed
+//
+// PH_OPT_TLCACHE makes a non-pooled heap recycle released nodes through a small cache
+// that is kept per thread, and is shared with every other such heap used by that thread
+//
+// PH_OPT_INSBUF buffers inserts.  New nodes are put onto an unpaired pending list without
+// touching the root, and the whole list is paired up in a single merge pairs pass the next
+// time the heap is looked at or changed by anything other than another insert.  This suits
+// bursts of many inserts between each pheap_delete_min()
+//
+// PH_OPT_INBOX gives the heap a lock-free inbox, so that any number of producer threads
+// may add nodes with pheap_inbox_insert() or pheap_inbox_push() while one consumer thread
+// owns the heap.  Producers never take a lock or touch the heap itself.  The consumer pairs
+// the whole inbox into the heap in a single merge pairs pass whenever it next looks at or
+// changes the heap.  All other functions may only be called by the consumer
+//
+// PH_OPT_INTRUSIVE makes a heap that only holds caller owned struct pheap_node's (see below)
+// The library never allocates or frees nodes for such a heap, and pheap_insert() fails on it
+//
+// PH_OPT_ARENA is PH_OPT_POOL for heaps that are emptied and refilled over and over.  When
+// pheap_clear() empties the heap its node memory is kept, and merged into a single slab the
+// first time, so that each later clear (and destroy) takes O(1) time without a kd_free(),
+// and refilling the heap up to its old size never calls into the system allocator
+#define	PH_OPT_POOL	0x0001
+#define	PH_OPT_TLCACHE	0x0002
+#define	PH_OPT_INTRUSIVE 0x0004
+#define	PH_OPT_INSBUF	0x0008
+#define	PH_OPT_INBOX	0x0010
+#define	PH_OPT_ARENA	0x0020
+
+// Built-in key types that may be given to pheap_create_typed(), or OR'd into the options
+// given to pheap_create_ex().  The void *key of each node is then taken to be:
+//
+// PH_KEY_U32    - A uint32_t value, cast to a void pointer
+// PH_KEY_U64    - A uint64_t value, cast to a void pointer
+// PH_KEY_I64    - An int64_t value, cast to a void pointer
+// PH_KEY_DOUBLE - A double, converted to a void pointer with pheap_double_key()
+// PH_KEY_STRPFX - A pointer to a NUL terminated string.  Compares as strcmp() does, but
+//                 looks at the first 8 bytes as an integer before falling back to strcmp()
+//
+// Built-in key types are compared inline by type-specialised copies of the internal merge
+// and pairing code, and never through a function pointer.  Any cmp given is ignored.
+// The numeric types require that a void pointer is 64 bits wide
+#define	PH_KEY_U32	0x0100
+#define	PH_KEY_U64	0x0200
+#define	PH_KEY_I64	0x0300
+#define	PH_KEY_DOUBLE	0x0400
+#define	PH_KEY_STRPFX	0x0500
+#define	PH_KEY_MASK	0x0f00
+
+// Pairing strategies that may be OR'd into the options given to pheap_create_ex().  They
+// choose how the children of a deleted node are merged back into one tree
+//
+// PH_PAIR_CHUNKED    - The default.  Pairs up to 480 trees at a time left to right, merges
+//                      those pairs back right to left, and repeats on what's left
+// PH_PAIR_TWOPASS    - The original two-pass pairing, over the whole sibling list at once
+// PH_PAIR_MULTIPASS  - Pairs the trees left to right, over and over, until one is left
+// PH_PAIR_FRONTBACK  - Pairs the trees left to right, and merges the pairs left to right
+// PH_PAIR_AUXTWOPASS - Two-pass pairing, with inserts kept on an auxiliary list which is
+//                      combined by multipass pairing, and merged into the heap, the next
+//                      time it is looked at.  Implies PH_OPT_INSBUF
+//
+// Every strategy keeps the same time bounds, and none uses more than a fixed amount of
+// memory.  Which one is fastest depends on the workload.  See phwork.c
+#define	PH_PAIR_CHUNKED		0x0000
+#define	PH_PAIR_TWOPASS		0x1000
+#define	PH_PAIR_MULTIPASS	0x2000
+#define	PH_PAIR_FRONTBACK	0x3000
+#define	PH_PAIR_AUXTWOPASS	0x4000
+#define	PH_PAIR_MASK		0x7000
+
+// Converts between doubles and void *keys for PH_KEY_DOUBLE heaps
+static inline void *pheap_double_key(double d)
+{
+	union { double d; void *p; } u;
+
+	u.d = d;
+	return u.p;
+}
+
+static inline double pheap_key_double(void *key)
+{
+	union { double d; void *p; } u;
+
+	u.p = key;
+	return u.d;
+}
+
+// Builds an order preserving 64-bit key prefix for pheap_create_prefixed() from the first
+// (up to) 8 bytes of a key, such that prefixes compare as memcmp() would on the bytes
+static inline uint64_t pheap_prefix_bytes(const void *buf, size_t len)
+{
+	const unsigned char *b = (const unsigned char *)buf;
+	uint64_t p = 0;
+	size_t i;
+
+	for (i = 0; (i < len) && (i < 8); i++)
+		p |= (uint64_t)b[i] << (56 - (i << 3));
+	return p;
+}
+
+// As above, for a NUL terminated string key, comparing as strcmp() would
+static inline uint64_t pheap_prefix_str(const char *s)
+{
+	uint64_t p = 0;
+	int i;
+
+	for (i = 0; (i < 8) && s[i]; i++)
+		p |= (uint64_t)(unsigned char)s[i] << (56 - (i << 3));
+	return p;
+}
+
+// A heap node that the caller may embed in their own structures, in the same manner as
+// a Linux list_head.  The contents are private to the library.  A pointer to one is a
+// valid node handle for all of the functions below that take one, and pheap_get_key()
+// and pheap_get_data() may be used on it.  Use pheap_entry() to get from a node back to
+// the structure that it's embedded in, eg.
+//
+//	struct timer {
+//		struct pheap_node	node;
+//		...
+//	};
+//	struct timer *t = pheap_entry(pheap_delete_min_node(heap), struct timer, node);
+struct pheap_node {
+	void	*ph_priv[5];
+};
+
+#define	pheap_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
 // Creates a paired-heap anchor node, around which a set of user data may be grouped under
 // Returns an opaque handle to the heap, which the user may pass for other operations
 //
@@ -12,6 +158,50 @@
 // values to uint64_t values, and compares the results
 void *pheap_create(int (*cmp)(void *, void *));
 
+// As for pheap_create(), but with the PH_OPT_* options above OR'd together in opts
+void *pheap_create_ex(int (*cmp)(void *, void *), int opts);
+
+// Creates a heap for one of the built-in PH_KEY_* key types above
+void *pheap_create_typed(int ktype);
+
+// Creates a heap that holds at most the k least keys it is given, such as for keeping the
+// k best of a stream of candidates.  Once it holds k nodes, pheap_insert() compares the new
+// key against the greatest key held, which is tracked by a companion max-heap, and rejects
+// it in O(1) time if it is no less.  Otherwise the node with the greatest key is evicted,
+// and reused for the new key and data, so a full heap never allocates or frees.  Node
+// handles to evicted nodes become handles to the new key.  All k nodes are allocated up
+// front.  Bounded heaps can't be melded.  Returns an opaque handle, or NULL on failure
+void *pheap_create_bounded(int (*cmp)(void *, void *), size_t k);
+
+// As for pheap_insert() on a bounded heap, but if a node was evicted then its key and data
+// are stored into ekey and edata (if non-NULL), so that they may be released.  Otherwise
+// they are set to NULL.  Returns the node, or NULL if the key was rejected
+void *pheap_insert_evict(void *oph, void *key, void *data, void **ekey, void **edata);
+
+// Returns the node with the greatest key in a bounded heap, being the next to be evicted,
+// or NULL if the heap is empty or not bounded.  Sets key and data if they are non-NULL
+void *pheap_get_worst_node(void *oph, void **key, void **data);
+
+// Creates a heap whose nodes hold an order preserving 64-bit prefix of their key, as
+// returned by prefix(key), right next to the links that the pairing passes walk.  Keys
+// are ordered by their prefixes, and cmp() is only called to break ties between equal
+// prefixes, so most comparisons never touch the key's memory.  If prefix(key1) is less
+// than prefix(key2) then cmp(key1, key2) must say key1 is less too.  Each node is 8 bytes
+// larger.  pheap_prefix_bytes() and pheap_prefix_str() build prefixes for common keys
+// Neither cmp nor prefix may be NULL, and PH_OPT_INTRUSIVE and PH_OPT_TLCACHE may not
+// be used.  Returns an opaque handle to the heap, or NULL on failure
+void *pheap_create_prefixed(int (*cmp)(void *, void *), uint64_t (*prefix)(void *), int opts);
+
+// Preallocates enough nodes so that at least n more nodes can be inserted into the heap
+// without calling into the system allocator.  For PH_OPT_TLCACHE heaps the nodes go into
+// the calling thread's cache.  Returns 1 on success, and 0 if the heap was not created with
+// PH_OPT_POOL or PH_OPT_TLCACHE, or if memory could not be allocated
+int pheap_reserve(void *oph, size_t n);
+
+// Releases all nodes held in the calling thread's PH_OPT_TLCACHE node cache.  Threads
+// that used PH_OPT_TLCACHE heaps should call this before they exit
+void pheap_tlcache_flush(void);
+
 // Releases an entire paired heap tree from memory, and the anchor node as well
 // oph must not be used afterwards (and its contents are zeroed out)
 // void kd_free(void *key, void *data) is a caller provided function that will be
@@ -20,11 +210,50 @@ void *pheap_create(int (*cmp)(void *, void *));
 // user-allocated key/data storage and the node will simply be destroyed
 void pheap_destroy(void *oph, void (*kd_free)(void *, void *));
 
+// Deletes every node from the heap, passing each node's key and data to kd_free() if it
+// isn't NULL, and leaves the heap empty and ready for reuse.  Without a kd_free() a pooled
+// heap releases its nodes with their slabs, and an arena heap keeps them for reuse, without
+// visiting any.  Nodes are only visited with a walk that uses no stack or extra memory
+void pheap_clear(void *oph, void (*kd_free)(void *, void *));
+
 // Inserts the user supplied key/data tuple into the paired heap.  Returns
 // an opaque pointer to the heap node that is associated with the user
 // data, that the user may pass to pheap_delete() later as required
 void *pheap_insert(void *oph, void *key, void *data);
 
+// Inserts n key/data tuples from the keys[] and data[] arrays in one go.  The new nodes are
+// paired up with each other and the root in a single pass, which is cheaper than inserting
+// them one at a time.  If data is NULL then all nodes get NULL data.  If handles is not NULL
+// it is filled in with the node handles.  Returns the number of tuples inserted, which will
+// be less than n only if memory ran out, or if a bounded heap rejected some of them
+size_t pheap_insert_batch(void *oph, void **keys, void **data, size_t n, void **handles);
+
+// Inserts a key/data tuple into a PH_OPT_INBOX heap.  May be called by any thread at any
+// time without locking.  Returns the new node, or NULL if out of memory, or if the heap
+// isn't a PH_OPT_INBOX heap or has PH_OPT_POOL or PH_OPT_INTRUSIVE nodes
+void *pheap_inbox_insert(void *oph, void *key, void *data);
+
+// Pushes the caller owned node pn with the given key into a PH_OPT_INBOX | PH_OPT_INTRUSIVE
+// heap.  May be called by any thread at any time without locking.  Returns 1 if the node
+// was pushed, or 0 if the heap doesn't have both of those options
+int pheap_inbox_push(void *oph, struct pheap_node *pn, void *key);
+
+// Inserts the caller owned node pn into a PH_OPT_INTRUSIVE heap with the given key
+// The node's data pointer is left untouched, and may be set with pheap_set_data()
+// Returns 1 if the node was inserted, or 0 if the heap isn't a PH_OPT_INTRUSIVE heap
+int pheap_insert_node(void *oph, struct pheap_node *pn, void *key);
+
+// Removes the least node from a PH_OPT_INTRUSIVE heap and returns it to the caller, or
+// returns NULL if the heap is empty.  The node's key and data are left in place
+struct pheap_node *pheap_delete_min_node(void *oph);
+
+// Removes the caller owned node pn from a PH_OPT_INTRUSIVE heap in-place
+// Returns 1 if the node was removed, and 0 on invalid parameters
+int pheap_delete_node(void *oph, struct pheap_node *pn);
+
+// Changes the key of the caller owned node pn within a PH_OPT_INTRUSIVE heap
+void pheap_change_key_node(void *oph, struct pheap_node *pn, void *newkey);
+
 // Gets the key pointer associated with the given node
 void *pheap_get_key(void *opn);
 
@@ -46,8 +275,193 @@ int pheap_delete_min(void *oph, void **key, void **data);
 // Sets key and data to that in the node if they are non-NULL
 int pheap_delete(void *oph, void *opd, void **key, void **data);
 
+// Deletes up to k of the least nodes from the heap in one call, in sorted order.  Their
+// keys and data are stored into keys[0..] and data[0..] if they are non-NULL, and the nodes
+// are freed together at the end.  Returns the number of nodes deleted, which is less
+// than k only if the heap ran out of nodes
+size_t pheap_delete_min_n(void *oph, size_t k, void **keys, void **data);
+
+// Deletes up to max of the least nodes from the heap whose keys are less than or equal to
+// limit, such as every timer that is due, in sorted order.  Keys and data are stored as
+// for pheap_delete_min_n().  Returns the number of nodes deleted, which is max if there
+// may be more due nodes left
+size_t pheap_delete_until(void *oph, void *limit, void **keys, void **data, size_t max);
+
 // Changes the key of the given node that is a member of the given heap
 void pheap_change_key(void *oph, void *opd, void *newkey);
 
+// Moves every node from the heap src into the heap dst in O(1) time, leaving src empty
+// but still usable.  All node handles stay valid, and now belong to dst.  Both heaps must
+// have the same compare function, and the same PH_OPT_POOL and PH_OPT_INTRUSIVE options.
+// Spare pooled nodes move over to dst along with src's nodes.  If src has PH_OPT_INSBUF
+// inserts pending then they are paired up first, as they would be by pheap_delete_min()
+// Returns 1 on success, and 0 if the heaps can't be melded
+int pheap_meld(void *dst, void *src);
+
+// Calls fn(node, key, data, ctx) on every node of the heap, in no set order, stopping early
+// if fn() returns non-zero.  The walk needs no memory no matter how deep the heap is.  fn()
+// must not insert, delete or change the key of any node.  Returns the number of nodes that
+// fn() was called on
+size_t pheap_foreach(void *oph, int (*fn)(void *opn, void *key, void *data, void *ctx), void *ctx);
+
+// Opens a cursor that reads the nodes of the heap in key order without removing them or
+// changing the heap in any way.  The cursor keeps the nodes that may come next in a heap of
+// its own, adding every child of each node that it reads, so reading the first k nodes takes
+// O(d + k log d) time, where d is the number of children those k nodes have.  That is
+// O(k log k) on a heap that has had deletes, but the first read after a run of inserts has
+// to look at every node inserted since the last delete.  The heap must not be changed while
+// the cursor is open.  Returns the cursor, or NULL on no memory
+void *pheap_cursor_open(void *oph);
+
+// Returns the handle of the cursor's next node in key order, and sets key and data to that
+// in the node if they are non-NULL.  Returns NULL once every node has been read, or if
+// there was no memory to hold the node's children, which pheap_cursor_failed() tells apart
+void *pheap_cursor_next(void *cur, void **key, void **data);
+
+// Returns 1 if the cursor's last pheap_cursor_next() returned NULL for lack of memory rather
+// than because every node had been read, or 0 if not.  No node is lost when it does, so the
+// read can be tried again once memory has been freed
+int pheap_cursor_failed(void *cur);
+
+// Frees the cursor.  The heap is left as it was
+void pheap_cursor_close(void *cur);
+
+// Moves every node of the heap into one block of memory, in the order of a depth first walk
+// of the heap, so that the walks made by pheap_delete_min() and pheap_delete() step through
+// memory in order, rather than all over it after a long run of inserts and deletes.  Each
+// moved node's handle changes, and relocate(oldh, newh, data) is called for each one so that
+// its owner can update it.  oldh must not be used after the call.  A heap that wasn't made
+// with PH_OPT_POOL has its nodes pooled from then on.  Returns 1 on success, and 0 if out of
+// memory, or for PH_OPT_INTRUSIVE and PH_OPT_INBOX heaps, whose nodes can't be moved
+int pheap_compact(void *oph, void (*relocate)(void *oldh, void *newh, void *data));
+
+// As for pheap_compact(), but stops once it has looked at budget nodes, so that a large heap
+// can be compacted a bit at a time without holding up the caller for long.  The heap may be
+// used as usual between calls, and newly inserted nodes are already in place.  The first
+// call on a heap that isn't pooled also walks the heap once to count its nodes.  Returns the
+// number of nodes still to be moved, which is 0 once the compaction is complete (or if, as
+// for pheap_compact(), it can't be done)
+size_t pheap_compact_step(void *oph, size_t budget, void (*relocate)(void *oldh, void *newh, void *data));
+
+// Structural statistics for a heap, as returned by pheap_stats()
+struct pheap_stats {
+	uint64_t	comparisons;		// Key comparisons made
+	uint64_t	merges;			// Merges of two trees (heap_merge() calls)
+	uint64_t	pair_passes;		// Merge pairs passes run
+	uint64_t	longest_chain;		// Longest sibling chain seen by a merge pairs pass
+	uint64_t	msn_limit_hits;		// Times a pass filled its chunk limit (MSN in ph.c)
+	uint64_t	root_children;		// Number of children the root has right now
+	uint64_t	nodes;			// Number of nodes in the heap
+};
+
+// Fills in out with the heap's statistics.  The counters are only kept if ph.c is built
+// with __PH_STATS defined, and cost nothing otherwise.  Returns 1 on success, or 0 (and
+// out is zeroed) if __PH_STATS was not defined
+int pheap_stats(void *oph, struct pheap_stats *out);
+
+// Zeroes the heap's statistics event counters.  The node count is kept
+void pheap_stats_reset(void *oph);
+
+// Walks the whole heap on demand, counting nodes by depth (the root being depth 0) into
+// depth_hist[], and by number of children into degree_hist[].  Each histogram has nbuckets
+// buckets, and the last bucket also counts everything beyond it.  Either histogram may be
+// NULL.  Works without __PH_STATS, and uses no extra memory.  Returns the number of nodes
+size_t pheap_stats_shape(void *oph, size_t *depth_hist, size_t *degree_hist, size_t nbuckets);
+
+// Calls timed by the latency histograms.  pheap_insert_node(), pheap_delete_min_node(),
+// pheap_delete_node() and pheap_change_key_node() count as the calls they stand in for
+#define	PH_LAT_INSERT		0
+#define	PH_LAT_DELETE_MIN	1
+#define	PH_LAT_DELETE		2
+#define	PH_LAT_CHANGE_KEY	3
+#define	PH_LAT_DESTROY		4
+#define	PH_LAT_OPS		5
+
+#define	PH_LAT_BUCKETS		256
+
+// Per call latency histograms, as returned by pheap_latency_snapshot().  hist[op][i] counts
+// the calls that took from pheap_latency_bucket_ns(i) up to pheap_latency_bucket_ns(i + 1)
+// nanoseconds.  Buckets are 1ns wide below 4ns, and above that every power of 2 is split
+// into 4 buckets, so any latency is known to within 25%
+struct pheap_latency {
+	uint64_t	count[PH_LAT_OPS];	// Calls timed
+	uint64_t	total_ns[PH_LAT_OPS];	// Sum of their latencies
+	uint64_t	max_ns[PH_LAT_OPS];	// Longest latency seen
+	uint64_t	hist[PH_LAT_OPS][PH_LAT_BUCKETS];
+};
+
+// Fills in out with the latency histograms of the heap, or with those of every heap that
+// has been destroyed so far if oph is NULL.  pheap_destroy() itself only shows up in the
+// latter.  The histograms are only kept if ph.c is built with __PH_LATENCY defined, which
+// times every call with the monotonic clock.  Returns 1 on success, or 0 (and out is zeroed)
+// if __PH_LATENCY was not defined
+int pheap_latency_snapshot(void *oph, struct pheap_latency *out);
+
+// Zeroes the latency histograms of the heap, or those of destroyed heaps if oph is NULL
+void pheap_latency_reset(void *oph);
+
+// Returns the lowest latency in nanoseconds that falls into bucket i of a histogram
+uint64_t pheap_latency_bucket_ns(unsigned i);
+
+// Returns the latency in nanoseconds that pct percent of the calls to op came in under, to
+// the bucket's upper bound (or the longest latency seen, if that's lower).  Returns 0 if
+// op was never timed
+uint64_t pheap_latency_percentile(const struct pheap_latency *lat, int op, double pct);
+
+// Writes the heap's tree to fd, which should be a newly created or truncated file, in a
+// compact binary format that pheap_restore() can rebuild the heap from.  Nodes are written
+// in a walk of the tree that uses no memory, each with the bytes that
+//
+//	size_t key_serializer(void *key, void *data, void *buf, size_t len)
+//
+// puts into buf for the node's key and data.  key_serializer() must return the number of
+// bytes that it needs, and is first called with a NULL buf and a len of 0 to find out how
+// many that is.  If key_serializer is NULL then the key and data pointers themselves are
+// written, which suits integer keys and data.  Returns 1 on success, and 0 on failure
+int pheap_snapshot(void *oph, int fd, size_t (*key_serializer)(void *key, void *data, void *buf, size_t len));
+
+// Rebuilds a heap from the snapshot in the file fd, with the given compare function and
+// PH_OPT_* options.  The file is memory mapped and read in one linear pass, and the nodes
+// all come from a single slab of the heap's node pool, so PH_OPT_POOL is implied.  The
+// tree has the same shape as when it was saved, so a heap that was consolidated then
+// needs no pairing up on the first pheap_delete_min().  For each node
+//
+//	void key_deserializer(const void *rec, size_t len, void **key, void **data)
+//
+// is given the len bytes that key_serializer() wrote, and sets the node's key and data.
+// rec stays mapped until the heap is destroyed, so keys may point straight into it.  If
+// key_deserializer is NULL the saved key and data pointers are used as they are.  Heaps
+// with PH_OPT_INTRUSIVE, PH_OPT_INSBUF, PH_OPT_INBOX or PH_OPT_TLCACHE can't be restored,
+// nor can prefixed or bounded heaps, and a restored heap can't be melded into another
+// Returns an opaque handle to the heap, or NULL on failure or a bad snapshot
+void *pheap_restore(int fd, int (*cmp)(void *, void *), int opts,
+		    void (*key_deserializer)(const void *rec, size_t len, void **key, void **data));
+
+// Instruction set levels for pheap_simd_level()
+#define	PH_SIMD_NONE		0
+#define	PH_SIMD_SSE42		1
+#define	PH_SIMD_AVX2		2
+#define	PH_SIMD_AVX512		3
+
+// Heaps with integer keys (a NULL compare function, or PH_KEY_I64) and the default
+// PH_PAIR_CHUNKED pairing use a vectorised pairing pass on x86-64, picked at start up
+// from the widest instruction set that the CPU supports.  It gives the heap exactly the
+// same shape as the scalar pass.  Sets the widest level that may be used to level, or
+// to the CPU's own limit if that's lower, and returns the level now in use.  A level
+// below 0 just returns it.  The setting is process wide, and so should be made before
+// other threads are using heaps.  Always returns PH_SIMD_NONE if ph.c was built without
+// the vectorised pass
+int pheap_simd_level(int level);
+
+// Compares key1 with key2 using the given heap's compare function (or built-in key type)
+// Returns < 0 if key1 sorts first, > 0 if key2 sorts first.  Equal keys may give either
+int pheap_key_cmp(void *oph, void *key1, void *key2);
+
 // Sets the data pointer associated with the given node to the new supplied value
 void pheap_set_data(void *opd, void *newdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,316 @@
+// Stew's paired heap implementation - header-only C++ template version
+//
+// This is the same pairing heap as ph.c, with the same chunked merge-pairs pass, but with
+// the comparator given as a compile-time functor so that every comparison is inlined, and
+// with keys and values held in the nodes by value rather than as void pointers
+//
+// Compare(a, b) must return true if key a sorts strictly before key b (as per std::less)
+// Equal keys are handled exactly as they are in ph.c
+//
+// A node's key and value are destroyed as soon as it leaves the heap, and the node itself
+// is kept for reuse by later inserts, up to SPARE_MAX of them.  shrink_to_fit() frees the
+// rest
+
+#ifndef __PH_HPP
+#define __PH_HPP
+
+#include	<cstddef>
+#include	<functional>
+#include	<new>
+#include	<utility>
+
+template <typename Key, typename Value, typename Compare = std::less<Key>>
+class PairingHeap {
+	// The key and value only exist while the node is in the heap.  They are
+	// constructed in place by alloc() and destroyed by release()
+	struct Node {
+		Node	*next;			// Next sibling
+		Node	*prev;			// Previous sibling or parent
+		Node	*sub;			// child-nodes
+		union { Key key; };		// The key to compare on
+		union { Value value; };		// The associated value with this entry
+
+		Node() : next(nullptr), prev(nullptr), sub(nullptr) {}
+		~Node() {}
+	};
+
+public:
+	// A typed handle to an element in the heap.  It remains valid until the element
+	// is removed from the heap, and may be passed to erase() and change_key()
+	class Handle {
+		friend class PairingHeap;
+		Node	*n;
+		explicit Handle(Node *pn) : n(pn) {}
+	public:
+		Handle() : n(nullptr) {}
+		explicit operator bool() const { return n != nullptr; }
+		const Key &key() const { return n->key; }
+		Value &value() const { return n->value; }
+		bool operator==(const Handle &o) const { return n == o.n; }
+		bool operator!=(const Handle &o) const { return n != o.n; }
+	};
+
+	// Most released nodes that are kept for reuse
+	static const size_t SPARE_MAX = 1024;
+
+	explicit PairingHeap(const Compare &c = Compare()) : root(nullptr), spare(nullptr), count(0), nspare(0), cmp(c) {}
+
+	PairingHeap(const PairingHeap &) = delete;
+	PairingHeap &operator=(const PairingHeap &) = delete;
+
+	PairingHeap(PairingHeap &&o) noexcept
+		: root(o.root), spare(o.spare), count(o.count), nspare(o.nspare), cmp(std::move(o.cmp))
+	{
+		o.root = o.spare = nullptr;
+		o.count = o.nspare = 0;
+	}
+
+	PairingHeap &operator=(PairingHeap &&o) noexcept
+	{
+		if (this != &o) {
+			clear();
+			release_spare();
+			root = o.root;
+			spare = o.spare;
+			count = o.count;
+			nspare = o.nspare;
+			cmp = std::move(o.cmp);
+			o.root = o.spare = nullptr;
+			o.count = o.nspare = 0;
+		}
+		return *this;
+	}
+
+	~PairingHeap()
+	{
+		clear();
+		release_spare();
+	}
+
+	bool empty() const { return root == nullptr; }
+	size_t size() const { return count; }
+
+	// The least element.  The heap must not be empty
+	Handle top() const { return Handle(root); }
+	const Key &top_key() const { return root->key; }
+	Value &top_value() const { return root->value; }
+
+	// Inserts the key/value pair.  Returns a handle to the new element
+	Handle insert(Key key, Value value)
+	{
+		Node *n = alloc(std::move(key), std::move(value));
+
+		root = root ? merge(n, root) : n;
+		count++;
+		return Handle(n);
+	}
+
+	// Removes the least element, moving its key and value out to the caller if asked
+	// Returns false if the heap was already empty
+	bool pop(Key *key = nullptr, Value *value = nullptr)
+	{
+		Node *d = root;
+
+		if (d == nullptr)
+			return false;
+		if (key)
+			*key = std::move(d->key);
+		if (value)
+			*value = std::move(d->value);
+		root = d->sub ? merge_pairs(d->sub) : nullptr;
+		release(d);
+		return true;
+	}
+
+	// Removes the given element from the heap in-place
+	void erase(Handle h)
+	{
+		Node *d = h.n;
+
+		if (d == root) {
+			pop();
+			return;
+		}
+		detach(d);
+		release(d);
+	}
+
+	// Changes the key of the given element
+	void change_key(Handle h, Key newkey)
+	{
+		Node *pd = h.n;
+		bool lt = cmp(newkey, pd->key);
+
+		// Handle mega-easy key equivalence scenario
+		if (!lt && !cmp(pd->key, newkey)) {
+			pd->key = std::move(newkey);
+			return;
+		}
+		pd->key = std::move(newkey);
+
+		if (pd == root) {			// The node == root-node scenarios
+			if (lt || pd->sub == nullptr)	// Decrease key, or no children
+				return;
+			root = merge_pairs(pd->sub);
+		} else {
+			detach(pd);
+		}
+
+		pd->next = pd->prev = pd->sub = nullptr;
+		root = merge(root, pd);
+	}
+
+	// Removes every element.  Uses no recursion, so degenerate trees are safe
+	void clear()
+	{
+		Node *n = root, *t;
+
+		// Splice each node's children in ahead of its siblings, so that the
+		// whole tree is visited as one flat list
+		while (n) {
+			if ((t = n->sub)) {
+				while (t->next)
+					t = t->next;
+				t->next = n->next;
+				n->next = n->sub;
+			}
+			t = n->next;
+			release(n);
+			n = t;
+		}
+		root = nullptr;
+		count = 0;
+	}
+
+	// Frees the nodes that are being kept for reuse
+	void shrink_to_fit()
+	{
+		release_spare();
+	}
+
+private:
+	// Number of node pointers we'll allocate on the stack.  Same as ph.c
+	static const int MSN = 240;
+
+	Node	*root;				// The root of the actual heap
+	Node	*spare;				// Released nodes kept for reuse
+	size_t	count;				// Number of elements in the heap
+	size_t	nspare;				// Number of nodes on spare
+	Compare	cmp;
+
+	Node *alloc(Key &&k, Value &&v)
+	{
+		Node *n = spare;
+
+		if (n == nullptr) {
+			n = new Node();
+		} else {
+			spare = n->next;
+			nspare--;
+			n->next = n->prev = n->sub = nullptr;
+		}
+		try {
+			new (&n->key) Key(std::move(k));
+			try {
+				new (&n->value) Value(std::move(v));
+			} catch (...) {
+				n->key.~Key();
+				throw;
+			}
+		} catch (...) {
+			delete n;
+			throw;
+		}
+		return n;
+	}
+
+	// Destroys the node's key and value, and keeps the node for reuse if there's room
+	void release(Node *n)
+	{
+		n->key.~Key();
+		n->value.~Value();
+		count--;
+		if (nspare >= SPARE_MAX) {
+			delete n;
+			return;
+		}
+		n->next = spare;
+		spare = n;
+		nspare++;
+	}
+
+	void release_spare()
+	{
+		Node *n;
+
+		while ((n = spare)) {
+			spare = n->next;
+			delete n;
+		}
+		nspare = 0;
+	}
+
+	// Joins two root nodes together, assuming that node 'a' has priority
+	static Node *join(Node *a, Node *b)
+	{
+		if ((b->next = a->sub))
+			b->next->prev = b;
+		b->prev = a;
+		a->sub = b;
+		a->next = nullptr;
+		a->prev = nullptr;
+		return a;
+	}
+
+	// Merges two root-type nodes together in an heap ordered manner
+	Node *merge(Node *a, Node *b)
+	{
+		if (a == nullptr) {
+			b->prev = b->next = nullptr;
+			return b;
+		}
+		if (b == nullptr) {
+			a->prev = a->next = nullptr;
+			return a;
+		}
+		if (cmp(b->key, a->key))
+			return join(b, a);
+		return join(a, b);
+	}
+
+	// The chunked iterative merge-pairs pass from ph.c
+	Node *merge_pairs(Node *r)
+	{
+		Node *sn[MSN];
+		Node *n, *p, **m = sn, **l = sn + MSN;
+
+		for (r->prev = nullptr, p = r->next; p; p->next = r, r = p, p = p->next) {
+			for (n = p->next; r && (m < l); *m++ = merge(r, p), (r = n) && (p = r->next) ? (n = p->next) : (n = p));
+			for (p = *--m; m > sn; p = merge(*--m, p));
+		}
+		return r;
+	}
+
+	// Detaches the node from the heap.  d MUST NOT be the root node
+	void detach(Node *d)
+	{
+		Node *s;
+
+		if (d->sub) {
+			s = merge_pairs(d->sub);
+			s->prev = d->prev;
+			if ((s->next = d->next))
+				s->next->prev = s;
+		} else {
+			if ((s = d->next))
+				s->prev = d->prev;
+		}
+
+		if (d->prev->sub == d)
+			d->prev->sub = s;
+		else
+			d->prev->next = s;
+	}
+};
+
+#endif
@@ -0,0 +1,361 @@
+// Stew's paired heap implementation - compact 32-bit index version
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<string.h>
+#include	"ph32.h"
+
+// Nodes live in one array and refer to each other by index, with index 0 (PH32_NONE)
+// standing in for NULL.  Unused nodes are kept on a free list linked through next
+struct heap32 {
+	uint32_t	next;			// Next sibling
+	uint32_t	prev;			// Previous sibling or parent
+	uint32_t	sub;			// child-nodes
+	uint32_t	live;			// Non-zero while the node is in the heap
+	void		*key;			// The key to compare on
+};
+
+struct pheap32 {
+	int 		(*cmp)(void *, void *);	// User supplied compare function
+	struct heap32	*n;			// The node array.  n[0] is never used
+	void		**data;			// The data for each node, kept apart
+	uint32_t	root;			// The root of the actual heap
+	uint32_t	free;			// Free list of released nodes
+	uint32_t	used;			// Nodes in use or on the free list
+	uint32_t	cap;			// Length of the node and data arrays
+};
+
+
+// Default compare function that treats the void *key pointers as intptr_t
+// integers.  See heap_int_cmp() in ph.c
+static inline int heap32_int_cmp(register void *a, register void *b)
+{
+	return ((intptr_t)a > (intptr_t)b ? 1 : -1);
+} // heap32_int_cmp
+
+
+// Joins two root nodes together, assuming that node 'a' has priority
+static inline uint32_t
+heap32_join(register struct heap32 *h, register uint32_t a, register uint32_t b)
+{
+	if ((h[b].next = h[a].sub))
+		h[h[b].next].prev = b;
+	h[b].prev = a;
+	h[a].sub = b;
+	h[a].next = PH32_NONE;
+	h[a].prev = PH32_NONE;
+	return a;
+} // heap32_join
+
+
+// Merges two root-type nodes together in an heap ordered manner
+static inline __attribute__((always_inline)) uint32_t
+heap32_merge(int (*cmp)(void *, void *), register struct heap32 *h, register uint32_t a, register uint32_t b)
+{
+	if (a == PH32_NONE) {
+		h[b].prev = h[b].next = PH32_NONE;
+		return b;
+	}
+	if (b == PH32_NONE) {
+		h[a].prev = h[a].next = PH32_NONE;
+		return a;
+	}
+	if (cmp(h[a].key, h[b].key) < 0)
+		return heap32_join(h, a, b);
+	return heap32_join(h, b, a);
+} // heap32_merge
+
+
+// The chunked iterative merge pairs pass of heap_merge_pairs_iterative() in ph.c
+// with indices in place of pointers.  Only 4 bytes a node on the stack here
+#define	MSN	240	// Number of node indices we'll allocate on the stack
+static inline __attribute__((always_inline)) uint32_t
+heap32_merge_pairs_iterative(int (*cmp)(void *, void *), register struct heap32 *h, register uint32_t r)
+{
+	uint32_t	sn[MSN];
+	register uint32_t	n, p, *m = sn, *l = sn + MSN;
+
+	// Isolate the sub-chain from the parent.  Append any remainder with each pass
+	for(h[r].prev = PH32_NONE, p = h[r].next; p; h[p].next = r, r = p, p = h[p].next) {
+		// Do initial left-to-right pairing pass, then a reduction pairing pass right to left
+		for(n = h[p].next; r && (m < l); *m++ = heap32_merge(cmp, h, r, p), (r = n) && (p = h[r].next) ? (n = h[p].next) : (n = p));
+		for(p = *--m; m > sn; p = heap32_merge(cmp, h, *--m, p));
+	}
+	return r;
+} // heap32_merge_pairs_iterative
+
+
+// Selects the copy of the merge pairs pass with the default compare inlined
+static uint32_t
+heap32_merge_pairs(struct pheap32 *ph, uint32_t r)
+{
+	if (r == PH32_NONE)
+		return PH32_NONE;
+	if (ph->cmp == heap32_int_cmp)
+		return heap32_merge_pairs_iterative(heap32_int_cmp, ph->n, r);
+	return heap32_merge_pairs_iterative(ph->cmp, ph->n, r);
+} // heap32_merge_pairs
+
+
+// Merges two root-type nodes, with the default compare inlined
+static inline uint32_t
+heap32_merge_key(struct pheap32 *ph, uint32_t a, uint32_t b)
+{
+	if (ph->cmp == heap32_int_cmp)
+		return heap32_merge(heap32_int_cmp, ph->n, a, b);
+	return heap32_merge(ph->cmp, ph->n, a, b);
+} // heap32_merge_key
+
+
+// Grows the node and data arrays so there's room for at least one more node
+// Returns 0 if out of memory, or the heap is at its size limit
+static int
+heap32_grow(struct pheap32 *ph, uint64_t want)
+{
+	struct heap32 *n;
+	void **d;
+
+	if (want < 1024)
+		want = 1024;
+	if (want > (uint64_t)PH32_MAX_NODES + 1)
+		want = (uint64_t)PH32_MAX_NODES + 1;
+	if (want <= ph->cap)
+		return 0;
+
+	if ((n = (struct heap32 *)realloc(ph->n, want * sizeof(struct heap32))) == NULL)
+		return 0;
+	ph->n = n;
+	if ((d = (void **)realloc(ph->data, want * sizeof(void *))) == NULL)
+		return 0;
+	ph->data = d;
+	ph->cap = (uint32_t)want;
+	return 1;
+} // heap32_grow
+
+
+// Returns a node to the free list
+static inline void
+heap32_node_free(struct pheap32 *ph, uint32_t i)
+{
+	struct heap32 *h = ph->n;
+
+	h[i].next = ph->free;
+	h[i].prev = h[i].sub = PH32_NONE;
+	h[i].live = 0;
+	h[i].key = NULL;
+	ph->data[i] = NULL;
+	ph->free = i;
+} // heap32_node_free
+
+
+// Detaches the node from the heap.  d MUST NOT be the root node
+static void
+heap32_detach(struct pheap32 *ph, register uint32_t d)
+{
+	register struct heap32 *h = ph->n;
+	register uint32_t s;
+
+	if (h[d].sub) {
+		s = heap32_merge_pairs(ph, h[d].sub);
+		h[s].prev = h[d].prev;
+		if ((h[s].next = h[d].next))
+			h[h[s].next].prev = s;
+	} else {
+		if ((s = h[d].next))
+			h[s].prev = h[d].prev;
+	}
+
+	if (h[h[d].prev].sub == d)
+		h[h[d].prev].sub = s;
+	else
+		h[h[d].prev].next = s;
+} // heap32_detach
+
+
+uint32_t
+pheap32_insert(void *oph, void *key, void *data)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+	struct heap32 *h;
+	uint32_t i;
+
+	if ((i = ph->free)) {
+		ph->free = ph->n[i].next;
+	} else {
+		if ((ph->used + 1 >= ph->cap) && !heap32_grow(ph, (uint64_t)ph->cap << 1))
+			return PH32_NONE;
+		i = ++ph->used;
+	}
+	h = ph->n;
+	h[i].next = h[i].prev = h[i].sub = PH32_NONE;
+	h[i].live = 1;
+	h[i].key = key;
+	ph->data[i] = data;
+
+	if (ph->root == PH32_NONE)
+		ph->root = i;
+	else
+		ph->root = heap32_merge_key(ph, i, ph->root);
+	return i;
+} // pheap32_insert
+
+
+uint32_t
+pheap32_get_min_node(void *oph, void **key, void **data)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+	uint32_t r = ph ? ph->root : PH32_NONE;
+
+	if (key)
+		*key = r ? ph->n[r].key : NULL;
+	if (data)
+		*data = r ? ph->data[r] : NULL;
+	return r;
+} // pheap32_get_min_node
+
+
+int
+pheap32_delete_min(void *oph, void **key, void **data)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+	uint32_t r, nr;
+
+	if ((r = pheap32_get_min_node(oph, key, data)) == PH32_NONE)
+		return 0;
+
+	nr = ph->n[r].sub;
+	heap32_node_free(ph, r);
+	ph->root = heap32_merge_pairs(ph, nr);
+	return 1;
+} // pheap32_delete_min
+
+
+int
+pheap32_delete(void *oph, uint32_t d, void **key, void **data)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+
+	// Don't try to delete from an empty or non-existent heap, or a dead node
+	if ((ph == NULL) || (ph->root == PH32_NONE) || (d == PH32_NONE) || (d > ph->used) || !ph->n[d].live)
+		return 0;
+
+	if (d == ph->root)
+		return pheap32_delete_min(oph, key, data);
+
+	if (key)
+		*key = ph->n[d].key;
+	if (data)
+		*data = ph->data[d];
+	heap32_detach(ph, d);
+	heap32_node_free(ph, d);
+	return 1;
+} // pheap32_delete
+
+
+// Changes the key of the given node.  Follows pheap_change_key() in ph.c
+int
+pheap32_change_key(void *oph, uint32_t d, void *newkey)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+	struct heap32 *h;
+	int res;
+
+	// A dead node's links are the free list, so it must be left alone
+	if ((ph == NULL) || (ph->root == PH32_NONE) || (d == PH32_NONE) || (d > ph->used) || !ph->n[d].live)
+		return 0;
+	h = ph->n;
+
+	res = (ph->cmp == heap32_int_cmp) ? heap32_int_cmp(newkey, h[d].key) : ph->cmp(newkey, h[d].key);
+	h[d].key = newkey;
+
+	// Handle mega-easy key equivalence scenario
+	if (res == 0)
+		return 1;
+
+	if (d == ph->root) {				// The node == root-node scenarios
+		if ((res < 0) || (h[d].sub == PH32_NONE))
+			return 1;
+		ph->root = heap32_merge_pairs(ph, h[d].sub);
+	} else {
+		heap32_detach(ph, d);
+	}
+
+	h[d].next = h[d].prev = h[d].sub = PH32_NONE;
+	ph->root = heap32_merge_key(ph, ph->root, d);
+	return 1;
+} // pheap32_change_key
+
+
+void *
+pheap32_get_key(void *oph, uint32_t h)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+
+	return ((h == PH32_NONE) || (h > ph->used)) ? NULL : ph->n[h].key;
+} // pheap32_get_key
+
+
+void *
+pheap32_get_data(void *oph, uint32_t h)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+
+	return ((h == PH32_NONE) || (h > ph->used)) ? NULL : ph->data[h];
+} // pheap32_get_data
+
+
+void
+pheap32_set_data(void *oph, uint32_t h, void *newdata)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+
+	if ((h != PH32_NONE) && (h <= ph->used))
+		ph->data[h] = newdata;
+} // pheap32_set_data
+
+
+size_t
+pheap32_memory(void *oph)
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+
+	return sizeof(struct pheap32) + (size_t)ph->cap * (sizeof(struct heap32) + sizeof(void *));
+} // pheap32_memory
+
+
+// Releases the heap.  Since every node is in the one array, kd_free() is just
+// called on each live node in array order, and no tree walk is needed
+void
+pheap32_destroy(void *oph, void (*kd_free)(void *, void *))
+{
+	struct pheap32 *ph = (struct pheap32 *)oph;
+	uint32_t i;
+
+	if (ph == NULL)
+		return;
+	if (kd_free) {
+		for (i = 1; i <= ph->used; i++)
+			if (ph->n[i].live)
+				kd_free(ph->n[i].key, ph->data[i]);
+	}
+	free(ph->n);
+	free(ph->data);
+	memset(ph, 0, sizeof(struct pheap32));
+	free(ph);
+} // pheap32_destroy
+
+
+void *
+pheap32_create(int (*cmp)(void *, void *), uint32_t reserve)
+{
+	struct pheap32 *ph;
+
+	ph = (struct pheap32 *)calloc(sizeof(struct pheap32), 1);
+	if (ph == NULL)
+		return NULL;
+	ph->cmp = (cmp == NULL) ? heap32_int_cmp : cmp;
+	if (!heap32_grow(ph, (uint64_t)reserve + 1)) {
+		pheap32_destroy(ph, NULL);
+		return NULL;
+	}
+	return (void *)ph;
+} // pheap32_create
@@ -0,0 +1,65 @@
+// Stew's paired heap implementation - compact 32-bit index version
+//
+// The same paired heap algorithm as ph.c, but with every node held in one contiguous
+// growable array, and linked together with 32-bit array indices instead of pointers.
+// The links and key of a node take 24 bytes, and its data is kept in a separate array
+// that the pairing passes never touch.  Node handles are 32-bit indices rather than
+// pointers, and remain valid as the array grows.  Suits very large heaps, of up to
+// PH32_MAX_NODES nodes, where the memory used by ph.c (40 bytes per node, plus the
+// system allocator's overheads) matters
+
+#ifndef __PH32_H
+#define __PH32_H
+
+#include	<stddef.h>
+#include	<stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The handle value that refers to no node
+#define	PH32_NONE	0
+
+#define	PH32_MAX_NODES	0xfffffffeU
+
+// Creates a compact paired heap.  cmp() is as for pheap_create() in ph.h, and may be NULL
+// for integer keys.  Space for reserve nodes is allocated up front
+// Returns an opaque handle to the heap, or NULL on failure
+void *pheap32_create(int (*cmp)(void *, void *), uint32_t reserve);
+
+// Releases the heap and all of its nodes.  kd_free() is as for pheap_destroy() in ph.h
+void pheap32_destroy(void *oph, void (*kd_free)(void *, void *));
+
+// Inserts the key/data tuple.  Returns the node's handle, or PH32_NONE if out of memory
+uint32_t pheap32_insert(void *oph, void *key, void *data);
+
+// Returns the handle of the least node, or PH32_NONE if the heap is empty
+// Sets key and data to that in the node if they are non-NULL
+uint32_t pheap32_get_min_node(void *oph, void **key, void **data);
+
+// Deletes the least node.  Sets key and data to that in the node if they are non-NULL
+// Returns 1 if a node was deleted, and 0 if the heap was empty
+int pheap32_delete_min(void *oph, void **key, void **data);
+
+// Deletes the node with handle h in-place.  Sets key and data to that in the node if they
+// are non-NULL.  Returns 1 if the node was deleted, and 0 on invalid parameters
+int pheap32_delete(void *oph, uint32_t h, void **key, void **data);
+
+// Changes the key of the node with handle h.  Returns 1 if the key was changed, and 0 on
+// invalid parameters, such as the handle of a node that has been deleted
+int pheap32_change_key(void *oph, uint32_t h, void *newkey);
+
+// Gets or sets the key and data of the node with handle h
+void *pheap32_get_key(void *oph, uint32_t h);
+void *pheap32_get_data(void *oph, uint32_t h);
+void pheap32_set_data(void *oph, uint32_t h, void *newdata);
+
+// Returns the number of bytes of memory held by the heap
+size_t pheap32_memory(void *oph);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
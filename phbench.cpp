@@ -0,0 +1,371 @@
+// Paired Heap Comparative Benchmark Harness
+//
+// Runs the same workloads through the C library, std::priority_queue and an indexed
+// d-ary array heap, with warmup runs and repeated trials over a sweep of heap sizes,
+// and prints the median, mean, standard deviation and minimum ns per operation as a
+// text table, CSV or JSON on stdout.  The Makefile builds it twice, as phbench with the
+// default iterative merge pairs pass, and as phbench_rec with ph.c built with
+// __PH_USE_RECURSIVE_MERGE.  PHBENCH_PH_NAME labels whichever one is linked in
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <string.h>
+#include        <math.h>
+#include        <time.h>
+#include	<unistd.h>
+#include	<queue>
+#include	<vector>
+#include	<algorithm>
+#include	"ph.h"
+
+#ifndef PHBENCH_PH_NAME
+#define	PHBENCH_PH_NAME	"pheap"
+#endif
+
+#define	FMT_TEXT	0
+#define	FMT_CSV		1
+#define	FMT_JSON	2
+
+static inline uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // bench_ns
+
+
+// Each heap is wrapped in an adapter with the same members, so that the workloads
+// are written once as templates, and every call is inlined.  Ids run from 0 to n-1,
+// and decrease() lowers the key of an id that is still in the heap
+
+// The C library, with the built-in default compare
+struct PHeapAdapter {
+	void			*heap;
+	std::vector<void *>	nodes;
+
+	PHeapAdapter(intptr_t n) : nodes(n) {
+		heap = pheap_create_ex(NULL, PH_OPT_POOL);
+		pheap_reserve(heap, n);
+	}
+	~PHeapAdapter() { pheap_destroy(heap, NULL); }
+	inline void push(intptr_t key, intptr_t id) {
+		nodes[id] = pheap_insert(heap, (void *)key, (void *)id);
+	}
+	inline bool pop(intptr_t &key, intptr_t &id) {
+		return pheap_delete_min(heap, (void **)&key, (void **)&id);
+	}
+	inline void decrease(intptr_t id, intptr_t key) {
+		pheap_change_key(heap, nodes[id], (void *)key);
+	}
+	static const char *name() { return PHBENCH_PH_NAME; }
+};
+
+// std::priority_queue, which has no decrease key.  A decrease pushes a new entry, and
+// pop() skips entries whose key is no longer current
+struct StdAdapter {
+	typedef std::pair<intptr_t, intptr_t> Entry;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > pq;
+	std::vector<intptr_t>	cur;
+
+	StdAdapter(intptr_t n) : cur(n) {}
+	inline void push(intptr_t key, intptr_t id) {
+		cur[id] = key;
+		pq.push(Entry(key, id));
+	}
+	inline bool pop(intptr_t &key, intptr_t &id) {
+		while (!pq.empty()) {
+			Entry e = pq.top();
+			pq.pop();
+			if (cur[e.second] == e.first) {
+				key = e.first;
+				id = e.second;
+				cur[id] = INTPTR_MIN;
+				return true;
+			}
+		}
+		return false;
+	}
+	inline void decrease(intptr_t id, intptr_t key) { push(key, id); }
+	static const char *name() { return "std::priority_queue"; }
+};
+
+// An indexed 4-ary min heap in one array, with each id's position kept for decrease key
+struct DaryAdapter {
+	enum { D = 4 };
+	struct Entry {
+		intptr_t	key;
+		intptr_t	id;
+	};
+	std::vector<Entry>	a;
+	std::vector<intptr_t>	pos;
+
+	DaryAdapter(intptr_t n) : pos(n) { a.reserve(n); }
+	inline void place(intptr_t i, const Entry &e) {
+		a[i] = e;
+		pos[e.id] = i;
+	}
+	inline void up(intptr_t i, Entry e) {
+		intptr_t p;
+
+		for (; i > 0 && a[p = (i - 1) / D].key > e.key; i = p)
+			place(i, a[p]);
+		place(i, e);
+	}
+	inline void down(intptr_t i, Entry e) {
+		intptr_t c, best, end, n = a.size();
+
+		while ((c = i * D + 1) < n) {
+			end = std::min(c + D, n);
+			for (best = c++; c < end; c++)
+				if (a[c].key < a[best].key)
+					best = c;
+			if (a[best].key >= e.key)
+				break;
+			place(i, a[best]);
+			i = best;
+		}
+		place(i, e);
+	}
+	inline void push(intptr_t key, intptr_t id) {
+		Entry e = { key, id };
+
+		a.push_back(e);
+		up(a.size() - 1, e);
+	}
+	inline bool pop(intptr_t &key, intptr_t &id) {
+		if (a.empty())
+			return false;
+		key = a[0].key;
+		id = a[0].id;
+		Entry last = a.back();
+		a.pop_back();
+		if (!a.empty())
+			down(0, last);
+		return true;
+	}
+	inline void decrease(intptr_t id, intptr_t key) {
+		Entry e = { key, id };
+
+		up(pos[id], e);
+	}
+	static const char *name() { return "4-ary heap"; }
+};
+
+
+// The workloads.  Each returns the number of heap operations run, or -1 if keys came
+// out of order or the heap ran out of keys early
+
+// Inserts all n keys, and deletes them all again
+template <class H>
+intptr_t
+work_sort(H &h, const std::vector<intptr_t> &keys)
+{
+	intptr_t n = keys.size(), i, key = 0, id = 0, last = INTPTR_MIN;
+
+	for (i = 0; i < n; i++)
+		h.push(keys[i], i);
+	for (i = 0; h.pop(key, id); i++) {
+		if (key < last)
+			return -1;
+		last = key;
+	}
+	return (i == n) ? 2 * n : -1;
+} // work_sort
+
+
+// The hold model.  Fills the heap with n keys, and then does n deletes of the least
+// key t, each followed by an insert of t plus a random increment
+template <class H>
+intptr_t
+work_hold(H &h, const std::vector<intptr_t> &keys)
+{
+	intptr_t n = keys.size(), i, key = 0, id = 0, last = INTPTR_MIN;
+
+	for (i = 0; i < n; i++)
+		h.push(keys[i], i);
+	for (i = 0; i < n; i++) {
+		if (!h.pop(key, id) || (key < last))
+			return -1;
+		last = key;
+		h.push(key + (keys[i] >> 8), id);
+	}
+	return 2 * n;
+} // work_hold
+
+
+// Inserts n keys, decreases the keys of a quarter of them, and drains the heap, as
+// a shortest path search would
+template <class H>
+intptr_t
+work_decrease(H &h, const std::vector<intptr_t> &keys)
+{
+	intptr_t n = keys.size(), i, key = 0, id = 0, last = INTPTR_MIN;
+
+	for (i = 0; i < n; i++)
+		h.push(keys[i], i);
+	for (i = 0; i < n; i += 4)
+		h.decrease(i, keys[i] - (keys[n - i - 1] >> 2));
+	for (i = 0; h.pop(key, id); i++) {
+		if (key < last)
+			return -1;
+		last = key;
+	}
+	return (i == n) ? n + (n + 3) / 4 + n : -1;
+} // work_decrease
+
+
+struct workload {
+	const char	*name;
+	intptr_t	(*run[3])(intptr_t n, const std::vector<intptr_t> &keys);
+};
+
+template <class H, intptr_t (*W)(H &, const std::vector<intptr_t> &)>
+intptr_t
+run_one(intptr_t n, const std::vector<intptr_t> &keys)
+{
+	H h(n);
+
+	return W(h, keys);
+} // run_one
+
+#define	WORKLOAD(fn)	{ run_one<PHeapAdapter, fn<PHeapAdapter> >, \
+			  run_one<StdAdapter, fn<StdAdapter> >, \
+			  run_one<DaryAdapter, fn<DaryAdapter> > }
+
+static const workload workloads[] = {
+	{ "sort",	WORKLOAD(work_sort) },
+	{ "hold",	WORKLOAD(work_hold) },
+	{ "decrease",	WORKLOAD(work_decrease) },
+};
+#define	NWORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+static const char *impl_names[3] = { PHeapAdapter::name(), StdAdapter::name(), DaryAdapter::name() };
+
+
+// Times trials runs of one workload on one heap after warmups untimed runs, and prints
+// the result row.  Each run creates and destroys its own heap inside the timing.  Returns 1 on success, and 0 if the workload failed
+int
+bench(const workload &w, int impl, const std::vector<intptr_t> &keys, int warmups, int trials, int fmt, bool &first)
+{
+	std::vector<double> ns(trials);
+	intptr_t n = keys.size(), ops = 0;
+	double mean = 0, var = 0, median;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < warmups; i++)
+		if (w.run[impl](n, keys) < 0)
+			return 0;
+	for (i = 0; i < trials; i++) {
+		start = bench_ns();
+		if ((ops = w.run[impl](n, keys)) < 0)
+			return 0;
+		ns[i] = (double)(bench_ns() - start) / ops;
+		mean += ns[i];
+	}
+	mean /= trials;
+	for (i = 0; i < trials; i++)
+		var += (ns[i] - mean) * (ns[i] - mean);
+	var = (trials > 1) ? var / (trials - 1) : 0;
+	std::sort(ns.begin(), ns.end());
+	median = (trials & 1) ? ns[trials / 2] : (ns[trials / 2 - 1] + ns[trials / 2]) / 2;
+
+	switch (fmt) {
+	case FMT_CSV:
+		printf("%s,%s,%ld,%ld,%d,%.2f,%.2f,%.2f,%.2f\n", impl_names[impl], w.name, n, ops,
+		       trials, median, mean, sqrt(var), ns[0]);
+		break;
+	case FMT_JSON:
+		printf("%s\n  {\"impl\": \"%s\", \"workload\": \"%s\", \"n\": %ld, \"ops\": %ld, \"trials\": %d, "
+		       "\"median_ns\": %.2f, \"mean_ns\": %.2f, \"stddev_ns\": %.2f, \"min_ns\": %.2f}",
+		       first ? "" : ",", impl_names[impl], w.name, n, ops, trials, median, mean, sqrt(var), ns[0]);
+		break;
+	default:
+		printf("%-20s %-10s %10ld %8.1f %8.1f %8.2f %8.1f\n", impl_names[impl], w.name, n,
+		       median, mean, sqrt(var), ns[0]);
+		break;
+	}
+	first = false;
+	fflush(stdout);
+	return 1;
+} // bench
+
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f text|csv|json] [-t trials] [-w warmups] [-n from,to,factor]\n", prog);
+	fprintf(stderr, "  Sweeps n from from to to, multiplying by factor (default 1000,1000000,10)\n");
+} // usage
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t from = 1000, to = 1000000, factor = 10, n, i;
+	int fmt = FMT_TEXT, trials = 7, warmups = 1, impl, opt, failed = 0;
+	bool first = true;
+	size_t w;
+
+	while ((opt = getopt(argc, argv, "f:t:w:n:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (strcmp(optarg, "csv") == 0)
+				fmt = FMT_CSV;
+			else if (strcmp(optarg, "json") == 0)
+				fmt = FMT_JSON;
+			else if (strcmp(optarg, "text") == 0)
+				fmt = FMT_TEXT;
+			else
+				fmt = -1;
+			break;
+		case 't':
+			trials = atoi(optarg);
+			break;
+		case 'w':
+			warmups = atoi(optarg);
+			break;
+		case 'n':
+			if (sscanf(optarg, "%ld,%ld,%ld", &from, &to, &factor) != 3)
+				factor = 0;
+			break;
+		default:
+			fmt = -1;
+			break;
+		}
+	}
+	if ((fmt < 0) || (optind != argc) || (trials < 1) || (warmups < 0) || (from < 1) || (to < from) || (factor < 2)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (fmt == FMT_CSV)
+		printf("impl,workload,n,ops,trials,median_ns,mean_ns,stddev_ns,min_ns\n");
+	else if (fmt == FMT_JSON)
+		printf("[");
+	else
+		printf("%-20s %-10s %10s %8s %8s %8s %8s\n", "IMPL", "WORKLOAD", "N", "MEDIAN", "MEAN", "STDDEV", "MIN");
+
+	for (n = from; n <= to; n *= factor) {
+		std::vector<intptr_t> keys(n);
+
+		srandom(n);
+		for (i = 0; i < n; i++)
+			keys[i] = ((intptr_t)random() << 16) ^ random();
+		for (w = 0; w < NWORKLOADS; w++) {
+			for (impl = 0; impl < 3; impl++) {
+				if (!bench(workloads[w], impl, keys, warmups, trials, fmt, first)) {
+					fprintf(stderr, "%s %s n=%ld FAILED - Keys out of order or missing\n", impl_names[impl],
+						workloads[w].name, n);
+					failed = 1;
+				}
+			}
+		}
+	}
+	if (fmt == FMT_JSON)
+		printf("\n]\n");
+	return failed;
+} // main
@@ -0,0 +1,236 @@
+// Paired Heap C++ Template Test Framework
+//
+// Runs the same workloads through the C library (with a user compare callback, and with
+// the built-in default compare) and through the PairingHeap<> template in ph.hpp, so that
+// the gain from inlining the comparator can be seen
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <time.h>
+#include	<vector>
+#include	<memory>
+#include	<string>
+#include	"ph.h"
+#include	"ph.hpp"
+
+#define TIME_START 0
+#define TIME_SETUP 1
+#define TIME_DONE  2
+
+double
+test_time(int t)
+{
+	static struct timespec at_start, after_setup, at_done;
+	double taken = 0;
+
+	switch(t) {
+	case TIME_START:
+		clock_gettime(CLOCK_REALTIME, &at_start);
+		break;
+	case TIME_SETUP:
+		clock_gettime(CLOCK_REALTIME, &after_setup);
+		taken = after_setup.tv_nsec - at_start.tv_nsec;
+		taken /= 1000000000;
+		taken += after_setup.tv_sec - at_start.tv_sec;
+		fprintf(stderr, "Time to setup: %.3f\n", taken);
+		break;
+	case TIME_DONE:
+		clock_gettime(CLOCK_REALTIME, &at_done);
+		taken = at_done.tv_nsec - after_setup.tv_nsec;
+		taken /= 1000000000;
+		taken += at_done.tv_sec - after_setup.tv_sec;
+		fprintf(stderr, "Time to run: %.3f\n", taken);
+		break;
+	default:
+		fprintf(stderr, "Illegal argument to %s\n", __FUNCTION__);
+		break;
+	}
+	return taken;
+} // test_time
+
+
+static int
+user_cmp(void *a, void *b)
+{
+	return ((intptr_t)a < (intptr_t)b) ? -1 : ((intptr_t)a > (intptr_t)b);
+} // user_cmp
+
+
+// Insert count keys, run count del_min + insert's, then change count/4 keys, and
+// finally drain the heap checking the order.  Returns the time taken to run
+double
+test_c(intptr_t count, int (*cmp)(void *, void *), const std::vector<intptr_t> &keys)
+{
+	void *heap, *data, **nodes;
+	intptr_t i, ex, lex;
+	double taken;
+
+	fprintf(stderr, "C LIBRARY - %s COMPARE\n", cmp ? "USER CALLBACK" : "DEFAULT");
+
+	nodes = (void **)calloc(count, sizeof(void *));
+	heap = pheap_create_ex(cmp, PH_OPT_POOL);
+	if ((heap == NULL) || (nodes == NULL)) {
+		fprintf(stderr, "C FAILED - Out of memory\n");
+		free(nodes);
+		return 0;
+	}
+
+	test_time(TIME_START);
+	for (i = 0; i < count; i++)
+		nodes[i] = pheap_insert(heap, (void *)keys[i], (void *)keys[i]);
+	test_time(TIME_SETUP);
+
+	for (i = 0; i < count; i++) {
+		pheap_delete_min(heap, NULL, NULL);
+		ex = keys[(i + count / 2) % count];
+		nodes[i] = pheap_insert(heap, (void *)ex, (void *)ex);
+	}
+	for (i = 0; i < count; i += 4) {
+		ex = keys[count - i - 1];
+		pheap_change_key(heap, nodes[i], (void *)ex);
+		pheap_set_data(nodes[i], (void *)ex);
+	}
+	i = ex = lex = 0;
+	while (pheap_delete_min(heap, NULL, &data)) {
+		ex = (intptr_t)data;
+		if (ex < lex)
+			break;
+		lex = ex;
+		i++;
+	}
+	taken = test_time(TIME_DONE);
+
+	if (i < count)
+		fprintf(stderr, "C FAILED - Out of order after %ld deletions\n", i);
+	else
+		fprintf(stderr, "C PASSED\n");
+
+	pheap_destroy(heap, NULL);
+	free(nodes);
+	return taken;
+} // test_c
+
+
+// The same workload as test_c(), through the C++ template
+double
+test_cpp(intptr_t count, const std::vector<intptr_t> &keys)
+{
+	typedef PairingHeap<intptr_t, intptr_t> Heap;
+	Heap heap;
+	std::vector<Heap::Handle> nodes(count);
+	intptr_t i, ex, lex, data;
+	double taken;
+
+	fprintf(stderr, "C++ TEMPLATE - INLINED COMPARE\n");
+
+	test_time(TIME_START);
+	for (i = 0; i < count; i++)
+		nodes[i] = heap.insert(keys[i], keys[i]);
+	test_time(TIME_SETUP);
+
+	for (i = 0; i < count; i++) {
+		heap.pop();
+		ex = keys[(i + count / 2) % count];
+		nodes[i] = heap.insert(ex, ex);
+	}
+	for (i = 0; i < count; i += 4) {
+		ex = keys[count - i - 1];
+		heap.change_key(nodes[i], ex);
+		nodes[i].value() = ex;
+	}
+	i = ex = lex = 0;
+	while (heap.pop(NULL, &data)) {
+		ex = data;
+		if (ex < lex)
+			break;
+		lex = ex;
+		i++;
+	}
+	taken = test_time(TIME_DONE);
+
+	if (i < count)
+		fprintf(stderr, "C++ FAILED - Out of order after %ld deletions\n", i);
+	else
+		fprintf(stderr, "C++ PASSED\n");
+	return taken;
+} // test_cpp
+
+
+// Checks that the template lets go of each element's key and value as soon as the
+// element leaves the heap, by holding a shared_ptr in every value
+int
+test_release(intptr_t count, const std::vector<intptr_t> &keys)
+{
+	typedef PairingHeap<std::string, std::shared_ptr<int>> Heap;
+	std::shared_ptr<int> res = std::make_shared<int>(0);
+	std::string lkey, key;
+	Heap heap;
+	intptr_t i, bad = 0;
+
+	fprintf(stderr, "C++ TEMPLATE - ELEMENT RELEASE\n");
+
+	for (i = 0; i < count; i++)
+		heap.insert(std::to_string(keys[i]), res);
+	bad += (res.use_count() != count + 1);
+
+	// Pop half without keeping the values, then clear the rest
+	for (i = 0; i < count / 2; i++) {
+		heap.pop(&key);
+		bad += (i && (key < lkey));
+		lkey = key;
+	}
+	bad += (res.use_count() != count - count / 2 + 1);
+	heap.clear();
+	bad += (res.use_count() != 1) || (heap.size() != 0);
+
+	// The kept nodes are reused by later inserts, and erase() lets go too
+	for (i = 0; i < count; i++)
+		heap.insert(std::to_string(keys[i]), res);
+	for (i = 0; i < count; i++)
+		heap.erase(heap.top());
+	heap.shrink_to_fit();
+	bad += (res.use_count() != 1) || !heap.empty();
+
+	if (bad)
+		fprintf(stderr, "C++ FAILED - %ld bad results\n", bad);
+	else
+		fprintf(stderr, "C++ PASSED\n");
+	return !bad;
+} // test_release
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t i, count;
+	double tcb, tdef, tcpp;
+
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s count\n", argv[0]);
+		return 0;
+	}
+	count = (intptr_t)atoi(argv[1]);
+	if(count < 1) {
+		fprintf(stderr, "%s: count must be an integer of 1 or greater\n", argv[0]);
+		return 0;
+	}
+
+	std::vector<intptr_t> keys(count);
+	for (i = 0; i < count; i++)
+		keys[i] = (intptr_t)random() % INTPTR_MAX;
+
+	tcb = test_c(count, user_cmp, keys);
+	fprintf(stderr, "\n");
+	tdef = test_c(count, NULL, keys);
+	fprintf(stderr, "\n");
+	tcpp = test_cpp(count, keys);
+	fprintf(stderr, "\n");
+	test_release(count, keys);
+	fprintf(stderr, "\n");
+
+	if (tcpp > 0)
+		fprintf(stderr, "C++ template speedup: %.2fx over user callback, %.2fx over default compare\n",
+			tcb / tcpp, tdef / tcpp);
+	return 0;
+} // main
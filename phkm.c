@@ -0,0 +1,292 @@
+// Paired Heap K-Way Merge Test Framework
+//
+// Generates sorted run files of 16 byte records in a local directory, and then
+// measures how fast phmerge.c can merge them, against just reading the files and
+// against a merge that does a delete min + insert for every record
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <string.h>
+#include        <time.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"ph.h"
+#include	"phmerge.h"
+
+struct km_rec {
+	uint64_t	key;
+	uint64_t	payload;
+};
+
+
+double
+km_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // km_now
+
+
+static int
+km_cmp(void *a, void *b)
+{
+	uint64_t x = ((struct km_rec *)a)->key, y = ((struct km_rec *)b)->key;
+
+	return (x < y) ? -1 : (x > y);
+} // km_cmp
+
+
+static uint64_t
+km_prefix(void *a)
+{
+	return ((struct km_rec *)a)->key;
+} // km_prefix
+
+
+static int
+km_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+} // km_u64_cmp
+
+
+// Writes nruns run files of per records each.  Returns 1 on success
+int
+km_generate(char **paths, int nruns, intptr_t per)
+{
+	struct km_rec *recs;
+	uint64_t *keys;
+	intptr_t i;
+	int r, fd;
+
+	recs = (struct km_rec *)malloc(per * sizeof(struct km_rec));
+	keys = (uint64_t *)malloc(per * sizeof(uint64_t));
+	if ((recs == NULL) || (keys == NULL)) {
+		free(recs);
+		free(keys);
+		return 0;
+	}
+	for (r = 0; r < nruns; r++) {
+		for (i = 0; i < per; i++)
+			keys[i] = ((uint64_t)random() << 31) ^ random();
+		qsort(keys, per, sizeof(uint64_t), km_u64_cmp);
+		for (i = 0; i < per; i++) {
+			recs[i].key = keys[i];
+			recs[i].payload = ((uint64_t)r << 32) | i;
+		}
+		if ((fd = open(paths[r], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+			break;
+		if (write(fd, recs, per * sizeof(struct km_rec)) != (ssize_t)(per * sizeof(struct km_rec))) {
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	free(recs);
+	free(keys);
+	return (r == nruns);
+} // km_generate
+
+
+// Reads every run file from start to end with large reads.  Returns bytes read
+int64_t
+km_read_all(char **paths, int nruns)
+{
+	static char buf[1 << 20];
+	int64_t total = 0;
+	ssize_t n;
+	int r, fd;
+
+	for (r = 0; r < nruns; r++) {
+		if ((fd = open(paths[r], O_RDONLY)) < 0)
+			return -1;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			total += n;
+		close(fd);
+	}
+	return total;
+} // km_read_all
+
+
+// Checks that the output file holds count records in sorted order
+int
+km_verify(const char *path, int64_t count)
+{
+	struct km_rec *recs;
+	struct stat st;
+	int64_t i;
+	int fd, ok = 1;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if ((fstat(fd, &st) < 0) || (st.st_size != count * (int64_t)sizeof(struct km_rec))) {
+		close(fd);
+		return 0;
+	}
+	recs = (struct km_rec *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (recs == MAP_FAILED)
+		return 0;
+	for (i = 1; ok && (i < count); i++)
+		if (recs[i].key < recs[i - 1].key)
+			ok = 0;
+	munmap(recs, st.st_size);
+	return ok;
+} // km_verify
+
+
+// Merges the runs with a delete min and an insert for every record, the way
+// the merge was done before phmerge.c.  Returns the number of records merged
+int64_t
+km_merge_reinsert(char **paths, int nruns, int fd)
+{
+	struct km_rec **cur, **end, *rec;
+	static struct km_rec buf[65536];
+	void *heap;
+	struct stat st;
+	int64_t count = 0;
+	intptr_t r;
+	size_t used = 0;
+	int rfd;
+
+	cur = (struct km_rec **)calloc(nruns, sizeof(struct km_rec *));
+	end = (struct km_rec **)calloc(nruns, sizeof(struct km_rec *));
+	if ((cur == NULL) || (end == NULL) || ((heap = pheap_create(km_cmp)) == NULL)) {
+		free(cur);
+		free(end);
+		return -1;
+	}
+	for (r = 0; r < nruns; r++) {
+		if ((rfd = open(paths[r], O_RDONLY)) < 0)
+			break;
+		fstat(rfd, &st);
+		cur[r] = (struct km_rec *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rfd, 0);
+		close(rfd);
+		end[r] = cur[r] + st.st_size / sizeof(struct km_rec);
+		pheap_insert(heap, cur[r], (void *)r);
+	}
+	while (pheap_delete_min(heap, (void **)&rec, (void **)&r)) {
+		buf[used++] = *rec;
+		if (used == 65536) {
+			if (write(fd, buf, sizeof(buf)) < 0)
+				break;
+			used = 0;
+		}
+		count++;
+		if (rec + 1 < end[r])
+			pheap_insert(heap, rec + 1, (void *)r);
+	}
+	if (used && (write(fd, buf, used * sizeof(struct km_rec)) < 0))
+		count = -1;
+	for (r = 0; r < nruns; r++)
+		if (cur[r])
+			munmap(cur[r], (char *)end[r] - (char *)cur[r]);
+	pheap_destroy(heap, NULL);
+	free(cur);
+	free(end);
+	return count;
+} // km_merge_reinsert
+
+
+// Runs one of the merges into the output file.  mode 0 is phmerge_to_fd(), mode 1
+// is phmerge_to_fd() with key prefixes, and mode 2 is km_merge_reinsert()
+// Returns MB/s of records merged, or 0 on failure
+double
+km_merge(char **paths, int nruns, int64_t total, const char *opath, int mode)
+{
+	static const char *names[] = { "PHMERGE CHANGE_KEY", "PHMERGE CHANGE_KEY + PREFIX", "DELETE_MIN + INSERT" };
+	int64_t count;
+	double start, taken;
+	int fd;
+
+	if ((fd = open(opath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "%s FAILED - Unable to create %s\n", names[mode], opath);
+		return 0;
+	}
+	start = km_now();
+	if (mode == 2)
+		count = km_merge_reinsert(paths, nruns, fd);
+	else
+		count = phmerge_to_fd((const char **)paths, nruns, sizeof(struct km_rec), km_cmp,
+				      (mode == 1) ? km_prefix : NULL, fd);
+	taken = km_now() - start;
+	close(fd);
+
+	if ((count != total) || !km_verify(opath, count)) {
+		fprintf(stderr, "%-28s FAILED - merged %ld of %ld records\n", names[mode], count, total);
+		return 0;
+	}
+	fprintf(stderr, "%-28s PASSED - %.3fs, %8.1f MB/s, %6.1f ns/record\n", names[mode], taken,
+		(total * sizeof(struct km_rec)) / taken / 1000000.0, taken * 1000000000.0 / total);
+	return (total * sizeof(struct km_rec)) / taken / 1000000.0;
+} // km_merge
+
+
+int
+main(int argc, char *argv[])
+{
+	const char *dir = "/tmp";
+	char **paths = NULL, opath[4096];
+	intptr_t count, per;
+	int64_t bytes;
+	int nruns, r;
+	double start, taken, change, reinsert;
+
+	if((argc != 3) && (argc != 4)) {
+		fprintf(stderr, "Usage: %s nruns count [dir]\n", argv[0]);
+		return 0;
+	}
+	nruns = atoi(argv[1]);
+	count = (intptr_t)atoi(argv[2]);
+	if((nruns < 1) || (count < nruns)) {
+		fprintf(stderr, "%s: nruns must be 1 or greater, and count at least nruns\n", argv[0]);
+		return 0;
+	}
+	if (argc == 4)
+		dir = argv[3];
+	per = count / nruns;
+
+	if ((paths = (char **)calloc(nruns, sizeof(char *))) == NULL)
+		return 1;
+	for (r = 0; r < nruns; r++) {
+		if ((paths[r] = (char *)malloc(4096)) == NULL)
+			goto km_cleanup;
+		snprintf(paths[r], 4096, "%s/phkm.%d.run.%d", dir, (int)getpid(), r);
+	}
+	snprintf(opath, sizeof(opath), "%s/phkm.%d.out", dir, (int)getpid());
+
+	fprintf(stderr, "TEST - K-WAY MERGE OF %d RUNS OF %ld RECORDS (%ld MB)\n", nruns, per,
+		(long)((nruns * per * sizeof(struct km_rec)) >> 20));
+	if (!km_generate(paths, nruns, per)) {
+		fprintf(stderr, "FAILED - Unable to write the run files in %s\n", dir);
+		goto km_cleanup;
+	}
+
+	start = km_now();
+	bytes = km_read_all(paths, nruns);
+	taken = km_now() - start;
+	fprintf(stderr, "%-28s        - %.3fs, %8.1f MB/s\n", "READ RUN FILES", taken, bytes / taken / 1000000.0);
+
+	change = km_merge(paths, nruns, nruns * per, opath, 0);
+	km_merge(paths, nruns, nruns * per, opath, 1);
+	reinsert = km_merge(paths, nruns, nruns * per, opath, 2);
+	if ((change > 0) && (reinsert > 0))
+		fprintf(stderr, "pheap_change_key() merge speedup over delete min + insert: %.2fx\n", change / reinsert);
+
+km_cleanup:
+	for (r = 0; r < nruns; r++) {
+		if (paths[r]) {
+			unlink(paths[r]);
+			free(paths[r]);
+		}
+	}
+	unlink(opath);
+	free(paths);
+} // main
@@ -0,0 +1,183 @@
+// Stew's paired heap k-way merge - merges sorted run files, such as for an external sort
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"phmerge.h"
+
+#define	PHMERGE_WBUF	(1 << 20)	// Size of the phmerge_to_fd() write buffer
+
+struct phmerge_run {
+	char		*base;			// Start of the mapped file
+	size_t		len;			// Length of the mapped file
+	char		*end;			// End of the last record
+};
+
+struct phmerge_writer {
+	int		fd;
+	int		err;			// Non-zero once a write has failed
+	size_t		used;			// Bytes waiting in buf
+	size_t		recsize;		// Size of each record
+	char		*buf;
+};
+
+
+// Unmaps every run, and releases the run array
+static void
+phmerge_unmap(struct phmerge_run *runs, int nruns)
+{
+	int i;
+
+	for (i = 0; i < nruns; i++)
+		if (runs[i].base)
+			munmap(runs[i].base, runs[i].len);
+	free(runs);
+} // phmerge_unmap
+
+
+// Maps every run file.  Returns the run array, or NULL on failure
+static struct phmerge_run *
+phmerge_map(const char **paths, int nruns, size_t recsize)
+{
+	struct phmerge_run *runs;
+	struct stat st;
+	int i, fd;
+
+	if ((runs = (struct phmerge_run *)calloc(nruns, sizeof(struct phmerge_run))) == NULL)
+		return NULL;
+
+	for (i = 0; i < nruns; i++) {
+		if ((fd = open(paths[i], O_RDONLY)) < 0)
+			goto map_fail;
+		if ((fstat(fd, &st) < 0) || (st.st_size % recsize)) {
+			close(fd);
+			goto map_fail;
+		}
+		// Empty runs are left unmapped, and never get a node
+		if (st.st_size > 0) {
+			runs[i].len = st.st_size;
+			runs[i].base = (char *)mmap(NULL, runs[i].len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (runs[i].base == MAP_FAILED) {
+				runs[i].base = NULL;
+				close(fd);
+				goto map_fail;
+			}
+			madvise(runs[i].base, runs[i].len, MADV_SEQUENTIAL);
+			runs[i].end = runs[i].base + runs[i].len;
+		}
+		close(fd);
+	}
+	return runs;
+
+map_fail:
+	phmerge_unmap(runs, nruns);
+	return NULL;
+} // phmerge_map
+
+
+int64_t
+phmerge_files(const char **paths, int nruns, size_t recsize, int (*cmp)(void *, void *),
+	      uint64_t (*prefix)(void *), int (*out)(void *rec, void *ctx), void *ctx)
+{
+	struct phmerge_run *runs, *run;
+	void *heap, *node, *rec;
+	int64_t count = 0;
+	int i;
+
+	if ((nruns < 0) || (recsize == 0) || (cmp == NULL))
+		return -1;
+	if ((runs = phmerge_map(paths, nruns, recsize)) == NULL)
+		return -1;
+
+	if (prefix)
+		heap = pheap_create_prefixed(cmp, prefix, PH_OPT_POOL);
+	else
+		heap = pheap_create_ex(cmp, PH_OPT_POOL);
+	if ((heap == NULL) || !pheap_reserve(heap, nruns)) {
+		pheap_destroy(heap, NULL);
+		phmerge_unmap(runs, nruns);
+		return -1;
+	}
+
+	// One node per run, keyed on the run's next record.  The nodes are
+	// paired up in a single pass on the first look at the heap
+	for (i = 0; i < nruns; i++)
+		if (runs[i].base)
+			pheap_insert(heap, runs[i].base, &runs[i]);
+
+	while ((node = pheap_get_min_node(heap, &rec, (void **)&run))) {
+		count++;
+		if (out(rec, ctx))
+			break;
+
+		// Move the run's node on to its next record, or drop it once empty
+		rec = (char *)rec + recsize;
+		if ((char *)rec < run->end)
+			pheap_change_key(heap, node, rec);
+		else
+			pheap_delete_min(heap, NULL, NULL);
+	}
+
+	pheap_destroy(heap, NULL);
+	phmerge_unmap(runs, nruns);
+	return count;
+} // phmerge_files
+
+
+// Writes out everything waiting in the writer's buffer
+static void
+phmerge_flush(struct phmerge_writer *w)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (!w->err && (off < w->used)) {
+		if ((n = write(w->fd, w->buf + off, w->used - off)) < 0) {
+			if (errno != EINTR)
+				w->err = 1;
+			continue;
+		}
+		off += n;
+	}
+	w->used = 0;
+} // phmerge_flush
+
+
+// The out() callback of phmerge_to_fd().  Copies the record into the buffer
+static int
+phmerge_write(void *rec, void *ctx)
+{
+	struct phmerge_writer *w = (struct phmerge_writer *)ctx;
+
+	if (w->used + w->recsize > PHMERGE_WBUF)
+		phmerge_flush(w);
+	memcpy(w->buf + w->used, rec, w->recsize);
+	w->used += w->recsize;
+	return w->err;
+} // phmerge_write
+
+
+int64_t
+phmerge_to_fd(const char **paths, int nruns, size_t recsize, int (*cmp)(void *, void *),
+	      uint64_t (*prefix)(void *), int fd)
+{
+	struct phmerge_writer w;
+	int64_t count;
+
+	if ((recsize == 0) || (recsize > PHMERGE_WBUF))
+		return -1;
+	memset(&w, 0, sizeof(w));
+	w.fd = fd;
+	w.recsize = recsize;
+	if ((w.buf = (char *)malloc(PHMERGE_WBUF)) == NULL)
+		return -1;
+
+	count = phmerge_files(paths, nruns, recsize, cmp, prefix, phmerge_write, &w);
+	phmerge_flush(&w);
+	free(w.buf);
+	return w.err ? -1 : count;
+} // phmerge_to_fd
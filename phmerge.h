@@ -0,0 +1,43 @@
+// Stew's paired heap k-way merge - merges sorted run files, such as for an external sort
+//
+// Every run file holds fixed size records, already sorted.  The files are memory mapped,
+// and one heap node is kept per run with the run's next record as its key.  Each time a
+// record is emitted its run's node just has its key moved on to the run's next record
+// with pheap_change_key(), so nothing is allocated or freed per record, and the records
+// themselves are never copied until they are written out
+
+#ifndef __PHMERGE_H
+#define __PHMERGE_H
+
+#include	<stddef.h>
+#include	<stdint.h>
+#include	"ph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Merges the nruns sorted run files named in paths[], each made up of records of recsize
+// bytes, calling out(rec, ctx) on every record in sorted order.  rec points into the mapped
+// file, and is only valid during the call.  If out() returns non-zero the merge stops early
+//
+// cmp() compares two records as for pheap_create().  prefix may be NULL, or else be an order
+// preserving key prefix function as for pheap_create_prefixed(), so that cmp() is only called
+// for records whose prefixes are the same
+//
+// Returns the number of records given to out(), or -1 if a file could not be opened or
+// mapped, or its size is not a multiple of recsize
+int64_t phmerge_files(const char **paths, int nruns, size_t recsize, int (*cmp)(void *, void *),
+		      uint64_t (*prefix)(void *), int (*out)(void *rec, void *ctx), void *ctx);
+
+// As for phmerge_files(), but writes the merged records to the file descriptor fd through
+// a large buffer.  Returns the number of records written, or -1 on a failure to open, map
+// or write
+int64_t phmerge_to_fd(const char **paths, int nruns, size_t recsize, int (*cmp)(void *, void *),
+		      uint64_t (*prefix)(void *), int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
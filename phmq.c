@@ -0,0 +1,227 @@
+// Stew's paired heap MultiQueue - a relaxed concurrent priority queue
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<string.h>
+#include	<pthread.h>
+#include	"phmq.h"
+
+#define	PHMQ_CACHELINE	64
+
+// Each shard sits in its own cache lines, so that threads working on different
+// shards don't fight over them.  top and full mirror the shard's minimum, and
+// are written under the lock but read without it when choosing shards.  top is
+// a copy of the minimum's priority rather than its key, as the key may have been
+// deleted and freed by the time another thread reads it
+struct phmq_shard {
+	pthread_mutex_t	lock;
+	void		*heap;			// The shard's paired heap
+	uint64_t	top;			// Priority of the least node in the heap
+	int		full;			// Non-zero if the heap has any nodes
+} __attribute__((aligned(PHMQ_CACHELINE)));
+
+struct phmq {
+	int			nshards;
+	int			ktype;		// PH_KEY_* type of the keys, or 0
+	uint64_t		(*prefix)(void *);	// Priority of a user key
+	struct phmq_shard	*shards;
+};
+
+static __thread uint64_t phmq_seed;
+
+
+// Per-thread xorshift random number generator, for picking shards
+static inline uint32_t
+phmq_random(void)
+{
+	uint64_t x = phmq_seed;
+
+	if (x == 0)
+		x = (uint64_t)(uintptr_t)&phmq_seed | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	phmq_seed = x;
+	return (uint32_t)(x >> 32);
+} // phmq_random
+
+
+// Maps a key to a 64-bit priority that orders as the key does, or for string and user
+// keys, as their prefix does
+static inline uint64_t
+phmq_prio(struct phmq *mq, void *key)
+{
+	uint64_t u = (uint64_t)(uintptr_t)key;
+
+	switch (mq->ktype) {
+	case PH_KEY_U32:
+		return (uint32_t)u;
+	case PH_KEY_U64:
+		return u;
+	case PH_KEY_DOUBLE:
+		// Negative doubles order backwards, and below the positive ones
+		return (u >> 63) ? ~u : u | ((uint64_t)1 << 63);
+	case PH_KEY_STRPFX:
+		return pheap_prefix_str((const char *)key);
+	default:
+		if (mq->prefix)
+			return mq->prefix(key);
+		// intptr_t and PH_KEY_I64 keys are signed
+		return u ^ ((uint64_t)1 << 63);
+	}
+} // phmq_prio
+
+
+// Refreshes the shard's published minimum.  Must hold the shard's lock
+static inline void
+phmq_publish(struct phmq *mq, struct phmq_shard *s)
+{
+	void *key;
+
+	if (pheap_get_min_node(s->heap, &key, NULL)) {
+		__atomic_store_n(&s->top, phmq_prio(mq, key), __ATOMIC_RELAXED);
+		__atomic_store_n(&s->full, 1, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&s->full, 0, __ATOMIC_RELEASE);
+	}
+} // phmq_publish
+
+
+int
+phmq_insert(void *omq, void *key, void *data)
+{
+	struct phmq *mq = (struct phmq *)omq;
+	struct phmq_shard *s;
+	void *n;
+
+	// Move on to another random shard if the one we picked is busy
+	do {
+		s = mq->shards + (phmq_random() % mq->nshards);
+	} while (pthread_mutex_trylock(&s->lock) != 0);
+
+	if ((n = pheap_insert(s->heap, key, data)))
+		phmq_publish(mq, s);
+	pthread_mutex_unlock(&s->lock);
+	return (n != NULL);
+} // phmq_insert
+
+
+int
+phmq_delete_min(void *omq, void **key, void **data)
+{
+	struct phmq *mq = (struct phmq *)omq;
+	struct phmq_shard *a, *b;
+	int i, tries;
+
+	for (tries = 0; tries < mq->nshards; tries++) {
+		a = mq->shards + (phmq_random() % mq->nshards);
+		b = mq->shards + (phmq_random() % mq->nshards);
+
+		// Take the better of the two shard minimums.  They are read without
+		// locks, so may be stale, which is checked again once locked
+		if (!__atomic_load_n(&a->full, __ATOMIC_ACQUIRE)) {
+			a = b;
+		} else if (__atomic_load_n(&b->full, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&b->top, __ATOMIC_RELAXED) < __atomic_load_n(&a->top, __ATOMIC_RELAXED))
+				a = b;
+		}
+		if (!__atomic_load_n(&a->full, __ATOMIC_ACQUIRE))
+			continue;
+		if (pthread_mutex_trylock(&a->lock) != 0)
+			continue;
+		if (pheap_delete_min(a->heap, key, data)) {
+			phmq_publish(mq, a);
+			pthread_mutex_unlock(&a->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	// Random picks keep finding empty shards, so sweep them all in order
+	for (i = 0; i < mq->nshards; i++) {
+		a = mq->shards + i;
+		if (!__atomic_load_n(&a->full, __ATOMIC_ACQUIRE))
+			continue;
+		pthread_mutex_lock(&a->lock);
+		if (pheap_delete_min(a->heap, key, data)) {
+			phmq_publish(mq, a);
+			pthread_mutex_unlock(&a->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+	return 0;
+} // phmq_delete_min
+
+
+void
+phmq_destroy(void *omq, void (*kd_free)(void *, void *))
+{
+	struct phmq *mq = (struct phmq *)omq;
+	int i;
+
+	if (mq == NULL)
+		return;
+	for (i = 0; i < mq->nshards; i++) {
+		if (mq->shards[i].heap) {
+			pheap_destroy(mq->shards[i].heap, kd_free);
+			pthread_mutex_destroy(&mq->shards[i].lock);
+		}
+	}
+	free(mq->shards);
+	memset(mq, 0, sizeof(struct phmq));
+	free(mq);
+} // phmq_destroy
+
+
+static void *
+phmq_create_with(int (*cmp)(void *, void *), uint64_t (*prefix)(void *), int opts, int nshards)
+{
+	struct phmq *mq;
+	int i;
+
+	if ((nshards < 1) || (opts & (PH_OPT_INTRUSIVE | PH_OPT_TLCACHE)))
+		return NULL;
+	if ((mq = (struct phmq *)calloc(sizeof(struct phmq), 1)) == NULL)
+		return NULL;
+	mq->shards = (struct phmq_shard *)aligned_alloc(PHMQ_CACHELINE, sizeof(struct phmq_shard) * nshards);
+	if (mq->shards == NULL) {
+		free(mq);
+		return NULL;
+	}
+	memset(mq->shards, 0, sizeof(struct phmq_shard) * nshards);
+	mq->nshards = nshards;
+	mq->ktype = opts & PH_KEY_MASK;
+	mq->prefix = prefix;
+
+	for (i = 0; i < nshards; i++) {
+		if (prefix)
+			mq->shards[i].heap = pheap_create_prefixed(cmp, prefix, opts);
+		else
+			mq->shards[i].heap = pheap_create_ex(cmp, opts);
+		if (mq->shards[i].heap == NULL) {
+			phmq_destroy(mq, NULL);
+			return NULL;
+		}
+		pthread_mutex_init(&mq->shards[i].lock, NULL);
+	}
+	return (void *)mq;
+} // phmq_create_with
+
+
+void *
+phmq_create(int (*cmp)(void *, void *), int opts, int nshards)
+{
+	// A user compare function gives no priority to publish
+	if (cmp && !(opts & PH_KEY_MASK))
+		return NULL;
+	return phmq_create_with(NULL, NULL, opts, nshards);
+} // phmq_create
+
+
+void *
+phmq_create_prefixed(int (*cmp)(void *, void *), uint64_t (*prefix)(void *), int opts, int nshards)
+{
+	if ((cmp == NULL) || (prefix == NULL))
+		return NULL;
+	return phmq_create_with(cmp, prefix, opts & ~PH_KEY_MASK, nshards);
+} // phmq_create_prefixed
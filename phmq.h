@@ -0,0 +1,52 @@
+// Stew's paired heap MultiQueue - a relaxed concurrent priority queue
+//
+// Spreads its elements over a number of paired heap shards, each with its own lock
+// Inserts go to a randomly chosen shard.  Delete min picks the better of the minimums
+// of two randomly chosen shards (the "power of two choices").  So delete min returns a
+// key that is close to the least in the whole queue, but not always the least, and in
+// exchange any number of threads may insert and delete at the same time with little
+// contention.  Use at least 2 shards per thread that will use the queue
+
+#ifndef __PHMQ_H
+#define __PHMQ_H
+
+#include	"ph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Creates a MultiQueue of nshards shards.  cmp and opts are as for pheap_create_ex(), and
+// are used for every shard.  PH_OPT_INTRUSIVE and PH_OPT_TLCACHE may not be used
+//
+// Shards are chosen by comparing copies of their minimum keys that are taken without the
+// other shards' locks held, and so must not point at memory that another thread may free.
+// So the keys must be integers (a NULL cmp) or one of the built-in PH_KEY_* types in opts,
+// and cmp must be NULL or ignored.  PH_KEY_STRPFX shards are chosen on the first 8 bytes
+// of their keys.  Other keys need phmq_create_prefixed() below
+// Returns an opaque handle to the queue, or NULL on failure
+void *phmq_create(int (*cmp)(void *, void *), int opts, int nshards);
+
+// Creates a MultiQueue for keys that are compared with cmp, as for pheap_create_prefixed()
+// Shards are chosen on the prefix of their minimum keys, which is taken under the shard's
+// lock, so cmp is only ever called on keys in the same shard
+// Returns an opaque handle to the queue, or NULL on failure
+void *phmq_create_prefixed(int (*cmp)(void *, void *), uint64_t (*prefix)(void *), int opts, int nshards);
+
+// Releases the queue and every element in it, calling kd_free() on each as for
+// pheap_destroy().  No other thread may be using the queue
+void phmq_destroy(void *omq, void (*kd_free)(void *, void *));
+
+// Inserts the key/data tuple into the queue
+// Returns 1 on success, and 0 if out of memory
+int phmq_insert(void *omq, void *key, void *data);
+
+// Deletes a near-least element from the queue, setting key and data to its key and data
+// if they are non-NULL.  Returns 1 if an element was deleted, and 0 if the queue was empty
+int phmq_delete_min(void *omq, void **key, void **data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,362 @@
+// Paired Heap Multi-Threaded Test Framework
+//
+// Checks that the phmq.c MultiQueue picks its shards in key order for each kind of key,
+// and then compares the throughput of a single paired heap behind one mutex against it
+// as the number of threads grows
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <string.h>
+#include        <time.h>
+#include	<pthread.h>
+#include	<sched.h>
+#include	"ph.h"
+#include	"phmq.h"
+
+struct locked_heap {
+	pthread_mutex_t	lock;
+	void		*heap;
+};
+
+struct mt_arg {
+	int		mq;			// Non-zero to use the MultiQueue
+	void		*q;			// The queue under test
+	intptr_t	ops;			// Insert + delete min pairs to run
+	intptr_t	seed;
+	intptr_t	misses;			// Delete mins that found nothing
+};
+
+
+double
+mt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // mt_now
+
+
+void *
+mt_worker(void *varg)
+{
+	struct mt_arg *arg = (struct mt_arg *)varg;
+	struct locked_heap *lh = (struct locked_heap *)arg->q;
+	uint64_t x = arg->seed | 1;
+	intptr_t i, key;
+	int got;
+
+	for (i = 0; i < arg->ops; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = (intptr_t)(x >> 2);
+
+		if (arg->mq) {
+			phmq_insert(arg->q, (void *)key, NULL);
+			got = phmq_delete_min(arg->q, NULL, NULL);
+		} else {
+			pthread_mutex_lock(&lh->lock);
+			pheap_insert(lh->heap, (void *)key, NULL);
+			got = pheap_delete_min(lh->heap, NULL, NULL);
+			pthread_mutex_unlock(&lh->lock);
+		}
+		if (!got)
+			arg->misses++;
+	}
+	return NULL;
+} // mt_worker
+
+
+// Runs ops insert + delete min pairs spread over nthreads threads against a queue
+// prefilled with count elements.  Returns millions of operations per second
+double
+test_mt(intptr_t count, intptr_t ops, int nthreads, int mq)
+{
+	struct locked_heap lh;
+	struct mt_arg args[nthreads];
+	pthread_t tids[nthreads];
+	void *q;
+	intptr_t i, left = 0, misses = 0;
+	double start, taken;
+
+	if (mq) {
+		q = phmq_create(NULL, PH_OPT_POOL, 4 * nthreads);
+	} else {
+		pthread_mutex_init(&lh.lock, NULL);
+		lh.heap = pheap_create_ex(NULL, PH_OPT_POOL);
+		q = lh.heap ? &lh : NULL;
+	}
+	if (q == NULL) {
+		fprintf(stderr, "Test FAILED - Unable to acquire a queue\n");
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (mq)
+			phmq_insert(q, (void *)((intptr_t)random()), NULL);
+		else
+			pheap_insert(lh.heap, (void *)((intptr_t)random()), NULL);
+	}
+
+	start = mt_now();
+	for (i = 0; i < nthreads; i++) {
+		args[i].mq = mq;
+		args[i].q = q;
+		args[i].ops = ops / nthreads;
+		args[i].seed = random();
+		args[i].misses = 0;
+		pthread_create(&tids[i], NULL, mt_worker, &args[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		misses += args[i].misses;
+	}
+	taken = mt_now() - start;
+
+	// Every insert was followed by a delete, so what we started with should remain
+	// (plus anything that a relaxed delete min failed to find)
+	if (mq) {
+		while (phmq_delete_min(q, NULL, NULL))
+			left++;
+		phmq_destroy(q, NULL);
+	} else {
+		while (pheap_delete_min(lh.heap, NULL, NULL))
+			left++;
+		pheap_destroy(lh.heap, NULL);
+		pthread_mutex_destroy(&lh.lock);
+	}
+	if (left != count + misses)
+		fprintf(stderr, "Test FAILED - %ld elements left over, expected %ld\n", left, count + misses);
+
+	return (2.0 * (ops / nthreads) * nthreads) / taken / 1000000.0;
+} // test_mt
+
+
+struct inbox_arg {
+	int		inbox;			// Non-zero to use the inbox
+	void		*q;			// Inbox heap, or struct locked_heap
+	intptr_t	ops;			// Elements to produce
+	intptr_t	seed;
+};
+
+
+void *
+inbox_producer(void *varg)
+{
+	struct inbox_arg *arg = (struct inbox_arg *)varg;
+	struct locked_heap *lh = (struct locked_heap *)arg->q;
+	uint64_t x = arg->seed | 1;
+	intptr_t i, key;
+
+	for (i = 0; i < arg->ops; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key = (intptr_t)(x >> 2);
+
+		if (arg->inbox) {
+			while (pheap_inbox_insert(arg->q, (void *)key, NULL) == NULL)
+				sched_yield();
+		} else {
+			pthread_mutex_lock(&lh->lock);
+			pheap_insert(lh->heap, (void *)key, NULL);
+			pthread_mutex_unlock(&lh->lock);
+		}
+	}
+	return NULL;
+} // inbox_producer
+
+
+// Has nproducers threads produce count elements between them, while this thread
+// consumes them with delete min.  Returns millions of elements per second
+double
+test_inbox(intptr_t count, int nproducers, int inbox)
+{
+	struct locked_heap lh;
+	struct inbox_arg args[nproducers];
+	pthread_t tids[nproducers];
+	void *q;
+	intptr_t i, got = 0, total;
+	double start, taken;
+	int ok;
+
+	if (inbox) {
+		q = pheap_create_ex(NULL, PH_OPT_INBOX);
+	} else {
+		pthread_mutex_init(&lh.lock, NULL);
+		lh.heap = pheap_create(NULL);
+		q = lh.heap ? &lh : NULL;
+	}
+	if (q == NULL) {
+		fprintf(stderr, "Test FAILED - Unable to acquire a heap\n");
+		return 0;
+	}
+
+	total = (count / nproducers) * nproducers;
+	start = mt_now();
+	for (i = 0; i < nproducers; i++) {
+		args[i].inbox = inbox;
+		args[i].q = q;
+		args[i].ops = count / nproducers;
+		args[i].seed = random();
+		pthread_create(&tids[i], NULL, inbox_producer, &args[i]);
+	}
+	while (got < total) {
+		if (inbox) {
+			ok = pheap_delete_min(q, NULL, NULL);
+		} else {
+			pthread_mutex_lock(&lh.lock);
+			ok = pheap_delete_min(lh.heap, NULL, NULL);
+			pthread_mutex_unlock(&lh.lock);
+		}
+		if (ok)
+			got++;
+		else
+			sched_yield();
+	}
+	taken = mt_now() - start;
+	for (i = 0; i < nproducers; i++)
+		pthread_join(tids[i], NULL);
+
+	if (inbox) {
+		ok = pheap_delete_min(q, NULL, NULL);
+		pheap_destroy(q, NULL);
+	} else {
+		ok = pheap_delete_min(lh.heap, NULL, NULL);
+		pheap_destroy(lh.heap, NULL);
+		pthread_mutex_destroy(&lh.lock);
+	}
+	if (ok)
+		fprintf(stderr, "Test FAILED - Consumer saw more elements than were produced\n");
+
+	return total / taken / 1000000.0;
+} // test_inbox
+
+
+static int
+mt_str_cmp(void *a, void *b)
+{
+	return strcmp((char *)a, (char *)b);
+} // mt_str_cmp
+
+
+static uint64_t
+mt_str_prefix(void *key)
+{
+	return pheap_prefix_str((char *)key);
+} // mt_str_prefix
+
+
+// Fills a MultiQueue of each key type with count keys in a random order, the data of
+// each being its rank, and drains it.  Shards are chosen on their published priorities,
+// so a priority that doesn't order as the keys do shows up as a large rank error
+int
+test_keys(intptr_t count)
+{
+	static const char *names[] = { "INTPTR", "PH_KEY_DOUBLE", "PREFIXED STRCMP" };
+	intptr_t *rank, i, j, t, pos, err, left;
+	char *strs;
+	void *q, *data;
+	int type, bad = 0;
+
+	rank = (intptr_t *)malloc(count * sizeof(intptr_t));
+	strs = (char *)malloc(count * 16);
+	if ((rank == NULL) || (strs == NULL)) {
+		fprintf(stderr, "Test FAILED - Out of memory\n");
+		free(rank);
+		free(strs);
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+		rank[i] = i;
+	for (i = count - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = rank[i];
+		rank[i] = rank[j];
+		rank[j] = t;
+	}
+
+	for (type = 0; type < 3; type++) {
+		if (type == 0)
+			q = phmq_create(NULL, PH_OPT_POOL, 8);
+		else if (type == 1)
+			q = phmq_create(NULL, PH_OPT_POOL | PH_KEY_DOUBLE, 8);
+		else
+			q = phmq_create_prefixed(mt_str_cmp, mt_str_prefix, PH_OPT_POOL, 8);
+		if (q == NULL) {
+			fprintf(stderr, "Test %s FAILED - Unable to acquire a queue\n", names[type]);
+			bad++;
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			t = rank[i];
+			snprintf(strs + t * 16, 16, "%08ld-key", (long)t);
+			if (type == 0)
+				phmq_insert(q, (void *)(t - count / 2), (void *)t);
+			else if (type == 1)
+				phmq_insert(q, pheap_double_key((t - count / 2) * 0.5), (void *)t);
+			else
+				phmq_insert(q, strs + t * 16, (void *)t);
+		}
+		for (pos = err = 0; phmq_delete_min(q, NULL, &data); pos++)
+			err += labs((intptr_t)data - pos);
+		left = pos;
+		phmq_destroy(q, NULL);
+
+		// Two choices out of 8 shards keeps the mean rank error to a few times 8
+		if ((left != count) || (err / count > 64)) {
+			fprintf(stderr, "Test %s FAILED - %ld of %ld drained, mean rank error %.2f\n",
+				names[type], left, count, (double)err / count);
+			bad++;
+		} else {
+			fprintf(stderr, "Test %s PASSED - Mean rank error %.2f\n", names[type], (double)err / count);
+		}
+	}
+	free(rank);
+	free(strs);
+	return !bad;
+} // test_keys
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t count, ops;
+	int t, maxthreads = 32;
+	double locked, multi;
+
+	if((argc != 2) && (argc != 3)) {
+		fprintf(stderr, "Usage: %s count [maxthreads]\n", argv[0]);
+		return 0;
+	}
+	count = (intptr_t)atoi(argv[1]);
+	if(count < 1) {
+		fprintf(stderr, "%s: count must be an integer of 1 or greater\n", argv[0]);
+		return 0;
+	}
+	if ((argc == 3) && ((maxthreads = atoi(argv[2])) < 1))
+		maxthreads = 1;
+	ops = count * 4;
+
+	fprintf(stderr, "TEST - MULTIQUEUE KEY TYPES, %ld keys over 8 shards\n", count);
+	test_keys(count);
+
+	fprintf(stderr, "\n");
+	fprintf(stderr, "TEST - INSERT + DEL_MIN THROUGHPUT, %ld queued, %ld operation pairs\n", count, ops);
+	fprintf(stderr, "Threads   Locked heap Mops/s   MultiQueue Mops/s   Speedup\n");
+	for (t = 1; t <= maxthreads; t <<= 1) {
+		locked = test_mt(count, ops, t, 0);
+		multi = test_mt(count, ops, t, 1);
+		fprintf(stderr, "%7d   %20.2f   %17.2f   %6.2fx\n", t, locked, multi, multi / locked);
+	}
+
+	fprintf(stderr, "\n");
+	fprintf(stderr, "TEST - N PRODUCERS, 1 CONSUMER, %ld elements\n", ops);
+	fprintf(stderr, "Producers   Locked heap Mops/s   Lock-free inbox Mops/s   Speedup\n");
+	for (t = 1; t <= maxthreads; t <<= 1) {
+		locked = test_inbox(ops, t, 0);
+		multi = test_inbox(ops, t, 1);
+		fprintf(stderr, "%9d   %20.2f   %22.2f   %6.2fx\n", t, locked, multi, multi / locked);
+	}
+} // main
@@ -0,0 +1,203 @@
+// Paired Heap Snapshot Restore Test Framework
+//
+// Measures how long it takes to bring a churned heap back after a restart, by comparing
+// reinserting every key from a flat key file against pheap_restore() from a snapshot,
+// and timing the first pheap_delete_min() that follows each
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <unistd.h>
+#include        <fcntl.h>
+#include        <time.h>
+#include	"ph.h"
+
+static char	sr_keys[] = "/tmp/phsr.keys";
+static char	sr_snap[] = "/tmp/phsr.snap";
+
+
+double
+sr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // sr_now
+
+
+static inline uint64_t
+sr_random(void)
+{
+	static uint64_t x = 88172645463325252ULL;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+} // sr_random
+
+
+static int
+sr_cmp(void *a, void *b)
+{
+	return ((uintptr_t)a > (uintptr_t)b) - ((uintptr_t)a < (uintptr_t)b);
+} // sr_cmp
+
+
+// Builds and churns a heap of count keys, then saves both the flat key file and
+// the snapshot.  The data of each node is its slot in keys[]
+static int
+sr_save(intptr_t count)
+{
+	uintptr_t *keys;
+	void *heap, *key, *data;
+	ssize_t len = count * sizeof(uintptr_t);
+	intptr_t i;
+	double t;
+	int fd;
+
+	if ((keys = (uintptr_t *)malloc(len)) == NULL)
+		return 0;
+	heap = pheap_create_ex(sr_cmp, PH_OPT_POOL);
+	pheap_reserve(heap, count);
+	for (i = 0; i < count; i++) {
+		keys[i] = sr_random() >> 16;
+		pheap_insert(heap, (void *)keys[i], (void *)i);
+	}
+	for (i = 0; i < count; i++) {
+		pheap_delete_min(heap, &key, &data);
+		keys[(intptr_t)data] = (uintptr_t)key + (sr_random() >> 40);
+		pheap_insert(heap, (void *)keys[(intptr_t)data], data);
+	}
+
+	fd = open(sr_keys, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if ((fd < 0) || (write(fd, keys, len) != len)) {
+		fprintf(stderr, "Unable to write %s\n", sr_keys);
+		goto save_fail;
+	}
+	close(fd);
+
+	t = sr_now();
+	fd = open(sr_snap, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if ((fd < 0) || !pheap_snapshot(heap, fd, NULL)) {
+		fprintf(stderr, "Unable to write %s\n", sr_snap);
+		goto save_fail;
+	}
+	close(fd);
+	printf("Saved %ld keys: snapshot written in %.3fms\n", count, (sr_now() - t) * 1000.0);
+
+	pheap_destroy(heap, NULL);
+	free(keys);
+	return 1;
+
+save_fail:
+	if (fd >= 0)
+		close(fd);
+	pheap_destroy(heap, NULL);
+	free(keys);
+	return 0;
+} // sr_save
+
+
+// Reads the key file back and reinserts each key
+static void *
+sr_rebuild(intptr_t count)
+{
+	uintptr_t *keys;
+	void *heap;
+	ssize_t len = count * sizeof(uintptr_t);
+	intptr_t i;
+	int fd;
+
+	if ((keys = (uintptr_t *)malloc(len)) == NULL)
+		return NULL;
+	fd = open(sr_keys, O_RDONLY);
+	if ((fd < 0) || (read(fd, keys, len) != len)) {
+		if (fd >= 0)
+			close(fd);
+		free(keys);
+		return NULL;
+	}
+	close(fd);
+	heap = pheap_create_ex(sr_cmp, PH_OPT_POOL);
+	pheap_reserve(heap, count);
+	for (i = 0; i < count; i++)
+		pheap_insert(heap, (void *)keys[i], (void *)i);
+	free(keys);
+	return heap;
+} // sr_rebuild
+
+
+// Maps the snapshot back in.  The snapshot knows how many nodes it holds, so count,
+// which sr_rebuild() needs, goes unused
+static void *
+sr_restore(intptr_t count)
+{
+	void *heap;
+	int fd;
+
+	(void)count;
+
+	if ((fd = open(sr_snap, O_RDONLY)) < 0)
+		return NULL;
+	heap = pheap_restore(fd, sr_cmp, 0, NULL);
+	close(fd);
+	return heap;
+} // sr_restore
+
+
+// Times bringing the heap back, the first delete min, and the next 1000
+static double
+sr_run(char *name, void *(*load)(intptr_t), intptr_t count)
+{
+	double t0, t1, t2, t3;
+	void *heap, *key, *last = NULL;
+	intptr_t i, bad = 0;
+
+	t0 = sr_now();
+	if ((heap = load(count)) == NULL) {
+		fprintf(stderr, "%s: unable to load the heap\n", name);
+		return 0;
+	}
+	t1 = sr_now();
+	pheap_delete_min(heap, &last, NULL);
+	t2 = sr_now();
+	for (i = 0; (i < 1000) && pheap_delete_min(heap, &key, NULL); i++) {
+		bad += ((uintptr_t)key < (uintptr_t)last);
+		last = key;
+	}
+	t3 = sr_now();
+
+	printf("%-8s  load %9.3fms  first delete min %9.3fms  next 1000 %7.3fms  ready %9.3fms%s\n",
+		name, (t1 - t0) * 1000.0, (t2 - t1) * 1000.0, (t3 - t2) * 1000.0,
+		(t2 - t0) * 1000.0, bad ? "  OUT OF ORDER" : "");
+	pheap_destroy(heap, NULL);
+	return t2 - t0;
+} // sr_run
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t count = 1000000;
+	double rebuild, restore;
+
+	if (argc > 1)
+		count = atol(argv[1]);
+	if (count < 1) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return 1;
+	}
+	if (!sr_save(count))
+		return 1;
+
+	rebuild = sr_run("REBUILD", sr_rebuild, count);
+	restore = sr_run("RESTORE", sr_restore, count);
+	if (restore > 0)
+		printf("pheap_restore() startup speedup over rebuilding: %.2fx\n", rebuild / restore);
+
+	unlink(sr_keys);
+	unlink(sr_snap);
+	return 0;
+} // main
@@ -5,16 +5,17 @@
 #include        <stdint.h>
 #include        <time.h>
 #include	"ph.h"
+#include	"ph32.h"
 
 #define TIME_START 0
 #define TIME_SETUP 1
 #define TIME_DONE  2
 
-void
+double
 test_time(int t)
 {
 	static struct timespec at_start, after_setup, at_done;
-	double taken;
+	double taken = 0;
 
 	switch(t) {
 	case TIME_START:
@@ -38,16 +39,100 @@ test_time(int t)
 		fprintf(stderr, "Illegal argument to %s\n", __FUNCTION__);
 		break;
 	}
+	return taken;
 } // test_time
 
 
-void
-test(intptr_t count)
+// The heap calls that the tests make, so that the same tests can be run on each
+// kind of heap.  Node handles are held as uintptr_t, with 0 meaning no node
+struct pht_ops {
+	void		*(*create)(int opts);
+	void		(*destroy)(void *heap);
+	uintptr_t	(*insert)(void *heap, void *key, void *data);
+	int		(*delete_min)(void *heap, void **key, void **data);
+	int		(*delete)(void *heap, uintptr_t h);
+	size_t		(*memory)(void *heap);		// May be NULL
+};
+
+
+static void *
+ph_create(int opts)
+{
+	return pheap_create_ex(NULL, opts);
+} // ph_create
+
+
+static void
+ph_destroy(void *heap)
+{
+	pheap_destroy(heap, NULL);
+} // ph_destroy
+
+
+static uintptr_t
+ph_insert(void *heap, void *key, void *data)
+{
+	return (uintptr_t)pheap_insert(heap, key, data);
+} // ph_insert
+
+
+static int
+ph_delete(void *heap, uintptr_t h)
+{
+	return pheap_delete(heap, (void *)h, NULL, NULL);
+} // ph_delete
+
+
+static const struct pht_ops ph_ops = {
+	ph_create, ph_destroy, ph_insert, pheap_delete_min, ph_delete, NULL
+};
+
+
+static void *
+ph32_create(int opts)
+{
+	(void)opts;			// Compact heaps have no options
+	return pheap32_create(NULL, 0);
+} // ph32_create
+
+
+static void
+ph32_destroy(void *heap)
+{
+	pheap32_destroy(heap, NULL);
+} // ph32_destroy
+
+
+static uintptr_t
+ph32_insert(void *heap, void *key, void *data)
+{
+	return pheap32_insert(heap, key, data);
+} // ph32_insert
+
+
+static int
+ph32_delete(void *heap, uintptr_t h)
+{
+	return pheap32_delete(heap, (uint32_t)h, NULL, NULL);
+} // ph32_delete
+
+
+static const struct pht_ops ph32_ops = {
+	ph32_create, ph32_destroy, ph32_insert, pheap32_delete_min, ph32_delete, pheap32_memory
+};
+
+
+// Runs the tests on a heap made by ops->create(opts)
+// Returns the total run time of all of the timed tests
+double
+test(intptr_t count, const struct pht_ops *ops, int opts)
 {
-	void *heap = NULL, **nodes = NULL;
+	void *heap = NULL, *key, *last = NULL;
+	uintptr_t *nodes = NULL;
 	intptr_t i, cnt = 0;
+	double total = 0;
 
-	if ((nodes = (void **)calloc(count, sizeof(void *))) == NULL) {
+	if ((nodes = (uintptr_t *)calloc(count, sizeof(uintptr_t))) == NULL) {
 		fprintf(stderr, "Test FAILED - Out of memory\n");
 		goto test_cleanup;
 	}
@@ -55,7 +140,7 @@ test(intptr_t count)
 	// Warmup - Primes L1/2/3 caches with data
 
 	fprintf(stderr, "WARMUP START\n");
-	if ((heap = pheap_create(NULL)) == NULL) {
+	if ((heap = ops->create(opts)) == NULL) {
 		fprintf(stderr, "Test 1 FAILED - Failed to create heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
@@ -63,14 +148,17 @@ test(intptr_t count)
 	}
 	for(i = 0; i < count; i++) {
 		intptr_t key = random() % INTPTR_MAX;
-		nodes[i] = pheap_insert(heap, (void *)key, (void *)i);
+		nodes[i] = ops->insert(heap, (void *)key, (void *)i);
 	}
+	if (ops->memory)
+		fprintf(stderr, "Heap holds %zu bytes for %ld nodes, %.1f bytes per node\n",
+			ops->memory(heap), count, (double)ops->memory(heap) / count);
 	for(i = 0; i < count; i++) {
-		pheap_delete(heap, nodes[i], NULL, NULL);
-		nodes[i] = NULL;
+		ops->delete(heap, nodes[i]);
+		nodes[i] = 0;
 	}
 	fprintf(stderr, "WARMUP DONE\n");
-	pheap_destroy(heap, NULL);
+	ops->destroy(heap);
 	heap = NULL;
 
 	fprintf(stderr, "\n");
@@ -78,25 +166,23 @@ test(intptr_t count)
 	// Baseline - Just inserts and removes with no heap merging.  Should be O(1)
 	fprintf(stderr, "BASELINE - DELETE OUT OF ORDER ON INACTIVE HEAP\n");
 	test_time(TIME_START);
-	if ((heap = pheap_create(NULL)) == NULL) {
+	if ((heap = ops->create(opts)) == NULL) {
 		fprintf(stderr, "Test 1 FAILED - Failed to create heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
 		goto test_cleanup;
 	}
-	for(i = 0; i < count; i++) {
-		intptr_t key = random() % INTPTR_MAX;
-		nodes[i] = pheap_insert(heap, (void *)i, (void *)i);
-	}
+	for(i = 0; i < count; i++)
+		nodes[i] = ops->insert(heap, (void *)i, (void *)i);
 	fprintf(stderr, "BASELINE SETUP DONE. Inserted %ld nodes into empty heap\n", count);
 	test_time(TIME_SETUP);
 	for(i = count - 1; i >= 0; i--) {
-		pheap_delete(heap, nodes[i], NULL, NULL);
-		nodes[i] = NULL;
+		ops->delete(heap, nodes[i]);
+		nodes[i] = 0;
 	}
 	fprintf(stderr, "BASELINE DONE. Deleted %ld nodes from inactive heap\n", count);
-	test_time(TIME_DONE);
-	pheap_destroy(heap, NULL);
+	total += test_time(TIME_DONE);
+	ops->destroy(heap);
 	heap = NULL;
 
 	fprintf(stderr, "\n");
@@ -105,7 +191,7 @@ test(intptr_t count)
 	// to do merging, and then just delete the whole lot out of order according to our list
 	fprintf(stderr, "TEST 1 - DELETE OUT OF ORDER ON ACTIVE HEAP\n");
 	test_time(TIME_START);
-	if ((heap = pheap_create(NULL)) == NULL) {
+	if ((heap = ops->create(opts)) == NULL) {
 		fprintf(stderr, "Test 1 FAILED - Failed to create heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
@@ -113,7 +199,7 @@ test(intptr_t count)
 	}
 	for(i = 0; i < count; i++) {
 		intptr_t key = random() % INTPTR_MAX;
-		nodes[i] = pheap_insert(heap, (void *)key, (void *)i);
+		nodes[i] = ops->insert(heap, (void *)key, (void *)i);
 	}
 	fprintf(stderr, "Test 1 SETUP Phase 1 - Inserted %ld nodes into empty heap.\n", count);
 	test_time(TIME_SETUP);
@@ -122,21 +208,24 @@ test(intptr_t count)
 	test_time(TIME_START);
 	for(i = 0; i < (count >> 3); i++) {
 		intptr_t pos;
-		pheap_delete_min(heap, NULL, (void **)&pos);
+		ops->delete_min(heap, NULL, (void **)&pos);
 		intptr_t key = random() % INTPTR_MAX;
-		nodes[pos] = pheap_insert(heap, (void *)key, (void *)pos);
+		nodes[pos] = ops->insert(heap, (void *)key, (void *)pos);
 	}
 	fprintf(stderr, "Test 1 SETUP Phase 2 - Activated heap with Delete Min + Insert %ld times\n", (count >> 3));
 	test_time(TIME_SETUP);
 
 	// Now delete all the nodes from our copy of the node list
 	for (i = 0; i < count; i++) {
-		pheap_delete(heap, nodes[i], NULL, NULL);
-		nodes[i] = NULL;
+		if (!ops->delete(heap, nodes[i])) {
+			fprintf(stderr, "Test 1 FAILED - Unable to delete node %ld\n", i);
+			break;
+		}
+		nodes[i] = 0;
 	}
 	fprintf(stderr, "Test 1 DONE - Deleted %ld nodes out of order\n", i);
-	test_time(TIME_DONE);
-	pheap_destroy(heap, NULL);
+	total += test_time(TIME_DONE);
+	ops->destroy(heap);
 	heap = NULL;
 
 	fprintf(stderr, "\n");
@@ -144,7 +233,7 @@ test(intptr_t count)
 	// Test 2 - Insert count nodes, then delete min the lot, forcing a full in-order removal
 	fprintf(stderr, "TEST 2 - DELETE/SORT IN ORDER\n");
 	test_time(TIME_START);
-	if ((heap = pheap_create(NULL)) == NULL) {
+	if ((heap = ops->create(opts)) == NULL) {
 		fprintf(stderr, "Test 2 FAILED - Failed to create heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
@@ -152,38 +241,71 @@ test(intptr_t count)
 	}
 	for(i = 0; i < count; i++) {
 		intptr_t key = random() % INTPTR_MAX;
-		nodes[i] = pheap_insert(heap, (void *)key, (void *)i);
+		nodes[i] = ops->insert(heap, (void *)key, (void *)i);
 	}
 	fprintf(stderr, "Test 2 SETUP - Inserted %ld nodes into empty heap\n", count);
 	test_time(TIME_SETUP);
 
 	// Now delete in order
-	while(pheap_delete_min(heap, NULL, (void **)&i)) {
-		nodes[i] = NULL;
+	while(ops->delete_min(heap, &key, (void **)&i)) {
+		if (cnt && ((intptr_t)key < (intptr_t)last)) {
+			fprintf(stderr, "Test 2 FAILED - Keys came out of order\n");
+			break;
+		}
+		last = key;
+		nodes[i] = 0;
 		cnt++;
 	}
 	fprintf(stderr, "Test 2 DONE - Sorted and Deleted %ld nodes in order\n", cnt);
-	test_time(TIME_DONE);
-	pheap_destroy(heap, NULL);
+	total += test_time(TIME_DONE);
+	ops->destroy(heap);
 	heap = NULL;
 
 	// Cleanup
 test_cleanup:
 	if (heap) {
-		pheap_destroy(heap, NULL);
+		ops->destroy(heap);
 		heap = NULL;
 	}
 	if (nodes) {
 		free(nodes);
 		nodes = NULL;
 	}
+	return total;
 } // test
 
 
+// A handle to a deleted node of a compact heap is left dangling, and may be
+// handed out again.  Until it is, the heap must refuse to change or delete it
+void
+test32_dead(void)
+{
+	void *heap;
+	uint32_t a, b;
+	int bad;
+
+	if ((heap = pheap32_create(NULL, 0)) == NULL)
+		return;
+	a = pheap32_insert(heap, (void *)10, NULL);
+	b = pheap32_insert(heap, (void *)20, NULL);
+	pheap32_delete(heap, a, NULL, NULL);
+	bad = pheap32_change_key(heap, a, (void *)5) || pheap32_delete(heap, a, NULL, NULL);
+	bad |= !pheap32_change_key(heap, b, (void *)30);
+	bad |= (pheap32_get_min_node(heap, NULL, NULL) != b);
+	if (bad)
+		fprintf(stderr, "Test 32 FAILED - A deleted node handle was still accepted\n");
+	else
+		fprintf(stderr, "Test 32 PASSED - Deleted node handles are refused\n");
+	pheap32_destroy(heap, NULL);
+} // test32_dead
+
+
 int
 main(int argc, char *argv[])
 {
 	intptr_t count;
+	double tmalloc, tpool, tcompact;
+
 	if(argc != 2) {
 		fprintf(stderr, "Usage: %s count\n", argv[0]);
 		return 0;
@@ -194,6 +316,20 @@ main(int argc, char *argv[])
 		return 0;
 	}
 
-	test(count);
+	fprintf(stderr, "==== MALLOC NODES ====\n\n");
+	tmalloc = test(count, &ph_ops, 0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "==== POOLED NODES ====\n\n");
+	tpool = test(count, &ph_ops, PH_OPT_POOL);
+	fprintf(stderr, "\n");
+	if (tpool > 0)
+		fprintf(stderr, "Pooled nodes speedup over malloc: %.2fx\n\n", tmalloc / tpool);
+	fprintf(stderr, "==== COMPACT 32-BIT INDEX NODES ====\n\n");
+	tcompact = test(count, &ph32_ops, 0);
 	fprintf(stderr, "\n");
+	test32_dead();
+	fprintf(stderr, "Pointer heap nodes are %zu bytes each, plus allocator overhead\n", sizeof(struct pheap_node));
+	if (tcompact > 0)
+		fprintf(stderr, "Compact nodes speedup over malloc: %.2fx, over pooled: %.2fx\n\n",
+			tmalloc / tcompact, tpool / tcompact);
 } // main
@@ -3,18 +3,20 @@
 #include        <stdio.h>
 #include        <stdlib.h>
 #include        <stdint.h>
+#include        <string.h>
 #include        <time.h>
+#include	<sys/resource.h>
 #include	"ph.h"
 
 #define TIME_START 0
 #define TIME_SETUP 1
 #define TIME_DONE  2
 
-void
+double
 test_time(int t)
 {
 	static struct timespec at_start, after_setup, at_done;
-	double taken;
+	double taken = 0;
 
 	switch(t) {
 	case TIME_START:
@@ -38,6 +40,7 @@ test_time(int t)
 		fprintf(stderr, "Illegal argument to %s\n", __FUNCTION__);
 		break;
 	}
+	return taken;
 } // test_time
 
 
@@ -257,13 +260,16 @@ t3cleanup:
 } // test3
 
 
-void
-test4(intptr_t count)
+// Returns the time taken by the del_min + insert churn phase
+double
+test4(intptr_t count, int opts)
 {
 	void *heap = NULL, *data, **t4nodes = NULL;
 	intptr_t i, ex, lex, *keys = NULL;;
+	double taken = 0;
 
-	fprintf(stderr, "TEST 4 - INSERT + DEL_MIN\n");
+	fprintf(stderr, "TEST 4 - INSERT + DEL_MIN (%s)\n",
+		(opts & PH_OPT_POOL) ? "POOL" : (opts & PH_OPT_TLCACHE) ? "TLCACHE" : "MALLOC");
 
 	test_time(TIME_START);
 
@@ -282,7 +288,7 @@ test4(intptr_t count)
 		test_time(TIME_DONE);
 		goto t4cleanup;
 	}
-	if((heap = pheap_create(NULL)) == NULL) {
+	if((heap = pheap_create_ex(NULL, opts)) == NULL) {
 		fprintf(stderr, "Test 4 FAILED - Unable to acquire a heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
@@ -305,7 +311,7 @@ test4(intptr_t count)
 		t4nodes[i] = pheap_insert(heap, (void *)ex, (void *)ex);
 	}
 	fprintf(stderr, "Test 4 DONE - Ran del_min + random insert %ld times\n", i);
-	test_time(TIME_DONE);
+	taken = test_time(TIME_DONE);
 
 	// Delete/sort validation
 	test_time(TIME_START);
@@ -344,93 +350,1588 @@ t4cleanup:
 		pheap_destroy(heap, NULL);
 		heap = NULL;
 	}
+	pheap_tlcache_flush();
+	return taken;
 } // test4
 
 
+static intptr_t t5_freed;			// Calls made to t5_kd_free()
+
+static void
+t5_kd_free(void *key, void *data)
+{
+	(void)key;
+	(void)data;
+	t5_freed++;
+} // t5_kd_free
+
+
+// Fills a heap made with opts with count random nodes, runs a del_min + insert
+// count times, and destroys it.  An arena heap is filled, cleared and filled
+// again first, so that its destroy is of the merged slab.  Returns the time
+// taken by pheap_destroy()
+double
+test5_destroy(intptr_t count, int opts, const char *name)
+{
+	void *heap;
+	intptr_t i, ex;
+	double taken;
+
+	fprintf(stderr, "Test 5 %s - Insert and churn %ld nodes, then destroy\n", name, count);
+	test_time(TIME_START);
+	if ((heap = pheap_create_ex(NULL, opts)) == NULL) {
+		fprintf(stderr, "Test 5 %s FAILED - Unable to create heap\n", name);
+		return 0;
+	}
+	if (opts & PH_OPT_ARENA) {
+		for(i = 0; i < count; i++)
+			pheap_insert(heap, (void *)(random() % INTPTR_MAX), NULL);
+		pheap_clear(heap, NULL);
+		if (pheap_get_min_node(heap, NULL, NULL)) {
+			fprintf(stderr, "Test 5 %s FAILED - Heap not empty after pheap_clear()\n", name);
+			pheap_destroy(heap, NULL);
+			return 0;
+		}
+	}
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, (void *)(random() % INTPTR_MAX), NULL);
+	for(i = 0; i < count; i++) {
+		pheap_delete_min(heap, NULL, NULL);
+		ex = (intptr_t)random() % INTPTR_MAX;
+		pheap_insert(heap, (void *)ex, (void *)ex);
+	}
+	test_time(TIME_SETUP);
+
+	pheap_destroy(heap, NULL);
+	taken = test_time(TIME_DONE);
+	fprintf(stderr, "Test 5 %s PASSED - Destroyed %ld nodes in %.3fms\n", name, count, taken * 1000.0);
+	return taken;
+} // test5_destroy
+
+
 void
 test5(intptr_t count)
 {
-	void *heap = NULL, **t5nodes = NULL;
-	intptr_t i, ex, lex, *keys = NULL;
+	void *heap, *key;
+	intptr_t i, n;
+	double tmalloc, tpool, tarena;
 
 	fprintf(stderr, "TEST 5 - FULL HEAP DESTROY\n");
 
+	tmalloc = test5_destroy(count, 0, "MALLOC");
+	tpool = test5_destroy(count, PH_OPT_POOL, "PH_OPT_POOL");
+	tarena = test5_destroy(count, PH_OPT_ARENA, "PH_OPT_ARENA");
+	if ((tpool > 0) && (tarena > 0))
+		fprintf(stderr, "Test 5 destroy speedup over malloc: POOL %.0fx, ARENA %.0fx\n",
+			tmalloc / tpool, tmalloc / tarena);
+
+	// Keys inserted in decreasing order leave a single chain as deep as the heap
+	// is big, which the destroy walk with a kd_free() has to get through without
+	// running out of stack
+	fprintf(stderr, "Test 5 DEGENERATE - Destroy a chain of %ld nodes with kd_free()\n", count);
+	test_time(TIME_START);
+	if ((heap = pheap_create(NULL)) == NULL) {
+		fprintf(stderr, "Test 5 DEGENERATE FAILED - Unable to create heap\n");
+		return;
+	}
+	for(i = count; i > 0; i--)
+		pheap_insert(heap, (void *)i, NULL);
+	test_time(TIME_SETUP);
+	t5_freed = 0;
+	pheap_destroy(heap, t5_kd_free);
+	test_time(TIME_DONE);
+	if (t5_freed != count)
+		fprintf(stderr, "Test 5 DEGENERATE FAILED - kd_free() called %ld times for %ld nodes\n", t5_freed, count);
+	else
+		fprintf(stderr, "Test 5 DEGENERATE PASSED\n");
+
+	// The same with pheap_clear(), after which the heap must still work
+	fprintf(stderr, "Test 5 CLEAR - Clear a chain of %ld nodes with kd_free(), and reuse the heap\n", count);
 	test_time(TIME_START);
+	if ((heap = pheap_create_ex(NULL, PH_OPT_ARENA)) == NULL) {
+		fprintf(stderr, "Test 5 CLEAR FAILED - Unable to create heap\n");
+		return;
+	}
+	for(i = count; i > 0; i--)
+		pheap_insert(heap, (void *)i, NULL);
+	test_time(TIME_SETUP);
+	t5_freed = 0;
+	pheap_clear(heap, t5_kd_free);
+	test_time(TIME_DONE);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, (void *)(count - i), NULL);
+	for(i = 1, n = 0; pheap_delete_min(heap, &key, NULL); i++)
+		if ((intptr_t)key != i)
+			n++;
+	pheap_destroy(heap, NULL);
+	if ((t5_freed != count) || n || (i != count + 1))
+		fprintf(stderr, "Test 5 CLEAR FAILED - kd_free() called %ld times, %ld keys wrong\n", t5_freed, n);
+	else
+		fprintf(stderr, "Test 5 CLEAR PASSED\n");
+} // test5
 
-	fprintf(stderr, "Setup: First inserting %ld nodes\n", count);
 
-	t5nodes = (void **)calloc(count, sizeof(void *));
-	if(t5nodes == NULL) {
-		fprintf(stderr, "Test 2 FAILED - Out of memory\n");
+struct t6item {
+	intptr_t		key;
+	struct pheap_node	node;
+};
+
+void
+test6(intptr_t count)
+{
+	void *heap = NULL, *other;
+	struct t6item *items = NULL, *it;
+	struct pheap_node *pn;
+	intptr_t i, ex, lex, cnt, bad = 0;
+
+	fprintf(stderr, "TEST 6 - INTRUSIVE NODES\n");
+
+	test_time(TIME_START);
+	if((items = (struct t6item *)calloc(count, sizeof(struct t6item))) == NULL) {
+		fprintf(stderr, "Test 6 FAILED - Out of memory\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
-		goto t5cleanup;
+		goto t6cleanup;
 	}
-
-	keys = (intptr_t *)calloc(count, sizeof(intptr_t));
-	if(keys == NULL) {
-		fprintf(stderr, "Test 2 FAILED - Out of memory\n");
+	if((heap = pheap_create_ex(NULL, PH_OPT_INTRUSIVE)) == NULL) {
+		fprintf(stderr, "Test 6 FAILED - Unable to acquire a heap\n");
 		test_time(TIME_SETUP);
 		test_time(TIME_DONE);
-		goto t5cleanup;
+		goto t6cleanup;
+	}
+	for(i = 0; i < count; i++) {
+		items[i].key = (intptr_t)random() % INTPTR_MAX;
+		bad += !pheap_insert_node(heap, &items[i].node, (void *)items[i].key);
+	}
+	fprintf(stderr, "Test 6 SETUP - Inserted %ld embedded nodes\n", i);
+	test_time(TIME_SETUP);
+
+	// Change every key, then delete every 4th item in place
+	for(i = 0; i < count; i++) {
+		items[i].key = (intptr_t)random() % INTPTR_MAX;
+		pheap_change_key_node(heap, &items[i].node, (void *)items[i].key);
+	}
+	for(i = 0; i < count; i += 4) {
+		pheap_delete_node(heap, &items[i].node);
+	}
+	cnt = count - ((count + 3) >> 2);
+
+	// Drain and validate the order, and the path back to the owning item
+	i = ex = lex = 0;
+	while((pn = pheap_delete_min_node(heap))) {
+		it = pheap_entry(pn, struct t6item, node);
+		ex = (intptr_t)pheap_get_key(pn);
+		if((ex < lex) || (ex != it->key))
+			break;
+		lex = ex;
+		i++;
+	}
+	fprintf(stderr, "Test 6 DONE - Changed keys, deleted and sorted %ld embedded nodes\n", i);
+	test_time(TIME_DONE);
+
+	// A heap that would free the node, or never look in its inbox, must refuse it
+	if ((other = pheap_create(NULL))) {
+		bad += pheap_insert_node(other, &items[0].node, NULL);
+		bad += pheap_inbox_push(other, &items[0].node, NULL);
+		bad += (pheap_delete_min(other, NULL, NULL) != 0);
+		pheap_destroy(other, NULL);
+	}
+	bad += pheap_inbox_push(heap, &items[0].node, NULL);
+	if ((other = pheap_create_ex(NULL, PH_OPT_INTRUSIVE | PH_OPT_INBOX))) {
+		bad += !pheap_inbox_push(other, &items[0].node, NULL);
+		bad += (pheap_delete_min_node(other) != &items[0].node);
+		pheap_destroy(other, NULL);
+	}
+
+	if (bad)
+		fprintf(stderr, "Test 6 FAILED - %ld caller owned nodes went to the wrong heap\n", bad);
+	else if(i < cnt)
+		fprintf(stderr, "Test 6 FAILED - Out of order after %ld deletions\n", i);
+	else if (pheap_delete_min_node(heap))
+		fprintf(stderr, "Test 6 FAILED - Tree is not empty\n");
+	else
+		fprintf(stderr, "Test 6 PASSED\n");
+
+	// Cleanup
+t6cleanup:
+	if (heap) {
+		pheap_destroy(heap, NULL);
+		heap = NULL;
+	}
+	if (items) {
+		free(items);
+		items = NULL;
+	}
+} // test6
+
+
+static int
+t7_u64_cmp(void *a, void *b)
+{
+	return ((uint64_t)a < (uint64_t)b) ? -1 : ((uint64_t)a > (uint64_t)b);
+} // t7_u64_cmp
+
+
+static int
+t7_double_cmp(void *a, void *b)
+{
+	double x = pheap_key_double(a), y = pheap_key_double(b);
+
+	return (x < y) ? -1 : (x > y);
+} // t7_double_cmp
+
+
+static int
+t7_str_cmp(void *a, void *b)
+{
+	return strcmp((char *)a, (char *)b);
+} // t7_str_cmp
+
+
+// Sorts count keys through a heap of the given type.  Returns the time taken
+double
+test7_sort(intptr_t count, const char *name, void *heap, void **keys, int (*cmp)(void *, void *))
+{
+	void *key, *lkey = NULL;
+	intptr_t i;
+	double taken;
+
+	fprintf(stderr, "Test 7 %s - Insert and Sort %ld keys\n", name, count);
+	test_time(TIME_START);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, keys[i], NULL);
+	test_time(TIME_SETUP);
+	for(i = 0; pheap_delete_min(heap, &key, NULL); i++) {
+		if((i > 0) && (cmp(key, lkey) < 0))
+			break;
+		lkey = key;
+	}
+	taken = test_time(TIME_DONE);
+
+	if(i < count)
+		fprintf(stderr, "Test 7 %s FAILED - Out of order after %ld deletions\n", name, i);
+	else
+		fprintf(stderr, "Test 7 %s PASSED\n", name);
+	pheap_destroy(heap, NULL);
+	return taken;
+} // test7_sort
+
+
+void
+test7(intptr_t count)
+{
+	void **keys = NULL;
+	char *strs = NULL;
+	intptr_t i;
+	double tcb, tu64;
+
+	fprintf(stderr, "TEST 7 - BUILT-IN KEY TYPES\n");
+
+	keys = (void **)calloc(count, sizeof(void *));
+	strs = (char *)calloc(count, 32);
+	if((keys == NULL) || (strs == NULL)) {
+		fprintf(stderr, "Test 7 FAILED - Out of memory\n");
+		goto t7cleanup;
 	}
 
-	heap = pheap_create(NULL);
+	for(i = 0; i < count; i++)
+		keys[i] = (void *)(((uint64_t)random() << 33) ^ random());
+	tcb = test7_sort(count, "U64 USER CALLBACK", pheap_create_ex(t7_u64_cmp, PH_OPT_POOL), keys, t7_u64_cmp);
+	tu64 = test7_sort(count, "PH_KEY_U64", pheap_create_ex(NULL, PH_KEY_U64 | PH_OPT_POOL), keys, t7_u64_cmp);
+	if(tu64 > 0)
+		fprintf(stderr, "Test 7 PH_KEY_U64 speedup over user callback: %.2fx\n", tcb / tu64);
+
+	for(i = 0; i < count; i++)
+		keys[i] = pheap_double_key((double)random() / 1000.0 - 1000000.0);
+	test7_sort(count, "PH_KEY_DOUBLE", pheap_create_ex(NULL, PH_KEY_DOUBLE | PH_OPT_POOL), keys, t7_double_cmp);
 
 	for(i = 0; i < count; i++) {
+		snprintf(strs + (i * 32), 32, "%08lx:%ld", random() % 0xfffffff, i);
+		keys[i] = strs + (i * 32);
+	}
+	test7_sort(count, "STRCMP USER CALLBACK", pheap_create_ex(t7_str_cmp, PH_OPT_POOL), keys, t7_str_cmp);
+	test7_sort(count, "PH_KEY_STRPFX", pheap_create_ex(NULL, PH_KEY_STRPFX | PH_OPT_POOL), keys, t7_str_cmp);
+
+t7cleanup:
+	if (keys) {
+		free(keys);
+		keys = NULL;
+	}
+	if (strs) {
+		free(strs);
+		strs = NULL;
+	}
+} // test7
+
+
+// Inserts count keys in bursts of burst keys, popping half a burst after each
+// one, and then drains and validates the heap.  mode 0 uses pheap_insert(),
+// mode 1 uses pheap_insert() on a PH_OPT_INSBUF heap, and mode 2 uses
+// pheap_insert_batch().  Returns the time taken
+double
+test8_bursts(intptr_t count, intptr_t burst, int mode, void **keys)
+{
+	static const char *names[] = { "PHEAP_INSERT", "PH_OPT_INSBUF", "PHEAP_INSERT_BATCH" };
+	void *heap, *data;
+	intptr_t i, j, ex, lex;
+	double taken;
+
+	fprintf(stderr, "Test 8 %s - Insert %ld nodes in bursts of %ld\n", names[mode], count, burst);
+	if ((heap = pheap_create_ex(NULL, PH_OPT_POOL | (mode == 1 ? PH_OPT_INSBUF : 0))) == NULL) {
+		fprintf(stderr, "Test 8 FAILED - Unable to acquire a heap\n");
+		return 0;
+	}
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	for (i = 0; i < count; i += burst) {
+		if (i + burst > count)
+			burst = count - i;
+		if (mode == 2) {
+			pheap_insert_batch(heap, keys + i, keys + i, burst, NULL);
+		} else {
+			for (j = 0; j < burst; j++)
+				pheap_insert(heap, keys[i + j], keys[i + j]);
+		}
+		for (j = 0; j < (burst >> 1); j++)
+			pheap_delete_min(heap, NULL, NULL);
+	}
+	i = ex = lex = 0;
+	while (pheap_delete_min(heap, NULL, &data)) {
+		ex = (intptr_t)data;
+		if (ex < lex)
+			break;
+		lex = ex;
+		i++;
+	}
+	taken = test_time(TIME_DONE);
+
+	// Only the final drain is checked for order, as the pops in between take
+	// out keys that are smaller than keys that are yet to be inserted
+	if (pheap_delete_min(heap, NULL, NULL) || (ex < lex))
+		fprintf(stderr, "Test 8 %s FAILED - Out of order after %ld deletions\n", names[mode], i);
+	else
+		fprintf(stderr, "Test 8 %s PASSED\n", names[mode]);
+	pheap_destroy(heap, NULL);
+	return taken;
+} // test8_bursts
+
+
+void
+test8(intptr_t count)
+{
+	void **keys;
+	intptr_t i, burst = 16384;
+	double tins, tbuf, tbatch;
+
+	fprintf(stderr, "TEST 8 - INSERT BURSTS\n");
+
+	if ((keys = (void **)calloc(count, sizeof(void *))) == NULL) {
+		fprintf(stderr, "Test 8 FAILED - Out of memory\n");
+		return;
+	}
+	for (i = 0; i < count; i++)
+		keys[i] = (void *)((intptr_t)random() % INTPTR_MAX);
+
+	tins = test8_bursts(count, burst, 0, keys);
+	tbuf = test8_bursts(count, burst, 1, keys);
+	tbatch = test8_bursts(count, burst, 2, keys);
+	if ((tbuf > 0) && (tbatch > 0))
+		fprintf(stderr, "Test 8 speedup over pheap_insert: PH_OPT_INSBUF %.2fx, pheap_insert_batch %.2fx\n",
+			tins / tbuf, tins / tbatch);
+	free(keys);
+} // test8
+
+
+// Builds nq queues of count / nq nodes each, and then combines them into the
+// first queue either by melding, or by draining and reinserting all the others
+// Then deletes every 8th node through its original handle and validates the
+// sort order of the rest.  Returns the time taken to combine the queues
+double
+test9_combine(intptr_t count, int meld)
+{
+	void *heaps[16], **nodes = NULL, *data;
+	intptr_t i, q, ex, lex, per, nq = 16, cnt = 0;
+	double taken = 0;
+
+	fprintf(stderr, "Test 9 %s - Combining %ld queues of %ld nodes\n",
+		meld ? "PHEAP_MELD" : "DRAIN + REINSERT", nq, count / nq);
+
+	per = count / nq;
+	if (per < 1)
+		per = 1;
+	if ((nodes = (void **)calloc(per * nq, sizeof(void *))) == NULL) {
+		fprintf(stderr, "Test 9 FAILED - Out of memory\n");
+		return 0;
+	}
+	for (q = 0; q < nq; q++)
+		heaps[q] = pheap_create(NULL);
+	for (i = 0; i < per * nq; i++) {
 		ex = (intptr_t)random() % INTPTR_MAX;
-		keys[i] = ex;
-		t5nodes[i] = pheap_insert(heap, (void *)ex, (void *)ex);
+		nodes[i] = pheap_insert(heaps[i % nq], (void *)ex, (void *)ex);
+	}
+	// Activate each heap a little, as a live queue would be
+	for (q = 0; q < nq; q++) {
+		data = pheap_get_min_node(heaps[q], NULL, NULL);
+		for (i = q; i < per * nq; i += nq) {
+			if (nodes[i] == data) {
+				pheap_delete(heaps[q], nodes[i], NULL, NULL);
+				nodes[i] = NULL;
+				break;
+			}
+		}
 	}
 
-	fprintf(stderr, "Test 5 SETUP - Inserted %ld nodes\n", i);
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	for (q = 1; q < nq; q++) {
+		if (meld) {
+			if (!pheap_meld(heaps[0], heaps[q]))
+				break;
+		} else {
+			void *key;
 
-	// Issue a del_min followed by an insert count times
+			while (pheap_delete_min(heaps[q], &key, &data))
+				pheap_insert(heaps[0], key, data);
+		}
+	}
+	taken = test_time(TIME_DONE);
 
-	fprintf(stderr, "Run: Now issuing a del_min followed by an insert %ld times\n", count);
-	// Now Change all the keys
-	for(i = 0; i < count; i++) {
-		pheap_delete_min(heap, NULL, NULL);
+	// Handles are only still valid in the melded case
+	if (meld) {
+		for (i = 0; i < per * nq; i += 8) {
+			if (nodes[i]) {
+				pheap_delete(heaps[0], nodes[i], NULL, NULL);
+				cnt++;
+			}
+		}
+	}
+	i = ex = lex = 0;
+	while (pheap_delete_min(heaps[0], NULL, &data)) {
+		ex = (intptr_t)data;
+		if (ex < lex)
+			break;
+		lex = ex;
+		i++;
+	}
+	if ((q < nq) || (ex < lex) || (i + cnt != (per * nq) - nq))
+		fprintf(stderr, "Test 9 FAILED - Combined heap is invalid after %ld deletions\n", i);
+	else
+		fprintf(stderr, "Test 9 %s PASSED\n", meld ? "PHEAP_MELD" : "DRAIN + REINSERT");
+
+	for (q = 0; q < nq; q++)
+		pheap_destroy(heaps[q], NULL);
+	free(nodes);
+	return taken;
+} // test9_combine
+
+
+// Reserves room for more than count nodes in one heap, puts one in, and melds it into
+// another heap.  The room left over must go with it, so the next inserts into the other
+// heap are made in the reserved slab, rather than in new memory with the room stranded
+static int
+test9_reserve(intptr_t count)
+{
+	void *src, *dst, *key;
+	char *lo, *hi, *n;
+	intptr_t i, r = count + 1000, in = 0, bad = 0;
+
+	src = pheap_create_ex(NULL, PH_OPT_POOL);
+	dst = pheap_create_ex(NULL, PH_OPT_POOL);
+	if ((src == NULL) || (dst == NULL) || !pheap_reserve(src, r)) {
+		pheap_destroy(src, NULL);
+		pheap_destroy(dst, NULL);
+		return 1;
+	}
+	lo = (char *)pheap_insert(src, (void *)0, NULL);
+	hi = lo + r * sizeof(struct pheap_node);
+	pheap_insert(dst, (void *)1, NULL);
+	if (!pheap_meld(dst, src))
+		bad++;
+	for(i = 2; i < r; i++) {
+		n = (char *)pheap_insert(dst, (void *)(random() % INTPTR_MAX), NULL);
+		in += ((n >= lo) && (n < hi));
+	}
+	if (in < (r - 2) / 2)
+		bad++;
+	if (!pheap_compact(dst, NULL))
+		bad++;
+	for(i = 0; pheap_delete_min(dst, &key, NULL); i++);
+	if (i != r)
+		bad++;
+	pheap_destroy(src, NULL);
+	pheap_destroy(dst, NULL);
+	return bad;
+} // test9_reserve
+
+
+void
+test9(intptr_t count)
+{
+	double tdrain, tmeld;
+
+	fprintf(stderr, "TEST 9 - MELD QUEUES\n");
+
+	tdrain = test9_combine(count, 0);
+	tmeld = test9_combine(count, 1);
+	if (tmeld > 0)
+		fprintf(stderr, "Test 9 pheap_meld speedup over drain + reinsert: %.0fx\n", tdrain / tmeld);
+	else
+		fprintf(stderr, "Test 9 pheap_meld took no measurable time\n");
+	if (test9_reserve(count))
+		fprintf(stderr, "Test 9 FAILED - Reserved nodes were stranded by pheap_meld\n");
+	else
+		fprintf(stderr, "Test 9 RESERVE PASSED\n");
+} // test9
+
+
+void
+test10_print(void *heap, const char *when)
+{
+	struct pheap_stats st;
+	size_t depth[16], degree[16], i, n;
+
+	fprintf(stderr, "Test 10 shape %s\n", when);
+	if (pheap_stats(heap, &st)) {
+		fprintf(stderr, "  nodes %lu, root children %lu, comparisons %lu, merges %lu\n",
+			st.nodes, st.root_children, st.comparisons, st.merges);
+		fprintf(stderr, "  merge pairs passes %lu, longest chain %lu, MSN limit hits %lu\n",
+			st.pair_passes, st.longest_chain, st.msn_limit_hits);
+	} else {
+		fprintf(stderr, "  (counters not compiled in, build with -D__PH_STATS)\n");
+	}
+	n = pheap_stats_shape(heap, depth, degree, 16);
+	fprintf(stderr, "  %lu nodes walked\n  depth: ", n);
+	for (i = 0; i < 16; i++)
+		fprintf(stderr, " %lu", depth[i]);
+	fprintf(stderr, "\n  degree:");
+	for (i = 0; i < 16; i++)
+		fprintf(stderr, " %lu", degree[i]);
+	fprintf(stderr, "\n");
+} // test10_print
+
+
+void
+test10(intptr_t count)
+{
+	void *heap;
+	struct pheap_stats st;
+	intptr_t i, ex;
+
+	fprintf(stderr, "TEST 10 - HEAP STATISTICS\n");
+
+	if ((heap = pheap_create(NULL)) == NULL) {
+		fprintf(stderr, "Test 10 FAILED - Unable to acquire a heap\n");
+		return;
+	}
+	for (i = 0; i < count; i++) {
 		ex = (intptr_t)random() % INTPTR_MAX;
-		keys[i] = ex;
-		t5nodes[i] = pheap_insert(heap, (void *)ex, (void *)ex);
+		pheap_insert(heap, (void *)ex, (void *)ex);
+	}
+	test10_print(heap, "after inserts");
+	pheap_delete_min(heap, NULL, NULL);
+	test10_print(heap, "after first delete min");
+	for (i = 0; i < count; i++) {
+		if (!pheap_delete_min(heap, NULL, NULL))
+			break;
+		ex = (intptr_t)random() % INTPTR_MAX;
+		pheap_insert(heap, (void *)ex, (void *)ex);
+	}
+	test10_print(heap, "after delete min + insert churn");
+
+	if ((pheap_stats_shape(heap, NULL, NULL, 1) != (size_t)count - 1) ||
+	    (pheap_stats(heap, &st) && (st.nodes != (uint64_t)count - 1)))
+		fprintf(stderr, "Test 10 FAILED - Node count mismatch\n");
+	else
+		fprintf(stderr, "Test 10 PASSED\n");
+	pheap_destroy(heap, NULL);
+} // test10
+
+
+static uint64_t t11_calls;		// Calls made to the user compare functions
+
+struct t11key {
+	uint32_t	major;
+	uint32_t	minor;
+	char		name[48];
+};
+
+
+static int
+t11_str_cmp(void *a, void *b)
+{
+	t11_calls++;
+	return strcmp((char *)a, (char *)b);
+} // t11_str_cmp
+
+
+static uint64_t
+t11_str_prefix(void *key)
+{
+	return pheap_prefix_str((char *)key);
+} // t11_str_prefix
+
+
+static int
+t11_struct_cmp(void *a, void *b)
+{
+	struct t11key *x = (struct t11key *)a, *y = (struct t11key *)b;
+
+	t11_calls++;
+	if (x->major != y->major)
+		return (x->major < y->major) ? -1 : 1;
+	if (x->minor != y->minor)
+		return (x->minor < y->minor) ? -1 : 1;
+	return strcmp(x->name, y->name);
+} // t11_struct_cmp
+
+
+static uint64_t
+t11_struct_prefix(void *key)
+{
+	struct t11key *k = (struct t11key *)key;
+
+	return ((uint64_t)k->major << 32) | k->minor;
+} // t11_struct_prefix
+
+
+// Sorts count keys through the given heap, counting the calls made to cmp()
+// Returns the time taken to sort them
+double
+test11_sort(intptr_t count, const char *name, void *heap, void **keys, int (*cmp)(void *, void *))
+{
+	void *key, *lkey = NULL;
+	intptr_t i;
+	uint64_t calls;
+	double taken;
+
+	if (heap == NULL) {
+		fprintf(stderr, "Test 11 %s FAILED - Unable to create heap\n", name);
+		return 0;
+	}
+	fprintf(stderr, "Test 11 %s - Insert and Sort %ld keys\n", name, count);
+	test_time(TIME_START);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, keys[i], NULL);
+	test_time(TIME_SETUP);
+	t11_calls = 0;
+	for(i = 0; pheap_delete_min(heap, &key, NULL); i++) {
+		if((i > 0) && (cmp(key, lkey) < 0))
+			break;
+		lkey = key;
+	}
+	taken = test_time(TIME_DONE);
+	calls = t11_calls - (i > 0 ? i - 1 : 0);
+
+	if(i < count)
+		fprintf(stderr, "Test 11 %s FAILED - Out of order after %ld deletions\n", name, i);
+	else
+		fprintf(stderr, "Test 11 %s PASSED - %.2f user compares per delete min\n", name, (double)calls / count);
+	pheap_destroy(heap, NULL);
+	return taken;
+} // test11_sort
+
+
+// Sorts keys that each sit in their own allocation, so that every compare that
+// looks at a key is likely to miss the cache, with and without key prefixes
+void
+test11(intptr_t count)
+{
+	void **keys = NULL;
+	struct t11key *k;
+	intptr_t i, j;
+	double tcb, tpfx;
+
+	fprintf(stderr, "TEST 11 - PREFIXED KEYS\n");
+
+	if ((keys = (void **)calloc(count, sizeof(void *))) == NULL) {
+		fprintf(stderr, "Test 11 FAILED - Out of memory\n");
+		return;
+	}
+	for(i = 0; i < count; i++) {
+		if ((keys[i] = malloc(32)) == NULL) {
+			fprintf(stderr, "Test 11 FAILED - Out of memory\n");
+			goto t11cleanup;
+		}
+		snprintf((char *)keys[i], 32, "%08lx:%ld", random() % 0xfffffff, i);
+	}
+	// Shuffle, so that keys next to each other in memory aren't inserted together
+	for(i = count - 1; i > 0; i--) {
+		void *t = keys[i];
+
+		j = random() % (i + 1);
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+	tcb = test11_sort(count, "STRCMP USER CALLBACK", pheap_create_ex(t11_str_cmp, PH_OPT_POOL), keys, t11_str_cmp);
+	test11_sort(count, "PH_KEY_STRPFX", pheap_create_ex(NULL, PH_KEY_STRPFX | PH_OPT_POOL), keys, t11_str_cmp);
+	tpfx = test11_sort(count, "PREFIXED STRCMP", pheap_create_prefixed(t11_str_cmp, t11_str_prefix, PH_OPT_POOL), keys, t11_str_cmp);
+	if (tpfx > 0)
+		fprintf(stderr, "Test 11 prefixed string key speedup over user callback: %.2fx\n", tcb / tpfx);
+
+	for(i = 0; i < count; i++) {
+		free(keys[i]);
+		if ((keys[i] = malloc(sizeof(struct t11key))) == NULL) {
+			fprintf(stderr, "Test 11 FAILED - Out of memory\n");
+			goto t11cleanup;
+		}
+		k = (struct t11key *)keys[i];
+		k->major = random() % 1000;
+		k->minor = random() % 1000;
+		snprintf(k->name, sizeof(k->name), "%ld", i);
+	}
+	tcb = test11_sort(count, "STRUCT USER CALLBACK", pheap_create_ex(t11_struct_cmp, PH_OPT_POOL), keys, t11_struct_cmp);
+	tpfx = test11_sort(count, "PREFIXED STRUCT", pheap_create_prefixed(t11_struct_cmp, t11_struct_prefix, PH_OPT_POOL), keys, t11_struct_cmp);
+	if (tpfx > 0)
+		fprintf(stderr, "Test 11 prefixed struct key speedup over user callback: %.2fx\n", tcb / tpfx);
+
+t11cleanup:
+	for(i = 0; i < count; i++)
+		free(keys[i]);
+	free(keys);
+} // test11
+
+
+// Inserts the keys, and then empties the heap with either a pheap_delete_min()
+// loop, or pheap_delete_min_n() batches of 256.  Returns the time taken
+double
+test12_sort(intptr_t count, int batch, void **keys)
+{
+	const char *name = batch ? "PHEAP_DELETE_MIN_N" : "DELETE_MIN LOOP";
+	void *heap, *key, *lkey = NULL, *out[256];
+	intptr_t i = 0, bad = 0;
+	size_t n, j;
+	double taken;
+
+	if ((heap = pheap_create_ex(NULL, PH_OPT_POOL)) == NULL) {
+		fprintf(stderr, "Test 12 %s FAILED - Unable to create heap\n", name);
+		return 0;
+	}
+	fprintf(stderr, "Test 12 %s - Insert and Sort %ld keys\n", name, count);
+	test_time(TIME_START);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, keys[i], NULL);
+	test_time(TIME_SETUP);
+	i = 0;
+	if (batch) {
+		while ((n = pheap_delete_min_n(heap, 256, out, NULL)) > 0) {
+			for (j = 0; j < n; j++, i++) {
+				if ((i > 0) && ((intptr_t)out[j] < (intptr_t)lkey))
+					bad++;
+				lkey = out[j];
+			}
+		}
+	} else {
+		for (; pheap_delete_min(heap, &key, NULL); i++) {
+			if ((i > 0) && ((intptr_t)key < (intptr_t)lkey))
+				bad++;
+			lkey = key;
+		}
+	}
+	taken = test_time(TIME_DONE);
+
+	if (bad || (i != count))
+		fprintf(stderr, "Test 12 %s FAILED - %ld out of order, %ld of %ld deleted\n", name, bad, i, count);
+	else
+		fprintf(stderr, "Test 12 %s PASSED\n", name);
+	pheap_destroy(heap, NULL);
+	return taken;
+} // test12_sort
+
+
+// Inserts the keys as timers, then advances a clock in steps of step, firing
+// everything that is due after each step with either a pheap_get_min_node() +
+// pheap_delete_min() loop, or pheap_delete_until().  Returns the time taken
+double
+test12_drain(intptr_t count, intptr_t step, int until, void **keys)
+{
+	const char *name = until ? "PHEAP_DELETE_UNTIL" : "DUE TIMER LOOP";
+	void *heap, *key, *out[256];
+	intptr_t i, got = 0, now, bad = 0;
+	size_t n, j;
+	double taken;
+
+	if ((heap = pheap_create_ex(NULL, PH_OPT_POOL)) == NULL) {
+		fprintf(stderr, "Test 12 %s FAILED - Unable to create heap\n", name);
+		return 0;
+	}
+	fprintf(stderr, "Test 12 %s - Fire %ld timers in clock steps of %ld\n", name, count, step);
+	test_time(TIME_START);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, keys[i], NULL);
+	test_time(TIME_SETUP);
+
+	for(now = 0; got < count; now += step) {
+		if (until) {
+			while ((n = pheap_delete_until(heap, (void *)now, out, NULL, 256)) > 0) {
+				for (j = 0; j < n; j++)
+					if ((intptr_t)out[j] > now)
+						bad++;
+				got += n;
+				if (n < 256)
+					break;
+			}
+		} else {
+			while (pheap_get_min_node(heap, &key, NULL) && ((intptr_t)key <= now)) {
+				pheap_delete_min(heap, NULL, NULL);
+				got++;
+			}
+		}
+		if (pheap_get_min_node(heap, &key, NULL) && ((intptr_t)key <= now))
+			bad++;
+	}
+	taken = test_time(TIME_DONE);
+
+	if (bad || pheap_get_min_node(heap, NULL, NULL))
+		fprintf(stderr, "Test 12 %s FAILED - %ld bad timers\n", name, bad);
+	else
+		fprintf(stderr, "Test 12 %s PASSED\n", name);
+	pheap_destroy(heap, NULL);
+	return taken;
+} // test12_drain
+
+
+void
+test12(intptr_t count)
+{
+	void **keys;
+	intptr_t i, step = 4096;
+	double tloop, tbatch;
+
+	fprintf(stderr, "TEST 12 - BATCH POP\n");
+
+	if ((keys = (void **)calloc(count, sizeof(void *))) == NULL) {
+		fprintf(stderr, "Test 12 FAILED - Out of memory\n");
+		return;
+	}
+	for(i = 0; i < count; i++)
+		keys[i] = (void *)(random() % INTPTR_MAX);
+	tloop = test12_sort(count, 0, keys);
+	tbatch = test12_sort(count, 1, keys);
+	if (tbatch > 0)
+		fprintf(stderr, "Test 12 pheap_delete_min_n() speedup over delete_min loop: %.2fx\n", tloop / tbatch);
+
+	// Timers due at random times, about 1000 of them per clock step
+	for(i = 0; i < count; i++)
+		keys[i] = (void *)(random() % ((count / 1000 + 1) * step));
+	tloop = test12_drain(count, step, 0, keys);
+	tbatch = test12_drain(count, step, 1, keys);
+	if (tbatch > 0)
+		fprintf(stderr, "Test 12 pheap_delete_until() speedup over due timer loop: %.2fx\n", tloop / tbatch);
+	free(keys);
+} // test12
+
+
+static int
+t13_rev_cmp(void *a, void *b)
+{
+	return ((intptr_t)a < (intptr_t)b) ? 1 : -1;
+} // t13_rev_cmp
+
+
+// Keeps the k least of count random candidates, first by inserting every one
+// into a heap ordered greatest first and deleting its root whenever it holds
+// more than k, and then with a bounded heap.  Checks both keep the same keys
+void
+test13(intptr_t count)
+{
+	intptr_t i, k = 1000, n, bad = 0;
+	void **keys = NULL, *heap = NULL, *key;
+	intptr_t *manual = NULL;
+	double tmanual, tbounded;
+
+	fprintf(stderr, "TEST 13 - BOUNDED TOP-K HEAP\n");
+	if (k > count)
+		k = count;
+
+	keys = (void **)calloc(count, sizeof(void *));
+	manual = (intptr_t *)calloc(k, sizeof(intptr_t));
+	if ((keys == NULL) || (manual == NULL)) {
+		fprintf(stderr, "Test 13 FAILED - Out of memory\n");
+		goto t13cleanup;
 	}
+	for(i = 0; i < count; i++)
+		keys[i] = (void *)(random() % INTPTR_MAX);
 
-	fprintf(stderr, "Test 5 SETUP - Ran del_min + random insert %ld times\n", i);
+	fprintf(stderr, "Test 13 MANUAL EVICTION - Keep least %ld of %ld keys\n", k, count);
+	test_time(TIME_START);
+	if ((heap = pheap_create(t13_rev_cmp)) == NULL) {
+		fprintf(stderr, "Test 13 FAILED - Unable to create heap\n");
+		goto t13cleanup;
+	}
 	test_time(TIME_SETUP);
+	for(i = 0, n = 0; i < count; i++) {
+		pheap_insert(heap, keys[i], NULL);
+		if (++n > k) {
+			pheap_delete_min(heap, NULL, NULL);
+			n--;
+		}
+	}
+	tmanual = test_time(TIME_DONE);
+	for(i = k - 1; pheap_delete_min(heap, &key, NULL); i--)
+		manual[i] = (intptr_t)key;
+	pheap_destroy(heap, NULL);
 
-	fprintf(stderr, "Test 5 RUN - Destroying heap of %ld nodes\n", i);
+	fprintf(stderr, "Test 13 PHEAP_CREATE_BOUNDED - Keep least %ld of %ld keys\n", k, count);
+	test_time(TIME_START);
+	if ((heap = pheap_create_bounded(NULL, k)) == NULL) {
+		fprintf(stderr, "Test 13 FAILED - Unable to create bounded heap\n");
+		goto t13cleanup;
+	}
+	test_time(TIME_SETUP);
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, keys[i], NULL);
+	tbounded = test_time(TIME_DONE);
+	if (pheap_get_worst_node(heap, &key, NULL) && ((intptr_t)key != manual[k - 1]))
+		bad++;
 
+	// Churn the keys in ways that the worst node tracking has to follow, while
+	// leaving the same keys in the heap
+	for(i = 0; i < k; i++) {
+		void *node = pheap_get_worst_node(heap, &key, NULL), *wkey;
+
+		pheap_change_key(heap, node, (void *)(INTPTR_MAX - i));
+		if (pheap_get_worst_node(heap, NULL, NULL) != node)
+			bad++;
+		pheap_change_key(heap, node, key);
+		pheap_delete(heap, pheap_get_worst_node(heap, NULL, NULL), NULL, NULL);
+		if (pheap_get_worst_node(heap, &wkey, NULL) && ((intptr_t)wkey > (intptr_t)key))
+			bad++;
+		pheap_insert(heap, key, NULL);
+	}
+	for(i = 0; pheap_delete_min(heap, &key, NULL); i++)
+		if ((i >= k) || ((intptr_t)key != manual[i]))
+			bad++;
+	if (i != k)
+		bad++;
 	pheap_destroy(heap, NULL);
-	heap = NULL;
 
+	if (bad)
+		fprintf(stderr, "Test 13 FAILED - %ld keys differ from manual eviction\n", bad);
+	else
+		fprintf(stderr, "Test 13 PASSED\n");
+	if (tbounded > 0)
+		fprintf(stderr, "Test 13 bounded heap speedup over manual eviction: %.2fx\n", tmanual / tbounded);
+
+t13cleanup:
+	free(keys);
+	free(manual);
+} // test13
+
+
+// Runs a mixed workload through a heap with each PH_PAIR_* pairing strategy.
+// Inserts the keys, changes the keys of a quarter of the nodes, deletes every
+// eighth node by handle, and drains what's left, checking the order
+void
+test14(intptr_t count)
+{
+	static const int pairing[] = { PH_PAIR_CHUNKED, PH_PAIR_TWOPASS, PH_PAIR_MULTIPASS,
+				       PH_PAIR_FRONTBACK, PH_PAIR_AUXTWOPASS };
+	static const char *names[] = { "CHUNKED", "TWOPASS", "MULTIPASS", "FRONTBACK", "AUXTWOPASS" };
+	void **keys = NULL, **nodes = NULL, *heap, *key, *lkey;
+	intptr_t i, n, bad;
+	double taken[5];
+	int p;
+
+	fprintf(stderr, "TEST 14 - PAIRING STRATEGIES\n");
+	keys = (void **)calloc(count, sizeof(void *));
+	nodes = (void **)calloc(count, sizeof(void *));
+	if ((keys == NULL) || (nodes == NULL)) {
+		fprintf(stderr, "Test 14 FAILED - Out of memory\n");
+		goto t14cleanup;
+	}
+	for(i = 0; i < count; i++)
+		keys[i] = (void *)(random() % INTPTR_MAX);
+
+	for(p = 0; p < 5; p++) {
+		fprintf(stderr, "Test 14 PH_PAIR_%s - Insert, change, delete and sort %ld keys\n", names[p], count);
+		taken[p] = 0;
+		if ((heap = pheap_create_ex(NULL, PH_OPT_POOL | pairing[p])) == NULL) {
+			fprintf(stderr, "Test 14 FAILED - Unable to create heap\n");
+			continue;
+		}
+		test_time(TIME_START);
+		for(i = 0; i < count; i++)
+			nodes[i] = pheap_insert(heap, keys[i], NULL);
+		test_time(TIME_SETUP);
+		for(i = 0; i < count; i += 4)
+			pheap_change_key(heap, nodes[i], keys[count - i - 1]);
+		for(i = 1, n = 0; i < count; i += 8, n++)
+			pheap_delete(heap, nodes[i], NULL, NULL);
+		for(bad = 0, lkey = NULL; pheap_delete_min(heap, &key, NULL); n++) {
+			if (lkey && ((intptr_t)key < (intptr_t)lkey))
+				bad++;
+			lkey = key;
+		}
+		taken[p] = test_time(TIME_DONE);
+		pheap_destroy(heap, NULL);
+
+		if (bad || (n != count))
+			fprintf(stderr, "Test 14 PH_PAIR_%s FAILED - %ld out of order, %ld of %ld deleted\n",
+				names[p], bad, n, count);
+		else
+			fprintf(stderr, "Test 14 PH_PAIR_%s PASSED\n", names[p]);
+	}
+	for(p = 1; p < 5; p++)
+		if ((taken[0] > 0) && (taken[p] > 0))
+			fprintf(stderr, "Test 14 PH_PAIR_%s time relative to PH_PAIR_CHUNKED: %.2fx\n", names[p], taken[p] / taken[0]);
+
+t14cleanup:
+	free(keys);
+	free(nodes);
+} // test14
+
+
+// Writes a string key as its length and bytes, and the data as it is
+static size_t
+t15_serialize(void *key, void *data, void *buf, size_t len)
+{
+	size_t klen = strlen((char *)key) + 1;
+
+	if (len >= sizeof(void *) + klen) {
+		memcpy(buf, &data, sizeof(void *));
+		memcpy((char *)buf + sizeof(void *), key, klen);
+	}
+	return sizeof(void *) + klen;
+} // t15_serialize
+
+
+// Points the key straight into the mapped snapshot
+static void
+t15_deserialize(const void *rec, size_t len, void **key, void **data)
+{
+	(void)len;
+	memcpy(data, rec, sizeof(void *));
+	*key = (char *)rec + sizeof(void *);
+} // t15_deserialize
+
+
+static int
+t15_str_cmp(void *a, void *b)
+{
+	return strcmp((char *)a, (char *)b);
+} // t15_str_cmp
+
+
+// Snapshots a heap of count string keys part way through being used, restores
+// it, and checks that the restored heap has the same shape and drains in order
+void
+test15(intptr_t count)
+{
+	char *keys = NULL, *lkey = NULL;
+	void *heap = NULL, *rheap = NULL, *bheap = NULL, *key, *data;
+	size_t sdepth[32], rdepth[32], sdeg[32], rdeg[32];
+	uint64_t nodes;
+	intptr_t i, bad = 0;
+	FILE *fp = NULL;
+
+	fprintf(stderr, "TEST 15 - SNAPSHOT AND RESTORE\n");
+	keys = (char *)malloc(count * 16);
+	heap = pheap_create_ex(t15_str_cmp, PH_OPT_POOL);
+	if ((keys == NULL) || (heap == NULL) || ((fp = tmpfile()) == NULL)) {
+		fprintf(stderr, "Test 15 FAILED - Out of memory or files\n");
+		goto t15cleanup;
+	}
+	for(i = 0; i < count; i++) {
+		snprintf(keys + i * 16, 16, "%015lu", (unsigned long)random() % 1000000000000000UL);
+		pheap_insert(heap, keys + i * 16, (void *)i);
+	}
+	pheap_delete_min(heap, NULL, NULL);
+
+	fprintf(stderr, "Test 15 SNAPSHOT - Save a heap of %ld string keys\n", count - 1);
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	if (!pheap_snapshot(heap, fileno(fp), t15_serialize)) {
+		fprintf(stderr, "Test 15 FAILED - pheap_snapshot() failed\n");
+		goto t15cleanup;
+	}
+	fflush(fp);
 	test_time(TIME_DONE);
 
-	fprintf(stderr, "Test 5 DONE - Destroyed Heap with %ld nodes\n", i);
+	fprintf(stderr, "Test 15 RESTORE - Rebuild the heap from the snapshot\n");
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	if ((rheap = pheap_restore(fileno(fp), t15_str_cmp, 0, t15_deserialize)) == NULL) {
+		fprintf(stderr, "Test 15 FAILED - pheap_restore() failed\n");
+		goto t15cleanup;
+	}
+	test_time(TIME_DONE);
 
-	fprintf(stderr, "Test 5 PASSED\n");
+	pheap_stats_shape(heap, sdepth, sdeg, 32);
+	pheap_stats_shape(rheap, rdepth, rdeg, 32);
+	if (memcmp(sdepth, rdepth, sizeof(sdepth)) || memcmp(sdeg, rdeg, sizeof(sdeg)))
+		bad++;
 
-	// Cleanup
-t5cleanup:
-	if (t5nodes) {
-		free(t5nodes);
-		t5nodes = NULL;
+	// A snapshot whose header claims more nodes than its records can hold is refused
+	nodes = UINT64_MAX / 2;
+	if (fseek(fp, 8, SEEK_SET) || (fwrite(&nodes, sizeof(nodes), 1, fp) != 1) || fflush(fp))
+		bad++;
+	else if ((bheap = pheap_restore(fileno(fp), t15_str_cmp, 0, t15_deserialize)) != NULL)
+		bad++;
+	pheap_destroy(bheap, NULL);
+	for(i = 0; pheap_delete_min(rheap, &key, &data); i++) {
+		if ((lkey && (strcmp(lkey, (char *)key) > 0)) || strcmp(keys + (intptr_t)data * 16, (char *)key))
+			bad++;
+		lkey = (char *)key;
 	}
-	if (keys) {
+	if (bad || (i != count - 1))
+		fprintf(stderr, "Test 15 FAILED - %ld bad nodes, %ld of %ld restored\n", bad, i, count - 1);
+	else
+		fprintf(stderr, "Test 15 PASSED\n");
+
+t15cleanup:
+	pheap_destroy(rheap, NULL);
+	pheap_destroy(heap, NULL);
+	if (fp)
+		fclose(fp);
+	free(keys);
+} // test15
+
+
+struct t16_sum {
+	uintptr_t	sum;
+	intptr_t	count;
+};
+
+
+static int
+t16_add(void *opn, void *key, void *data, void *ctx)
+{
+	struct t16_sum *ts = (struct t16_sum *)ctx;
+
+	(void)opn;
+	(void)data;
+	ts->sum += (uintptr_t)key;
+	ts->count++;
+	return 0;
+} // t16_add
+
+
+// Hashes the handles in the order that the walk finds them, which only stays the same if
+// nothing has moved any node about in the heap
+static int
+t16_shape(void *opn, void *key, void *data, void *ctx)
+{
+	struct t16_sum *ts = (struct t16_sum *)ctx;
+
+	(void)key;
+	(void)data;
+	ts->sum = (ts->sum * 31) + (uintptr_t)opn;
+	ts->count++;
+	return 0;
+} // t16_shape
+
+
+// Copies each node into another heap, as monitoring code had to before there were cursors
+static int
+t16_copy(void *opn, void *key, void *data, void *ctx)
+{
+	(void)opn;
+	pheap_insert(ctx, key, data);
+	return 0;
+} // t16_copy
+
+
+// Reads a heap that has only had inserts, whose first read needs room for every node, with
+// the address space capped at its current size and the memory that malloc() has free used
+// up.  A read that gives NULL must be put down to no memory and lose nothing, so once the
+// cap is lifted the cursor still reads every node in order, and then ends without a failure.
+// Returns 1 if no memory was forced, else 0, and adds to *bad on a wrong result
+static int
+t16_nomem(intptr_t count, intptr_t *bad)
+{
+	struct rlimit old, cap;
+	unsigned long pages = 0;
+	void *heap, *cur, *key, *last = NULL, *n = NULL, **hog = NULL, **h;
+	size_t size;
+	intptr_t i = 0;
+	FILE *f;
+	int forced = 0;
+
+	if (((heap = pheap_create_ex(NULL, PH_OPT_POOL)) == NULL) || !pheap_reserve(heap, count)) {
+		pheap_destroy(heap, NULL);
+		return 1;
+	}
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, (void *)(random() % INTPTR_MAX), NULL);
+	cur = pheap_cursor_open(heap);
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(f, "%lu", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	i = 0;
+	if ((cur != NULL) && pages && (getrlimit(RLIMIT_AS, &old) == 0)) {
+		cap = old;
+		cap.rlim_cur = pages * 4096;
+		if (setrlimit(RLIMIT_AS, &cap) == 0) {
+			// Each block holds the one taken before it
+			for (size = 1 << 20; size >= 64; size >>= 1)
+				while ((h = (void **)malloc(size)) != NULL) {
+					*h = hog;
+					hog = h;
+				}
+			n = pheap_cursor_next(cur, &key, NULL);
+			forced = (n == NULL);
+			if (forced != pheap_cursor_failed(cur))
+				(*bad)++;
+			for (; hog; hog = h) {
+				h = (void **)*hog;
+				free(hog);
+			}
+			setrlimit(RLIMIT_AS, &old);
+			if (n != NULL) {
+				i = 1;
+				last = key;
+			}
+		}
+	}
+	for(; pheap_cursor_next(cur, &key, NULL); i++, last = key)
+		*bad += (i && ((intptr_t)key < (intptr_t)last));
+	if ((i != count) || pheap_cursor_failed(cur))
+		(*bad)++;
+	pheap_cursor_close(cur);
+	pheap_destroy(heap, NULL);
+	return !forced;
+} // t16_nomem
+
+
+// Looks at the heap without changing it: sums every key with pheap_foreach(), reads the
+// first 100 keys with a cursor compared against copying the heap to find them, and then
+// reads the whole heap with a cursor and checks that the heap still drains the same way.
+// No cursor may change the shape of the heap
+void
+test16(intptr_t count)
+{
+	void **keys = NULL, *heap, *copy, *cur, *key, *last;
+	intptr_t i, k, n, bad = 0;
+	struct t16_sum ts = { 0, 0 }, shape = { 0, 0 }, again;
+	uintptr_t sum = 0;
+	double tcopy, tcur[2];
+	int r;
+
+	fprintf(stderr, "TEST 16 - FOREACH AND SORTED CURSOR\n");
+	keys = (void **)calloc(count, sizeof(void *));
+	if ((keys == NULL) || ((heap = pheap_create_ex(NULL, PH_OPT_POOL)) == NULL)) {
+		fprintf(stderr, "Test 16 FAILED - Out of memory\n");
 		free(keys);
-		keys = NULL;
+		return;
 	}
-	if (heap) {
+	for(i = 0; i < count; i++) {
+		key = (void *)(random() % INTPTR_MAX);
+		sum += (uintptr_t)key;
+		pheap_insert(heap, key, NULL);
+	}
+	k = (count < 100) ? count : 100;
+
+	// Straight after the inserts the root has every other node as a child
+	pheap_foreach(heap, t16_shape, &shape);
+	cur = pheap_cursor_open(heap);
+	for(i = 0, last = NULL; (i < k) && pheap_cursor_next(cur, &key, NULL); i++, last = key)
+		bad += (i && ((intptr_t)key < (intptr_t)last));
+	pheap_cursor_close(cur);
+	again.sum = again.count = 0;
+	pheap_foreach(heap, t16_shape, &again);
+	if ((i != k) || (again.sum != shape.sum) || (again.count != shape.count))
+		bad++;
+
+	// Look at a heap in use, rather than one that has only had inserts
+	if (pheap_delete_min(heap, &key, NULL))
+		pheap_insert(heap, key, NULL);
+	shape.sum = shape.count = 0;
+	pheap_foreach(heap, t16_shape, &shape);
+	pheap_foreach(heap, t16_add, &ts);
+	if ((ts.count != count) || (ts.sum != sum))
+		bad++;
+
+	fprintf(stderr, "Test 16 COPY - Copy %ld nodes to read the least %ld\n", count, k);
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	copy = pheap_create_ex(NULL, PH_OPT_POOL);
+	pheap_foreach(heap, t16_copy, copy);
+	for(i = 0; i < k; i++)
+		pheap_delete_min(copy, &keys[i], NULL);
+	pheap_destroy(copy, NULL);
+	tcopy = test_time(TIME_DONE);
+
+	// Reading the same heap again must do the same work and find the same keys
+	for(r = 0; r < 2; r++) {
+		fprintf(stderr, "Test 16 CURSOR %s - Read the least %ld of %ld nodes\n", r ? "AGAIN" : "FIRST", k, count);
+		test_time(TIME_START);
+		test_time(TIME_SETUP);
+		cur = pheap_cursor_open(heap);
+		for(i = 0; (i < k) && pheap_cursor_next(cur, &key, NULL); i++)
+			bad += (key != keys[i]);
+		pheap_cursor_close(cur);
+		tcur[r] = test_time(TIME_DONE);
+		if (i != k)
+			bad++;
+	}
+
+	// A second cursor reads everything, and then the heap itself is drained
+	cur = pheap_cursor_open(heap);
+	for(n = 0; (n < count) && pheap_cursor_next(cur, &keys[n], NULL); n++)
+		bad += (n && ((intptr_t)keys[n] < (intptr_t)keys[n - 1]));
+	if ((n != count) || pheap_cursor_next(cur, NULL, NULL))
+		bad++;
+	pheap_cursor_close(cur);
+	again.sum = again.count = 0;
+	pheap_foreach(heap, t16_shape, &again);
+	if ((again.sum != shape.sum) || (again.count != shape.count))
+		bad++;
+	for(i = 0; pheap_delete_min(heap, &key, NULL); i++)
+		bad += ((i >= n) || (key != keys[i]));
+	if (i != count)
+		bad++;
+	pheap_destroy(heap, NULL);
+	if (t16_nomem(count, &bad))
+		fprintf(stderr, "Test 16 NOMEM - Cursor ran without running out of memory\n");
+
+	if (bad)
+		fprintf(stderr, "Test 16 FAILED - %ld bad results\n", bad);
+	else
+		fprintf(stderr, "Test 16 PASSED\n");
+	if ((tcur[0] > 0) && (tcur[1] > 0) && (tcopy > 0))
+		fprintf(stderr, "Test 16 cursor speedup over copying the heap: FIRST %.0fx, AGAIN %.0fx\n",
+			tcopy / tcur[0], tcopy / tcur[1]);
+	free(keys);
+} // test16
+
+
+static void	**t17_nodes;
+static intptr_t	t17_moved;
+
+// Keeps the node handles up to date as pheap_compact() moves them
+static void
+t17_relocate(void *oldh, void *newh, void *data)
+{
+	(void)oldh;
+	t17_nodes[(intptr_t)data] = newh;
+	t17_moved++;
+} // t17_relocate
+
+
+static int
+t17_sum(void *opn, void *key, void *data, void *ctx)
+{
+	(void)opn;
+	(void)data;
+	*(uintptr_t *)ctx += (uintptr_t)key;
+	return 0;
+} // t17_sum
+
+
+// Deletes a random node by its handle and inserts a new one in its place, so that
+// over time the nodes end up all over memory
+static void
+t17_churn(void *heap, intptr_t count)
+{
+	intptr_t j = random() % count;
+
+	pheap_delete(heap, t17_nodes[j], NULL, NULL);
+	t17_nodes[j] = pheap_insert(heap, (void *)(random() % INTPTR_MAX), (void *)j);
+} // t17_churn
+
+
+// Builds a heap of count nodes, each with its index as data, churns it, and does a delete
+// min and insert so that it is in use.  The same seed builds the same heap
+static void *
+t17_build(intptr_t count, int opts, unsigned seed)
+{
+	void *heap, *key, *data;
+	intptr_t i;
+
+	srandom(seed);
+	if ((heap = pheap_create_ex(NULL, opts)) == NULL)
+		return NULL;
+	for(i = 0; i < count; i++)
+		t17_nodes[i] = pheap_insert(heap, (void *)(random() % INTPTR_MAX), (void *)i);
+	for(i = 0; i < count; i++)
+		t17_churn(heap, count);
+	if (pheap_delete_min(heap, &key, &data))
+		t17_nodes[(intptr_t)data] = pheap_insert(heap, key, data);
+	return heap;
+} // t17_build
+
+
+// Drains the heap, returning the number of keys out of order
+static intptr_t
+t17_drain(void *heap, intptr_t count, void **keys)
+{
+	intptr_t i, bad = 0;
+
+	for(i = 0; pheap_delete_min(heap, &keys[i], NULL); i++)
+		bad += (i && ((intptr_t)keys[i] < (intptr_t)keys[i - 1]));
+	return bad + (i != count);
+} // t17_drain
+
+
+// Compares walking and draining a churned malloc heap before and after pheap_compact(),
+// and compacts a pooled heap in small steps with churn going on between them
+void
+test17(intptr_t count)
+{
+	void **keys = NULL, **keys2 = NULL, *heap = NULL, *cheap = NULL;
+	intptr_t i, steps, bad = 0;
+	uintptr_t sum[2] = { 0, 0 };
+	double twalk[2], tdrain[2];
+
+	fprintf(stderr, "TEST 17 - HEAP COMPACTION\n");
+	keys = (void **)calloc(count, sizeof(void *));
+	keys2 = (void **)calloc(count, sizeof(void *));
+	t17_nodes = (void **)calloc(count, sizeof(void *));
+	if ((keys == NULL) || (keys2 == NULL) || (t17_nodes == NULL)) {
+		fprintf(stderr, "Test 17 FAILED - Out of memory\n");
+		goto t17cleanup;
+	}
+
+	fprintf(stderr, "Test 17 SETUP - Build two identical churned heaps of %ld nodes\n", count);
+	heap = t17_build(count, 0, 17);
+	cheap = t17_build(count, 0, 17);
+	fprintf(stderr, "Test 17 COMPACT - Compact one of them\n");
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	t17_moved = 0;
+	if (!pheap_compact(cheap, t17_relocate) || (t17_moved != count))
+		bad++;
+	test_time(TIME_DONE);
+
+	fprintf(stderr, "Test 17 WALK - Walk the churned heap, then the compacted one\n");
+	for(i = 0; i < 2; i++) {
+		test_time(TIME_START);
+		test_time(TIME_SETUP);
+		pheap_foreach(i ? cheap : heap, t17_sum, &sum[i]);
+		twalk[i] = test_time(TIME_DONE);
+	}
+	fprintf(stderr, "Test 17 DRAIN - Drain the churned heap, then the compacted one\n");
+	for(i = 0; i < 2; i++) {
+		test_time(TIME_START);
+		test_time(TIME_SETUP);
+		bad += t17_drain(i ? cheap : heap, count, i ? keys2 : keys);
+		tdrain[i] = test_time(TIME_DONE);
+	}
+	if ((sum[0] != sum[1]) || memcmp(keys, keys2, count * sizeof(void *)))
+		bad++;
+	pheap_destroy(heap, NULL);
+	pheap_destroy(cheap, NULL);
+	heap = cheap = NULL;
+
+	// Handles that change during the run must be kept up to date by t17_relocate()
+	fprintf(stderr, "Test 17 STEPS - Compact a pooled heap 1000 nodes at a time, with churn between\n");
+	heap = t17_build(count, PH_OPT_POOL, 18);
+	test_time(TIME_START);
+	test_time(TIME_SETUP);
+	for(steps = 1; pheap_compact_step(heap, 1000, t17_relocate); steps++) {
+		t17_churn(heap, count);
+		i = random() % count;
+		pheap_change_key(heap, t17_nodes[i], (void *)(random() % INTPTR_MAX));
+	}
+	test_time(TIME_DONE);
+	for(i = 0; i < count; i++)
+		pheap_change_key(heap, t17_nodes[i], (void *)(intptr_t)(count - i));
+	for(i = 0; pheap_delete_min(heap, &keys[0], NULL); i++)
+		bad += ((intptr_t)keys[0] != i + 1);
+	if (i != count)
+		bad++;
+	pheap_destroy(heap, NULL);
+
+	// A bounded heap keeps room for all of its nodes, and has to go on evicting
+	fprintf(stderr, "Test 17 BOUNDED - Compact a half full bounded heap, then overfill it\n");
+	heap = pheap_create_bounded(NULL, count);
+	for(i = 0; i < count / 2; i++)
+		pheap_insert(heap, (void *)(random() % INTPTR_MAX), NULL);
+	if (!pheap_compact(heap, NULL))
+		bad++;
+	for(i = 0; i < count; i++)
+		pheap_insert(heap, (void *)(random() % INTPTR_MAX), NULL);
+	for(i = 0; pheap_delete_min(heap, &keys[i % 2], NULL); i++)
+		bad += (i && ((intptr_t)keys[i % 2] < (intptr_t)keys[(i + 1) % 2]));
+	if (i != count)
+		bad++;
+
+	if (bad)
+		fprintf(stderr, "Test 17 FAILED - %ld bad results\n", bad);
+	else
+		fprintf(stderr, "Test 17 PASSED - Compacted in %ld steps\n", steps);
+	if ((twalk[1] > 0) && (tdrain[1] > 0))
+		fprintf(stderr, "Test 17 compacted heap speedup: walk %.2fx, drain %.2fx\n",
+			twalk[0] / twalk[1], tdrain[0] / tdrain[1]);
+
+t17cleanup:
+	pheap_destroy(heap, NULL);
+	free(keys);
+	free(keys2);
+	free(t17_nodes);
+} // test17
+
+
+// Runs the pairing pass at each SIMD level that the CPU has, on the same keys.  The
+// least key goes in first, so the first delete min pairs up a root list of all of the
+// others.  With many repeats among the keys, the order in which equal keys come out
+// shows up any merge that went differently to the scalar pass
+void
+test18(intptr_t count)
+{
+	static const char *names[] = { "SCALAR", "SSE4.2", "AVX2", "AVX-512" };
+	intptr_t *order[PH_SIMD_AVX512 + 1] = { NULL }, i, bad = 0;
+	double tfirst[PH_SIMD_AVX512 + 1], tdrain[PH_SIMD_AVX512 + 1];
+	void *heap, *key, *data, *last;
+	int level, max;
+
+	fprintf(stderr, "TEST 18 - SIMD PAIRING PASS\n");
+	max = pheap_simd_level(PH_SIMD_AVX512);
+	for(level = PH_SIMD_NONE; level <= max; level++) {
+		if ((order[level] = (intptr_t *)calloc(count, sizeof(intptr_t))) == NULL) {
+			fprintf(stderr, "Test 18 FAILED - Out of memory\n");
+			goto t18cleanup;
+		}
+		pheap_simd_level(level);
+		fprintf(stderr, "Test 18 %s - Bulk insert %ld keys, then delete min and drain\n", names[level], count);
+		test_time(TIME_START);
+		srandom(18);
+		heap = pheap_create_ex(NULL, PH_OPT_POOL);
+		pheap_reserve(heap, count);
+		pheap_insert(heap, (void *)(-count), (void *)0);
+		for(i = 1; i < count; i++)
+			pheap_insert(heap, (void *)((random() % (count / 4 + 1)) - count / 8), (void *)i);
+		test_time(TIME_SETUP);
+		pheap_delete_min(heap, &last, &data);
+		tfirst[level] = test_time(TIME_DONE);
+		order[level][0] = (intptr_t)data;
+
+		test_time(TIME_START);
+		test_time(TIME_SETUP);
+		for(i = 1; pheap_delete_min(heap, &key, &data) && (i < count); last = key, i++) {
+			bad += ((intptr_t)key < (intptr_t)last);
+			order[level][i] = (intptr_t)data;
+		}
+		tdrain[level] = test_time(TIME_DONE);
+		bad += (i != count);
 		pheap_destroy(heap, NULL);
-		heap = NULL;
+		if (level && memcmp(order[level], order[PH_SIMD_NONE], count * sizeof(intptr_t)))
+			bad++;
 	}
-} // test5
+
+	if (bad)
+		fprintf(stderr, "Test 18 FAILED - %ld bad results\n", bad);
+	else
+		fprintf(stderr, "Test 18 PASSED\n");
+	for(level = PH_SIMD_NONE + 1; level <= max; level++)
+		if ((tfirst[level] > 0) && (tdrain[level] > 0))
+			fprintf(stderr, "Test 18 %s speedup over scalar: first delete min %.2fx, drain %.2fx\n",
+				names[level], tfirst[PH_SIMD_NONE] / tfirst[level], tdrain[PH_SIMD_NONE] / tdrain[level]);
+
+t18cleanup:
+	pheap_simd_level(max);
+	for(level = PH_SIMD_NONE; level <= PH_SIMD_AVX512; level++)
+		free(order[level]);
+} // test18
 
 
 int
 main(int argc, char *argv[])
 {
 	intptr_t count;
+	double t4malloc, t4pool, t4tlc;
 	if(argc != 2) {
 		fprintf(stderr, "Usage: %s count\n", argv[0]);
 		return 0;
@@ -447,7 +1948,42 @@ main(int argc, char *argv[])
 	fprintf(stderr, "\n");
 	test3(count);
 	fprintf(stderr, "\n");
-	test4(count);
+	t4malloc = test4(count, 0);
+	fprintf(stderr, "\n");
+	t4pool = test4(count, PH_OPT_POOL);
+	fprintf(stderr, "\n");
+	t4tlc = test4(count, PH_OPT_TLCACHE);
 	fprintf(stderr, "\n");
+	if (t4pool > 0 && t4tlc > 0) {
+		fprintf(stderr, "Test 4 del_min + insert speedup over malloc: POOL %.2fx, TLCACHE %.2fx\n",
+			t4malloc / t4pool, t4malloc / t4tlc);
+		fprintf(stderr, "\n");
+	}
 	test5(count);
+	fprintf(stderr, "\n");
+	test6(count);
+	fprintf(stderr, "\n");
+	test7(count);
+	fprintf(stderr, "\n");
+	test8(count);
+	fprintf(stderr, "\n");
+	test9(count);
+	fprintf(stderr, "\n");
+	test10(count);
+	fprintf(stderr, "\n");
+	test11(count);
+	fprintf(stderr, "\n");
+	test12(count);
+	fprintf(stderr, "\n");
+	test13(count);
+	fprintf(stderr, "\n");
+	test14(count);
+	fprintf(stderr, "\n");
+	test15(count);
+	fprintf(stderr, "\n");
+	test16(count);
+	fprintf(stderr, "\n");
+	test17(count);
+	fprintf(stderr, "\n");
+	test18(count);
 } // main
@@ -0,0 +1,306 @@
+// Stew's paired heap timer service
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<string.h>
+#include	<time.h>
+#include	"phtimer.h"
+
+// Where a timer is waiting
+#define	PHT_IDLE	0
+#define	PHT_BUCKET	1
+#define	PHT_HEAP	2
+
+struct phtimer_wheel {
+	void		*heap;			// Timers beyond the buckets, keyed on expiry
+	struct phtimer	**buckets;		// Ring of near-future bucket lists
+	struct phtimer	*late;			// Timers already due when they were added
+	uint64_t	gran;			// Nanoseconds covered by each bucket
+	uint64_t	tick;			// The bucket tick that the clock is in
+	uint64_t	now;			// Time of the last run
+	size_t		nbucketed;		// Timers in the buckets and late list
+	unsigned	nb;			// Number of buckets
+	int		running;		// Non-zero while firing timers
+};
+
+
+uint64_t
+phtimer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} // phtimer_now
+
+
+// Links the timer onto the front of a bucket list
+static inline void
+phtimer_link(struct phtimer_wheel *tw, struct phtimer **head, struct phtimer *t)
+{
+	if ((t->bnext = *head))
+		t->bnext->bpprev = &t->bnext;
+	t->bpprev = head;
+	*head = t;
+	t->where = PHT_BUCKET;
+	tw->nbucketed++;
+} // phtimer_link
+
+
+// Unlinks the timer from whichever bucket list it is on in O(1) time
+static inline void
+phtimer_unlink(struct phtimer_wheel *tw, struct phtimer *t)
+{
+	if ((*t->bpprev = t->bnext))
+		t->bnext->bpprev = t->bpprev;
+	t->bnext = NULL;
+	t->bpprev = NULL;
+	t->where = PHT_IDLE;
+	tw->nbucketed--;
+} // phtimer_unlink
+
+
+// Puts an idle timer into its bucket if it is due within the ring, or else the heap
+// Timers for the tick being fired, or before the current tick, go onto the late list
+static void
+phtimer_insert(struct phtimer_wheel *tw, struct phtimer *t)
+{
+	uint64_t tk = t->expires / tw->gran;
+
+	if (tw->nb && (tk < tw->tick + tw->nb)) {
+		if ((tk < tw->tick) || (tw->running && (tk == tw->tick)))
+			phtimer_link(tw, &tw->late, t);
+		else
+			phtimer_link(tw, &tw->buckets[tk & (tw->nb - 1)], t);
+		return;
+	}
+	pheap_insert_node(tw->heap, &t->node, (void *)t->expires);
+	t->where = PHT_HEAP;
+} // phtimer_insert
+
+
+void
+phtimer_init(struct phtimer *t, void (*fn)(struct phtimer *t, void *arg), void *arg)
+{
+	memset(t, 0, sizeof(struct phtimer));
+	t->fn = fn;
+	t->arg = arg;
+} // phtimer_init
+
+
+int
+phtimer_pending(struct phtimer *t)
+{
+	return (t->where != PHT_IDLE);
+} // phtimer_pending
+
+
+int
+phtimer_cancel(void *otw, struct phtimer *t)
+{
+	struct phtimer_wheel *tw = (struct phtimer_wheel *)otw;
+
+	switch (t->where) {
+	case PHT_BUCKET:
+		phtimer_unlink(tw, t);
+		return 1;
+	case PHT_HEAP:
+		pheap_delete_node(tw->heap, &t->node);
+		t->where = PHT_IDLE;
+		return 1;
+	}
+	return 0;
+} // phtimer_cancel
+
+
+void
+phtimer_reschedule(void *otw, struct phtimer *t, uint64_t expires)
+{
+	struct phtimer_wheel *tw = (struct phtimer_wheel *)otw;
+
+	// A timer staying in the heap just has its key changed
+	if ((t->where == PHT_HEAP) && (!tw->nb || (expires / tw->gran >= tw->tick + tw->nb))) {
+		t->expires = expires;
+		pheap_change_key_node(tw->heap, &t->node, (void *)expires);
+		return;
+	}
+	phtimer_cancel(tw, t);
+	t->expires = expires;
+	phtimer_insert(tw, t);
+} // phtimer_reschedule
+
+
+void
+phtimer_add(void *otw, struct phtimer *t, uint64_t expires)
+{
+	phtimer_reschedule(otw, t, expires);
+} // phtimer_add
+
+
+// Fires every timer on the list that is due, and puts the rest back
+static size_t
+phtimer_fire_list(struct phtimer_wheel *tw, struct phtimer **head, uint64_t now)
+{
+	struct phtimer *list, *t;
+	size_t fired = 0;
+
+	// Move the list aside, so that timers added by fn() don't join it
+	if ((list = *head) == NULL)
+		return 0;
+	list->bpprev = &list;
+	*head = NULL;
+
+	while ((t = list)) {
+		phtimer_unlink(tw, t);
+		if (t->expires > now) {
+			phtimer_insert(tw, t);
+			continue;
+		}
+		fired++;
+		t->fn(t, t->arg);
+	}
+	return fired;
+} // phtimer_fire_list
+
+
+// Fires every heap timer due by limit
+static size_t
+phtimer_fire_heap(struct phtimer_wheel *tw, uint64_t limit)
+{
+	struct pheap_node *n;
+	struct phtimer *t;
+	void *key;
+	size_t fired = 0;
+
+	while (pheap_get_min_node(tw->heap, &key, NULL) && ((uint64_t)key <= limit)) {
+		n = pheap_delete_min_node(tw->heap);
+		t = pheap_entry(n, struct phtimer, node);
+		t->where = PHT_IDLE;
+		fired++;
+		t->fn(t, t->arg);
+	}
+	return fired;
+} // phtimer_fire_heap
+
+
+size_t
+phtimer_run_at(void *otw, uint64_t now)
+{
+	struct phtimer_wheel *tw = (struct phtimer_wheel *)otw;
+	uint64_t t, target, limit;
+	size_t fired = 0;
+
+	if ((tw == NULL) || tw->running || (now < tw->now))
+		return 0;
+	target = now / tw->gran;
+	tw->running = 1;
+
+	fired += phtimer_fire_list(tw, &tw->late, now);
+
+	// Step through the ticks in order, firing the heap and then the bucket
+	// for each one.  Ticks are skipped once the buckets have nothing in them
+	for (t = tw->tick; ; t++) {
+		if ((tw->nbucketed == 0) && (t < target))
+			t = target;
+		tw->tick = t;
+		limit = (t + 1) * tw->gran - 1;
+		fired += phtimer_fire_heap(tw, (limit < now) ? limit : now);
+		if (tw->nb)
+			fired += phtimer_fire_list(tw, &tw->buckets[t & (tw->nb - 1)], now);
+		if (t >= target)
+			break;
+	}
+
+	tw->now = now;
+	tw->running = 0;
+	return fired;
+} // phtimer_run_at
+
+
+size_t
+phtimer_run(void *otw)
+{
+	return phtimer_run_at(otw, phtimer_now());
+} // phtimer_run
+
+
+// Returns the earliest expiry time of the timers on the list, or UINT64_MAX
+static inline uint64_t
+phtimer_list_min(struct phtimer *t)
+{
+	uint64_t min = UINT64_MAX;
+
+	for (; t; t = t->bnext)
+		if (t->expires < min)
+			min = t->expires;
+	return min;
+} // phtimer_list_min
+
+
+uint64_t
+phtimer_next(void *otw)
+{
+	struct phtimer_wheel *tw = (struct phtimer_wheel *)otw;
+	uint64_t next, t;
+	void *key;
+
+	// The late list holds timers of the current tick that weren't due yet, as
+	// well as overdue ones, so its earliest timer may still be in the future
+	next = phtimer_list_min(tw->late);
+	if (pheap_get_min_node(tw->heap, &key, NULL) && ((uint64_t)key < next))
+		next = (uint64_t)key;
+
+	// Every timer in a bucket expires within that bucket's tick, so only the
+	// first bucket with anything in it needs looking through
+	if (tw->nbucketed) {
+		for (t = tw->tick; t < tw->tick + tw->nb; t++) {
+			if (tw->buckets[t & (tw->nb - 1)]) {
+				if ((t = phtimer_list_min(tw->buckets[t & (tw->nb - 1)])) < next)
+					next = t;
+				break;
+			}
+		}
+	}
+	return ((next < tw->now) ? tw->now : next);
+} // phtimer_next
+
+
+void
+phtimer_destroy(void *otw)
+{
+	struct phtimer_wheel *tw = (struct phtimer_wheel *)otw;
+
+	if (tw == NULL)
+		return;
+	pheap_destroy(tw->heap, NULL);
+	free(tw->buckets);
+	memset(tw, 0, sizeof(struct phtimer_wheel));
+	free(tw);
+} // phtimer_destroy
+
+
+void *
+phtimer_create(uint64_t now, uint64_t granularity, unsigned nbuckets)
+{
+	struct phtimer_wheel *tw;
+	unsigned nb = 0;
+
+	if ((granularity == 0) || (nbuckets > (1U << 30)))
+		return NULL;
+	if (nbuckets)
+		for (nb = 1; nb < nbuckets; nb <<= 1);
+
+	if ((tw = (struct phtimer_wheel *)calloc(sizeof(struct phtimer_wheel), 1)) == NULL)
+		return NULL;
+	tw->heap = pheap_create_ex(NULL, PH_KEY_U64 | PH_OPT_INTRUSIVE);
+	if (nb)
+		tw->buckets = (struct phtimer **)calloc(nb, sizeof(struct phtimer *));
+	if ((tw->heap == NULL) || (nb && (tw->buckets == NULL))) {
+		phtimer_destroy(tw);
+		return NULL;
+	}
+	tw->gran = granularity;
+	tw->nb = nb;
+	tw->now = now;
+	tw->tick = now / granularity;
+	return (void *)tw;
+} // phtimer_create
@@ -0,0 +1,82 @@
+// Stew's paired heap timer service
+//
+// Keeps timers in a paired heap keyed on their expiry times, with a ring of coarse buckets
+// in front of it for the near future.  A timer due within nbuckets * granularity of the
+// current time goes onto the doubly linked list of its bucket, so short timers (such as
+// network timeouts that are nearly always cancelled) never touch the heap, and are added,
+// rescheduled and cancelled in O(1) time.  Timers further out go into the heap, where
+// adding is O(1), and rescheduling and cancelling use pheap_change_key_node() and
+// pheap_delete_node().  Timers are caller owned, and the service never allocates memory
+// after it is created
+//
+// Times are unsigned 64-bit nanosecond counts on any monotonic clock, such as the one
+// returned by phtimer_now().  The service is not thread safe
+
+#ifndef __PHTIMER_H
+#define __PHTIMER_H
+
+#include	<stddef.h>
+#include	<stdint.h>
+#include	"ph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A timer, which the caller may embed in their own structures.  Only expires, fn and arg
+// may be looked at by the caller.  The rest is private to the timer service
+struct phtimer {
+	struct pheap_node	node;		// Heap node while in the heap
+	struct phtimer		*bnext;		// Bucket list links while in a bucket
+	struct phtimer		**bpprev;
+	uint64_t		expires;	// When the timer is due
+	void			(*fn)(struct phtimer *t, void *arg);
+	void			*arg;
+	int			where;		// Idle, in a bucket, or in the heap
+};
+
+// Returns the current time in nanoseconds on CLOCK_MONOTONIC
+uint64_t phtimer_now(void);
+
+// Creates a timer service whose clock currently reads now, with nbuckets near-future
+// buckets of granularity nanoseconds each.  nbuckets is rounded up to a power of 2, and
+// may be 0 to put every timer into the heap.  Returns an opaque handle, or NULL on failure
+void *phtimer_create(uint64_t now, uint64_t granularity, unsigned nbuckets);
+
+// Releases the timer service.  Any timers still pending are left idle, and are not fired
+void phtimer_destroy(void *otw);
+
+// Sets up a timer to call fn(t, arg) when it fires.  Must be called before first use
+void phtimer_init(struct phtimer *t, void (*fn)(struct phtimer *t, void *arg), void *arg);
+
+// Schedules the timer to fire at the time expires, rescheduling it if already pending
+void phtimer_add(void *otw, struct phtimer *t, uint64_t expires);
+
+// Moves a pending timer to fire at the time expires.  Does the same as phtimer_add()
+void phtimer_reschedule(void *otw, struct phtimer *t, uint64_t expires);
+
+// Cancels the timer.  Returns 1 if it was pending, and 0 if it was idle
+int phtimer_cancel(void *otw, struct phtimer *t);
+
+// Returns non-zero if the timer is waiting to fire
+int phtimer_pending(struct phtimer *t);
+
+// Fires every timer that is due at the time now, in order of expiry to within the bucket
+// granularity, and moves the service's clock forward to now.  The timers are idle again
+// by the time that their fn() is called, and fn() may add or cancel any timers.  Timers that
+// fn() adds which are already due are fired by the next call.  Returns the number fired
+size_t phtimer_run_at(void *otw, uint64_t now);
+
+// As for phtimer_run_at(), at the time given by phtimer_now()
+size_t phtimer_run(void *otw);
+
+// Returns the expiry time of the earliest pending timer, or UINT64_MAX if there are none
+// A timer that is already overdue gives the time of the last run.  Looks through the timers
+// of one bucket, so that a caller that sleeps until then always has something to fire
+uint64_t phtimer_next(void *otw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,239 @@
+// Paired Heap Timer Service Test Framework
+//
+// Drives phtimer.c with a network timeout style workload on a simulated clock, where
+// nearly every timer is cancelled before it fires, and compares the timer service with
+// its near-future buckets against the same service with every timer in the heap
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <time.h>
+#include	"phtimer.h"
+
+#define	TM_MS	1000000ULL		// Nanoseconds in a millisecond
+
+struct tm_conn {
+	struct phtimer	timer;
+	intptr_t	slot;			// Index in tm_active[], while pending
+};
+
+static struct tm_conn	**tm_active;	// Connections with a pending timer
+static intptr_t		tm_nactive;
+static uint64_t		tm_clock;	// The simulated clock
+static intptr_t		tm_fired, tm_early;
+
+
+double
+tm_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // tm_now
+
+
+static inline uint64_t
+tm_random(void)
+{
+	static uint64_t x = 88172645463325252ULL;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+} // tm_random
+
+
+// Takes the connection out of the active list
+static inline void
+tm_drop(struct tm_conn *c)
+{
+	tm_active[c->slot] = tm_active[--tm_nactive];
+	tm_active[c->slot]->slot = c->slot;
+	c->slot = -1;
+} // tm_drop
+
+
+static void
+tm_expired(struct phtimer *t, void *arg)
+{
+	struct tm_conn *c = (struct tm_conn *)arg;
+
+	if (t->expires > tm_clock)
+		tm_early++;
+	tm_fired++;
+	tm_drop(c);
+} // tm_expired
+
+
+// Mostly short request timeouts, with some long idle timeouts
+static inline uint64_t
+tm_timeout(void)
+{
+	uint64_t r = tm_random();
+
+	if ((r & 0xff) < 230)
+		return 10 * TM_MS + (r >> 8) % (2000 * TM_MS);
+	return 10000 * TM_MS + (r >> 8) % (110000 * TM_MS);
+} // tm_timeout
+
+
+// Adds count timers, cancelling a random pending timer 90% of the time after each
+// add, and rescheduling one 10% of the time.  The clock moves on 1ms every 64 adds
+// Returns ns per timer operation, or 0 on failure
+double
+test_timers(intptr_t count, unsigned nbuckets)
+{
+	struct tm_conn *conns;
+	void *tw;
+	intptr_t i, ops = 0, cancels = 0, resched = 0;
+	uint64_t r;
+	double start, taken;
+
+	conns = (struct tm_conn *)calloc(count, sizeof(struct tm_conn));
+	tm_active = (struct tm_conn **)calloc(count, sizeof(struct tm_conn *));
+	tw = phtimer_create(0, TM_MS, nbuckets);
+	if ((conns == NULL) || (tm_active == NULL) || (tw == NULL)) {
+		fprintf(stderr, "Test FAILED - Out of memory\n");
+		free(conns);
+		free(tm_active);
+		phtimer_destroy(tw);
+		return 0;
+	}
+	tm_nactive = tm_fired = tm_early = 0;
+	tm_clock = 0;
+
+	start = tm_now();
+	for (i = 0; i < count; i++) {
+		struct tm_conn *c = conns + i;
+
+		phtimer_init(&c->timer, tm_expired, c);
+		c->slot = tm_nactive;
+		tm_active[tm_nactive++] = c;
+		phtimer_add(tw, &c->timer, tm_clock + tm_timeout());
+
+		r = tm_random() % 100;
+		if ((r < 90) && tm_nactive) {
+			c = tm_active[tm_random() % tm_nactive];
+			phtimer_cancel(tw, &c->timer);
+			tm_drop(c);
+			cancels++;
+		} else if (tm_nactive) {
+			c = tm_active[tm_random() % tm_nactive];
+			phtimer_reschedule(tw, &c->timer, tm_clock + tm_timeout());
+			resched++;
+		}
+
+		if ((i & 63) == 63) {
+			tm_clock += TM_MS;
+			phtimer_run_at(tw, tm_clock);
+		}
+	}
+	// Let everything left run out
+	while (tm_nactive) {
+		tm_clock += 1000 * TM_MS;
+		phtimer_run_at(tw, tm_clock);
+	}
+	taken = tm_now() - start;
+	ops = count + cancels + resched + tm_fired;
+
+	if (tm_early || (tm_fired + cancels != count))
+		fprintf(stderr, "Test FAILED - %ld fired early, %ld fired + %ld cancelled of %ld\n",
+			tm_early, tm_fired, cancels, count);
+	else
+		fprintf(stderr, "%8u   %10ld   %10ld   %10ld   %8.3fs   %8.1f\n", nbuckets,
+			cancels, resched, tm_fired, taken, taken * 1000000000.0 / ops);
+
+	phtimer_destroy(tw);
+	free(conns);
+	free(tm_active);
+	tm_active = NULL;
+	return (tm_early ? 0 : taken * 1000000000.0 / ops);
+} // test_timers
+
+
+static intptr_t	tm_woken;		// Timers fired by test_next()
+
+static void
+tm_wake(struct phtimer *t, void *arg)
+{
+	(void)arg;
+	if (t->expires > tm_clock)
+		tm_early++;
+	tm_woken++;
+} // tm_wake
+
+
+// Sleeps until phtimer_next() over and over, as an event loop would, and checks that
+// every wakeup fires at least one timer.  The timers expire part way through their
+// 1ms buckets, and the first run lands in the middle of a bucket as well
+int
+test_next(intptr_t count, unsigned nbuckets)
+{
+	struct phtimer *timers;
+	void *tw;
+	intptr_t i, wakeups = 0, idle = 0;
+	uint64_t next;
+
+	timers = (struct phtimer *)calloc(count, sizeof(struct phtimer));
+	if ((timers == NULL) || ((tw = phtimer_create(0, TM_MS, nbuckets)) == NULL)) {
+		fprintf(stderr, "Test FAILED - Out of memory\n");
+		free(timers);
+		return 0;
+	}
+	tm_woken = tm_early = 0;
+	for (i = 0; i < count; i++) {
+		phtimer_init(&timers[i], tm_wake, NULL);
+		phtimer_add(tw, &timers[i], TM_MS + TM_MS / 2 + tm_random() % (count * TM_MS / 4 + 1));
+	}
+	tm_clock = TM_MS + TM_MS / 5;
+	phtimer_run_at(tw, tm_clock);
+	while ((next = phtimer_next(tw)) != UINT64_MAX) {
+		if ((next < tm_clock) || (idle > count))
+			break;
+		tm_clock = next;
+		wakeups++;
+		idle += (phtimer_run_at(tw, tm_clock) == 0);
+	}
+	phtimer_destroy(tw);
+	free(timers);
+
+	if (idle || tm_early || (tm_woken != count)) {
+		fprintf(stderr, "Test FAILED - %u buckets: %ld of %ld wakeups fired nothing, %ld early, %ld of %ld fired\n",
+			nbuckets, idle, wakeups, tm_early, tm_woken, count);
+		return 0;
+	}
+	fprintf(stderr, "%8u buckets: %ld timers fired in %ld wakeups, none idle\n", nbuckets, count, wakeups);
+	return 1;
+} // test_next
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t count;
+	double heap, wheel;
+
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s count\n", argv[0]);
+		return 0;
+	}
+	count = (intptr_t)atoi(argv[1]);
+	if(count < 1) {
+		fprintf(stderr, "%s: count must be an integer of 1 or greater\n", argv[0]);
+		return 0;
+	}
+
+	fprintf(stderr, "TEST - %ld TIMERS, 90%% CANCELLED, 1ms BUCKETS\n", count);
+	fprintf(stderr, " Buckets      Cancels   Reschedules       Fired       Time    ns/op\n");
+	heap = test_timers(count, 0);
+	test_timers(count, 256);
+	wheel = test_timers(count, 4096);
+	if ((heap > 0) && (wheel > 0))
+		fprintf(stderr, "4096 bucket speedup over heap only: %.2fx\n", heap / wheel);
+
+	fprintf(stderr, "\nTEST - SLEEP UNTIL phtimer_next()\n");
+	test_next(count < 100000 ? count : 100000, 0);
+	test_next(count < 100000 ? count : 100000, 4096);
+} // main
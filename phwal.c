@@ -0,0 +1,801 @@
+// Stew's durable paired heap queue
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"phwal.h"
+
+#define	PHWAL_SNAP_MAGIC	"PHWALS01"
+#define	PHWAL_LOG_MAGIC		"PHWALL01"
+#define	PHWAL_BUF		(64 * 1024)	// Log frame buffer, and snapshot write buffer
+#define	PHWAL_CHUNK		1024		// Entries allocated at a time
+#define	PHWAL_COMPACT_MIN	(4 * 1024 * 1024) // Log size below which it is never compacted
+#define	PHWAL_REC_MAX		31		// Largest record, an op and three varints
+
+// Log record types.  A delete min is logged as a delete of the entry that it removed,
+// so that replay never depends on which of several equal keys the heap gave up
+#define	PHWAL_OP_INSERT		1		// id, key, data
+#define	PHWAL_OP_DELETE		2		// id
+#define	PHWAL_OP_CHANGE		3		// id, key
+
+// The header of both files.  A snapshot holds every change made in log generations
+// before its own, so a log with an older generation than the snapshot is stale
+struct phwal_hdr {
+	char		magic[8];
+	uint64_t	gen;
+	uint64_t	next_id;
+	uint64_t	count;			// Snapshot records that follow
+};
+
+// Snapshot record
+struct phwal_rec {
+	uint64_t	key;
+	uint64_t	id;
+	uint64_t	data;
+};
+
+// Each frame of log records is led by its length and checksum
+struct phwal_frame {
+	uint32_t	len;
+	uint32_t	sum;
+};
+
+struct phwal_ent {
+	struct pheap_node	node;		// Heap node, keyed on the entry's key
+	struct phwal_ent	*hnext;		// ID hash chain, or free list
+	uint64_t		id;
+	uint64_t		data;
+};
+
+struct phwal_chunk {
+	struct phwal_chunk	*next;
+	struct phwal_ent	ents[PHWAL_CHUNK];
+};
+
+struct phwal {
+	void			*heap;		// Entries keyed on their keys
+	struct phwal_ent	**hash;		// Entries by ID
+	size_t			hmask;
+	size_t			count;
+	struct phwal_ent	*free;		// Free entries
+	struct phwal_chunk	*chunks;
+	uint64_t		next_id;
+	uint64_t		gen;		// Generation of the current log
+	int			logfd;
+	int			sync;
+	unsigned		batch;
+	unsigned		nwait;		// Changes since the last commit
+	int			failed;		// Set on a write failure
+	uint8_t			*buf;		// Frame being built, led by its frame header
+	size_t			used;
+	uint64_t		logbytes;	// Size of the log file
+	uint64_t		compact_at;	// Log size that triggers a compaction
+	uint64_t		bytes, syncs, compactions;
+	char			*snap, *log, *tmp, *dir;
+};
+
+
+// 32-bit FNV-1a, to catch frames that were torn by a crash
+static uint32_t
+phwal_sum(const uint8_t *p, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+} // phwal_sum
+
+
+static inline uint8_t *
+phwal_put(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+} // phwal_put
+
+
+// Decodes a varint, returning NULL if it runs past end or is too long
+static inline const uint8_t *
+phwal_get(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	uint64_t r = 0;
+	int shift;
+
+	for (shift = 0; (p < end) && (shift < 64); shift += 7) {
+		r |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*v = r;
+			return p;
+		}
+	}
+	return NULL;
+} // phwal_get
+
+
+static int
+phwal_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+} // phwal_write_all
+
+
+// Syncs the directory, so that a rename into it is durable
+static int
+phwal_sync_dir(struct phwal *w)
+{
+	int fd, ok;
+
+	if ((fd = open(w->dir, O_RDONLY)) < 0)
+		return 0;
+	ok = (fsync(fd) == 0);
+	close(fd);
+	return ok;
+} // phwal_sync_dir
+
+
+//---------------------------------------------------------------------------------
+//				ENTRY TABLE
+//---------------------------------------------------------------------------------
+
+static struct phwal_ent *
+phwal_find(struct phwal *w, uint64_t id)
+{
+	struct phwal_ent *e;
+
+	for (e = w->hash[id & w->hmask]; e && (e->id != id); e = e->hnext);
+	return e;
+} // phwal_find
+
+
+// Doubles the ID hash table
+static int
+phwal_grow(struct phwal *w)
+{
+	struct phwal_ent **hash, *e, *next;
+	size_t i, mask = (w->hmask << 1) | 1;
+
+	if ((hash = (struct phwal_ent **)calloc(mask + 1, sizeof(struct phwal_ent *))) == NULL)
+		return 0;
+	for (i = 0; i <= w->hmask; i++) {
+		for (e = w->hash[i]; e; e = next) {
+			next = e->hnext;
+			e->hnext = hash[e->id & mask];
+			hash[e->id & mask] = e;
+		}
+	}
+	free(w->hash);
+	w->hash = hash;
+	w->hmask = mask;
+	return 1;
+} // phwal_grow
+
+
+// Adds an entry to the table and the heap
+static struct phwal_ent *
+phwal_add(struct phwal *w, uint64_t id, uint64_t key, uint64_t data)
+{
+	struct phwal_chunk *c;
+	struct phwal_ent *e;
+	int i;
+
+	if ((w->count > w->hmask) && !phwal_grow(w))
+		return NULL;
+	if (w->free == NULL) {
+		if ((c = (struct phwal_chunk *)malloc(sizeof(struct phwal_chunk))) == NULL)
+			return NULL;
+		c->next = w->chunks;
+		w->chunks = c;
+		for (i = PHWAL_CHUNK - 1; i >= 0; i--) {
+			c->ents[i].hnext = w->free;
+			w->free = &c->ents[i];
+		}
+	}
+	e = w->free;
+	w->free = e->hnext;
+
+	e->id = id;
+	e->data = data;
+	e->hnext = w->hash[id & w->hmask];
+	w->hash[id & w->hmask] = e;
+	pheap_insert_node(w->heap, &e->node, (void *)key);
+	w->count++;
+	if (id >= w->next_id)
+		w->next_id = id + 1;
+	return e;
+} // phwal_add
+
+
+// Takes an entry out of the table and the heap, if it isn't already out of the heap
+static void
+phwal_remove(struct phwal *w, struct phwal_ent *e, int inheap)
+{
+	struct phwal_ent **pe;
+
+	for (pe = &w->hash[e->id & w->hmask]; *pe != e; pe = &(*pe)->hnext);
+	*pe = e->hnext;
+	if (inheap)
+		pheap_delete_node(w->heap, &e->node);
+	e->hnext = w->free;
+	w->free = e;
+	w->count--;
+} // phwal_remove
+
+
+//---------------------------------------------------------------------------------
+//				LOG AND SNAPSHOT FILES
+//---------------------------------------------------------------------------------
+
+// Writes the frame being built to the log, without syncing it
+static int
+phwal_write(struct phwal *w)
+{
+	struct phwal_frame *f = (struct phwal_frame *)w->buf;
+
+	if (w->used == sizeof(struct phwal_frame))
+		return 1;
+	f->len = w->used - sizeof(struct phwal_frame);
+	f->sum = phwal_sum(w->buf + sizeof(struct phwal_frame), f->len);
+	if (!phwal_write_all(w->logfd, w->buf, w->used)) {
+		w->failed = 1;
+		return 0;
+	}
+	w->logbytes += w->used;
+	w->bytes += w->used;
+	w->used = sizeof(struct phwal_frame);
+	return 1;
+} // phwal_write
+
+
+// Creates a file holding just hdr through a temporary file and a rename, so that it appears
+// whole or not at all.  Returns the file's descriptor, at the end of the file, or -1 on failure
+static int
+phwal_create(struct phwal *w, const char *path, struct phwal_hdr *hdr)
+{
+	int fd;
+
+	if ((fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	if (!phwal_write_all(fd, hdr, sizeof(struct phwal_hdr)) ||
+	    (fsync(fd) != 0) || (rename(w->tmp, path) != 0) || !phwal_sync_dir(w)) {
+		close(fd);
+		unlink(w->tmp);
+		return -1;
+	}
+	return fd;
+} // phwal_create
+
+
+// Starts an empty log of the given generation in place of the current one
+static int
+phwal_new_log(struct phwal *w, uint64_t gen)
+{
+	struct phwal_hdr hdr;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PHWAL_LOG_MAGIC, sizeof(hdr.magic));
+	hdr.gen = gen;
+	if ((fd = phwal_create(w, w->log, &hdr)) < 0)
+		return 0;
+	if (w->logfd >= 0)
+		close(w->logfd);
+	w->logfd = fd;
+	w->gen = gen;
+	w->logbytes = sizeof(struct phwal_hdr);
+	w->used = sizeof(struct phwal_frame);
+	return 1;
+} // phwal_new_log
+
+
+// Writes every entry out to a new snapshot that holds this log generation, and then
+// moves on to an empty log of the next generation.  Changes still waiting in the frame
+// buffer are in the snapshot, and so are dropped
+int
+phwal_compact(void *ow)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct phwal_rec *recs = (struct phwal_rec *)w->buf;
+	size_t i, n = 0, max = PHWAL_BUF / sizeof(struct phwal_rec);
+	struct phwal_hdr hdr;
+	struct phwal_ent *e;
+	int fd, ok;
+
+	if ((w == NULL) || w->failed)
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PHWAL_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.gen = w->gen + 1;
+	hdr.next_id = w->next_id;
+	hdr.count = w->count;
+	if ((fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return 0;
+	ok = phwal_write_all(fd, &hdr, sizeof(hdr));
+	for (i = 0; ok && (i <= w->hmask); i++) {
+		for (e = w->hash[i]; ok && e; e = e->hnext) {
+			recs[n].key = (uint64_t)pheap_get_key(&e->node);
+			recs[n].id = e->id;
+			recs[n].data = e->data;
+			if (++n == max) {
+				ok = phwal_write_all(fd, recs, n * sizeof(struct phwal_rec));
+				n = 0;
+			}
+		}
+	}
+	w->used = sizeof(struct phwal_frame);
+	if (!ok || !phwal_write_all(fd, recs, n * sizeof(struct phwal_rec)) || (fsync(fd) != 0) ||
+	    (rename(w->tmp, w->snap) != 0) || !phwal_sync_dir(w)) {
+		close(fd);
+		unlink(w->tmp);
+		w->failed = 1;
+		return 0;
+	}
+	close(fd);
+	w->syncs += 2;
+	w->bytes += sizeof(hdr) + w->count * sizeof(struct phwal_rec);
+
+	// A crash from here on leaves the old log, which is now stale, and is dropped on open
+	if (!phwal_new_log(w, hdr.gen)) {
+		w->failed = 1;
+		return 0;
+	}
+	w->syncs += 2;
+	w->nwait = 0;
+	w->compactions++;
+	w->compact_at = 2 * (sizeof(hdr) + w->count * sizeof(struct phwal_rec));
+	if (w->compact_at < PHWAL_COMPACT_MIN)
+		w->compact_at = PHWAL_COMPACT_MIN;
+	return 1;
+} // phwal_compact
+
+
+int
+phwal_commit(void *ow)
+{
+	struct phwal *w = (struct phwal *)ow;
+
+	if ((w == NULL) || w->failed || !phwal_write(w))
+		return 0;
+	if (w->nwait == 0)
+		return 1;
+	w->nwait = 0;
+	if (w->sync == PHWAL_SYNC_NONE)
+		return 1;
+	if (fdatasync(w->logfd) != 0) {
+		w->failed = 1;
+		return 0;
+	}
+	w->syncs++;
+	return 1;
+} // phwal_commit
+
+
+// Starts a record in the frame buffer, writing the frame out first if it is full
+static uint8_t *
+phwal_record(struct phwal *w, int op)
+{
+	uint8_t *p;
+
+	if ((w->used + PHWAL_REC_MAX > PHWAL_BUF) && !phwal_write(w))
+		return NULL;
+	p = w->buf + w->used;
+	*p++ = op;
+	return p;
+} // phwal_record
+
+
+// Finishes a record, and commits it as the sync policy says.  The change has already
+// been made by then, so this returns 1, or PHWAL_ENOSYNC if the log failed before the
+// record was safely out.  A compaction that fails after the record was committed leaves
+// the change on disk, and is only seen by the calls that follow
+static int
+phwal_logged(struct phwal *w, uint8_t *end)
+{
+	int committed = 0;
+
+	w->used = end - w->buf;
+	w->nwait++;
+	if ((w->sync == PHWAL_SYNC_EACH) || ((w->sync == PHWAL_SYNC_GROUP) && (w->nwait >= w->batch))) {
+		if (!phwal_commit(w))
+			return PHWAL_ENOSYNC;
+		committed = 1;
+	}
+	if ((w->logbytes + w->used > w->compact_at) && !phwal_compact(w) && w->failed && !committed)
+		return PHWAL_ENOSYNC;
+	return 1;
+} // phwal_logged
+
+
+// Loads the snapshot, if there is one
+static int
+phwal_load_snap(struct phwal *w)
+{
+	struct phwal_hdr hdr;
+	struct phwal_rec *recs = (struct phwal_rec *)w->buf;
+	size_t max = PHWAL_BUF / sizeof(struct phwal_rec);
+	uint64_t left, n, i;
+	ssize_t got;
+	int fd, ok = 1;
+
+	if ((fd = open(w->snap, O_RDONLY)) < 0)
+		return (errno == ENOENT);
+	if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	    memcmp(hdr.magic, PHWAL_SNAP_MAGIC, sizeof(hdr.magic))) {
+		close(fd);
+		return 0;
+	}
+	for (left = hdr.count; ok && left; left -= n) {
+		n = (left < max) ? left : max;
+		got = read(fd, recs, n * sizeof(struct phwal_rec));
+		if ((got < 0) || ((size_t)got != n * sizeof(struct phwal_rec))) {
+			ok = 0;
+			break;
+		}
+		for (i = 0; ok && (i < n); i++)
+			ok = (phwal_find(w, recs[i].id) == NULL) &&
+			     (phwal_add(w, recs[i].id, recs[i].key, recs[i].data) != NULL);
+	}
+	close(fd);
+	w->gen = hdr.gen;
+	if (hdr.next_id > w->next_id)
+		w->next_id = hdr.next_id;
+	return ok;
+} // phwal_load_snap
+
+
+// Applies the records in one frame.  Returns 0 if any of them make no sense
+static int
+phwal_replay_frame(struct phwal *w, const uint8_t *p, const uint8_t *end)
+{
+	uint64_t id, key, data;
+	struct phwal_ent *e;
+	int op;
+
+	while (p < end) {
+		op = *p++;
+		if ((p = phwal_get(p, end, &id)) == NULL)
+			return 0;
+		switch (op) {
+		case PHWAL_OP_INSERT:
+			if (((p = phwal_get(p, end, &key)) == NULL) || ((p = phwal_get(p, end, &data)) == NULL))
+				return 0;
+			if (phwal_find(w, id) || (phwal_add(w, id, key, data) == NULL))
+				return 0;
+			break;
+		case PHWAL_OP_DELETE:
+			if ((e = phwal_find(w, id)) == NULL)
+				return 0;
+			phwal_remove(w, e, 1);
+			break;
+		case PHWAL_OP_CHANGE:
+			if (((p = phwal_get(p, end, &key)) == NULL) || ((e = phwal_find(w, id)) == NULL))
+				return 0;
+			pheap_change_key_node(w->heap, &e->node, (void *)key);
+			break;
+		default:
+			return 0;
+		}
+	}
+	return 1;
+} // phwal_replay_frame
+
+
+// Replays the log over the snapshot, and cuts off any torn frames at its end.  A missing
+// or stale log is replaced with an empty one
+static int
+phwal_replay(struct phwal *w)
+{
+	struct phwal_frame f;
+	struct phwal_hdr *hdr;
+	struct stat st;
+	uint8_t *map, *p;
+	size_t off;
+	int fd, stale;
+
+	if ((fd = open(w->log, O_RDWR | O_APPEND)) < 0)
+		return (errno == ENOENT) && phwal_new_log(w, w->gen);
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct phwal_hdr))) {
+		close(fd);
+		return phwal_new_log(w, w->gen);
+	}
+	if ((map = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	hdr = (struct phwal_hdr *)map;
+	if (memcmp(hdr->magic, PHWAL_LOG_MAGIC, sizeof(hdr->magic)) || (hdr->gen != w->gen)) {
+		stale = !memcmp(hdr->magic, PHWAL_LOG_MAGIC, sizeof(hdr->magic)) && (hdr->gen < w->gen);
+		munmap(map, st.st_size);
+		close(fd);
+		return stale && phwal_new_log(w, w->gen);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	// Frames are packed end to end, so their headers are copied out to read them
+	for (off = sizeof(struct phwal_hdr); off + sizeof(struct phwal_frame) <= (size_t)st.st_size; ) {
+		memcpy(&f, map + off, sizeof(f));
+		p = map + off + sizeof(f);
+		if ((f.len > (size_t)st.st_size - off - sizeof(f)) || (phwal_sum(p, f.len) != f.sum))
+			break;
+		if (!phwal_replay_frame(w, p, p + f.len)) {
+			munmap(map, st.st_size);
+			close(fd);
+			return 0;
+		}
+		off += sizeof(f) + f.len;
+	}
+	munmap(map, st.st_size);
+
+	if ((off < (size_t)st.st_size) && ((ftruncate(fd, off) != 0) || (fsync(fd) != 0))) {
+		close(fd);
+		return 0;
+	}
+	w->logfd = fd;
+	w->logbytes = off;
+	return 1;
+} // phwal_replay
+
+
+//---------------------------------------------------------------------------------
+//				QUEUE OPERATIONS
+//---------------------------------------------------------------------------------
+
+uint64_t
+phwal_insert(void *ow, uint64_t key, uint64_t data)
+{
+	struct phwal *w = (struct phwal *)ow;
+	uint64_t id;
+	uint8_t *p;
+
+	if ((w == NULL) || w->failed || ((p = phwal_record(w, PHWAL_OP_INSERT)) == NULL))
+		return 0;
+	id = w->next_id;
+	if (phwal_add(w, id, key, data) == NULL)
+		return 0;
+	p = phwal_put(p, id);
+	p = phwal_put(p, key);
+	p = phwal_put(p, data);
+
+	// The entry is in the queue now, so its ID is returned even if the log
+	// fails, and phwal_failed() is left to say so
+	phwal_logged(w, p);
+	return id;
+} // phwal_insert
+
+
+int
+phwal_delete(void *ow, uint64_t id)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct phwal_ent *e;
+	uint8_t *p;
+
+	if ((w == NULL) || w->failed)
+		return PHWAL_EIO;
+	if ((e = phwal_find(w, id)) == NULL)
+		return 0;
+	if ((p = phwal_record(w, PHWAL_OP_DELETE)) == NULL)
+		return PHWAL_EIO;
+	phwal_remove(w, e, 1);
+	return phwal_logged(w, phwal_put(p, id));
+} // phwal_delete
+
+
+int
+phwal_delete_min(void *ow, uint64_t *key, uint64_t *data, uint64_t *id)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct pheap_node *n;
+	struct phwal_ent *e;
+	uint8_t *p;
+
+	if ((w == NULL) || w->failed)
+		return PHWAL_EIO;
+	if (w->count == 0)
+		return 0;
+	if ((p = phwal_record(w, PHWAL_OP_DELETE)) == NULL)
+		return PHWAL_EIO;
+	n = pheap_delete_min_node(w->heap);
+	e = pheap_entry(n, struct phwal_ent, node);
+	if (key)
+		*key = (uint64_t)pheap_get_key(n);
+	if (data)
+		*data = e->data;
+	if (id)
+		*id = e->id;
+	p = phwal_put(p, e->id);
+	phwal_remove(w, e, 0);
+	return phwal_logged(w, p);
+} // phwal_delete_min
+
+
+int
+phwal_change_key(void *ow, uint64_t id, uint64_t newkey)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct phwal_ent *e;
+	uint8_t *p;
+
+	if ((w == NULL) || w->failed)
+		return PHWAL_EIO;
+	if ((e = phwal_find(w, id)) == NULL)
+		return 0;
+	if ((p = phwal_record(w, PHWAL_OP_CHANGE)) == NULL)
+		return PHWAL_EIO;
+	pheap_change_key_node(w->heap, &e->node, (void *)newkey);
+	p = phwal_put(p, id);
+	return phwal_logged(w, phwal_put(p, newkey));
+} // phwal_change_key
+
+
+int
+phwal_get_min(void *ow, uint64_t *key, uint64_t *data, uint64_t *id)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct phwal_ent *e;
+	void *n, *k;
+
+	if ((w == NULL) || ((n = pheap_get_min_node(w->heap, &k, NULL)) == NULL))
+		return 0;
+	e = pheap_entry(n, struct phwal_ent, node);
+	if (key)
+		*key = (uint64_t)k;
+	if (data)
+		*data = e->data;
+	if (id)
+		*id = e->id;
+	return 1;
+} // phwal_get_min
+
+
+int
+phwal_lookup(void *ow, uint64_t id, uint64_t *key, uint64_t *data)
+{
+	struct phwal *w = (struct phwal *)ow;
+	struct phwal_ent *e;
+
+	if ((w == NULL) || ((e = phwal_find(w, id)) == NULL))
+		return 0;
+	if (key)
+		*key = (uint64_t)pheap_get_key(&e->node);
+	if (data)
+		*data = e->data;
+	return 1;
+} // phwal_lookup
+
+
+size_t
+phwal_count(void *ow)
+{
+	struct phwal *w = (struct phwal *)ow;
+
+	return w ? w->count : 0;
+} // phwal_count
+
+
+int
+phwal_failed(void *ow)
+{
+	struct phwal *w = (struct phwal *)ow;
+
+	return w ? w->failed : 1;
+} // phwal_failed
+
+
+void
+phwal_io_stats(void *ow, uint64_t *bytes, uint64_t *syncs, uint64_t *compactions)
+{
+	struct phwal *w = (struct phwal *)ow;
+
+	if (bytes)
+		*bytes = w ? w->bytes : 0;
+	if (syncs)
+		*syncs = w ? w->syncs : 0;
+	if (compactions)
+		*compactions = w ? w->compactions : 0;
+} // phwal_io_stats
+
+
+// Frees the queue's memory without touching its files
+static void
+phwal_free(struct phwal *w)
+{
+	struct phwal_chunk *c;
+
+	if (w->logfd >= 0)
+		close(w->logfd);
+	pheap_destroy(w->heap, NULL);
+	while ((c = w->chunks)) {
+		w->chunks = c->next;
+		free(c);
+	}
+	free(w->hash);
+	free(w->buf);
+	free(w->snap);
+	memset(w, 0, sizeof(struct phwal));
+	free(w);
+} // phwal_free
+
+
+void
+phwal_close(void *ow)
+{
+	struct phwal *w = (struct phwal *)ow;
+
+	if (w == NULL)
+		return;
+	if (!w->failed && phwal_write(w) && (w->logbytes > sizeof(struct phwal_hdr)))
+		fdatasync(w->logfd);
+	phwal_free(w);
+} // phwal_close
+
+
+void *
+phwal_open(const char *path, int sync, unsigned batch)
+{
+	struct phwal *w;
+	size_t len;
+	char *slash;
+
+	if ((path == NULL) || (sync < PHWAL_SYNC_EACH) || (sync > PHWAL_SYNC_NONE))
+		return NULL;
+	if ((w = (struct phwal *)calloc(sizeof(struct phwal), 1)) == NULL)
+		return NULL;
+	w->logfd = -1;
+	w->sync = sync;
+	w->batch = batch ? batch : 1;
+	w->next_id = 1;
+	w->hmask = 1023;
+	w->compact_at = PHWAL_COMPACT_MIN;
+	w->used = sizeof(struct phwal_frame);
+
+	// The four paths share one allocation, headed by the snapshot path
+	len = strlen(path) + 16;
+	if ((w->snap = (char *)malloc(len * 4)) != NULL) {
+		w->log = w->snap + len;
+		w->tmp = w->log + len;
+		w->dir = w->tmp + len;
+		strcat(strcpy(w->snap, path), ".snap");
+		strcat(strcpy(w->log, path), ".log");
+		strcat(strcpy(w->tmp, path), ".tmp");
+		strcpy(w->dir, path);
+		if ((slash = strrchr(w->dir, '/')) != NULL)
+			slash[1] = '\0';
+		else
+			strcpy(w->dir, ".");
+	}
+	w->heap = pheap_create_ex(NULL, PH_KEY_U64 | PH_OPT_INTRUSIVE);
+	w->hash = (struct phwal_ent **)calloc(w->hmask + 1, sizeof(struct phwal_ent *));
+	w->buf = (uint8_t *)malloc(PHWAL_BUF);
+	if ((w->snap == NULL) || (w->heap == NULL) || (w->hash == NULL) || (w->buf == NULL) ||
+	    !phwal_load_snap(w) || !phwal_replay(w)) {
+		phwal_free(w);
+		return NULL;
+	}
+	w->compact_at = 2 * (sizeof(struct phwal_hdr) + w->count * sizeof(struct phwal_rec));
+	if (w->compact_at < PHWAL_COMPACT_MIN)
+		w->compact_at = PHWAL_COMPACT_MIN;
+	return (void *)w;
+} // phwal_open
@@ -0,0 +1,108 @@
+// Stew's durable paired heap queue
+//
+// Keeps a priority queue of 64-bit keys, each with a 64-bit data value, in a paired heap
+// and makes every change to it durable by appending a compact record to a write-ahead log
+// file.  Each entry is given a stable 64-bit ID when it is inserted, which stays the same
+// across restarts, and which is used to delete it or change its key later on
+//
+// Records are gathered into frames, each with its length and a checksum, and frames are
+// written and synced to disk according to the queue's sync policy, so that many records
+// can share a single fsync (group commit).  On opening, the last snapshot is loaded and
+// the log is replayed over it.  A frame that was only partly written when the system went
+// down fails its checksum, and it and anything after it are dropped.  Once the log grows
+// well past the size of the queue itself it is compacted, by writing the queue out as a
+// new snapshot and starting the log afresh
+//
+// A queue at path uses the files path.snap and path.log.  The queue is not thread safe
+
+#ifndef __PHWAL_H
+#define __PHWAL_H
+
+#include	<stddef.h>
+#include	<stdint.h>
+#include	"ph.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sync policies
+//
+// PHWAL_SYNC_EACH  - Every change is written and synced before the call returns
+// PHWAL_SYNC_GROUP - Changes are written and synced together once batch of them are
+//                    waiting, or when phwal_commit() is called.  A change is durable
+//                    once the commit that it went out in has returned
+// PHWAL_SYNC_NONE  - Changes are written when the log buffer fills or on phwal_commit(),
+//                    and are left to the operating system to sync.  Only compaction and
+//                    phwal_close() sync the files
+#define	PHWAL_SYNC_EACH		0
+#define	PHWAL_SYNC_GROUP	1
+#define	PHWAL_SYNC_NONE		2
+
+// Results of a change once the log has failed to write or sync.  After either of them the
+// queue refuses every change, and phwal_failed() returns non-zero
+//
+// PHWAL_EIO     - The log had already failed, or failed before the record was made, so
+//                 nothing was changed
+// PHWAL_ENOSYNC - The change was made, and anything it passes back was filled in, but the
+//                 log failed in writing it out, so it may not be there after a restart
+#define	PHWAL_EIO		(-1)
+#define	PHWAL_ENOSYNC		(-2)
+
+// Opens the queue at path, creating it if it doesn't exist, and replays its snapshot and
+// log.  batch is the number of changes per group commit for PHWAL_SYNC_GROUP, and is
+// otherwise ignored.  Returns an opaque handle, or NULL on failure
+void *phwal_open(const char *path, int sync, unsigned batch);
+
+// Commits any waiting changes, and closes the queue
+void phwal_close(void *ow);
+
+// Inserts key with its data.  Returns the entry's ID, or 0 if the entry wasn't added.  Once
+// added the entry is in the queue, so its ID is returned even if the log then fails to
+// write it out, and phwal_failed() must be checked to tell if that happened
+uint64_t phwal_insert(void *ow, uint64_t key, uint64_t data);
+
+// Deletes the entry with the given ID.  Returns 1 on success, 0 if there is no such entry,
+// or PHWAL_EIO or PHWAL_ENOSYNC if the log failed
+int phwal_delete(void *ow, uint64_t id);
+
+// Deletes the entry with the least key, passing back its key, data and ID, any of which may
+// be NULL.  Returns 1 on success, 0 if the queue is empty, or PHWAL_EIO or PHWAL_ENOSYNC if
+// the log failed.  With PHWAL_ENOSYNC the entry has been taken out and passed back
+int phwal_delete_min(void *ow, uint64_t *key, uint64_t *data, uint64_t *id);
+
+// Changes the key of the entry with the given ID.  Returns 1 on success, 0 if there is no
+// such entry, or PHWAL_EIO or PHWAL_ENOSYNC if the log failed
+int phwal_change_key(void *ow, uint64_t id, uint64_t newkey);
+
+// Passes back the key, data and ID of the entry with the least key without removing it
+// Returns 1 on success, and 0 if the queue is empty
+int phwal_get_min(void *ow, uint64_t *key, uint64_t *data, uint64_t *id);
+
+// Passes back the key and data of the entry with the given ID.  Returns 1 on success, and 0
+// if there is no such entry
+int phwal_lookup(void *ow, uint64_t id, uint64_t *key, uint64_t *data);
+
+// Returns the number of entries in the queue
+size_t phwal_count(void *ow);
+
+// Returns non-zero once the log has failed to write or sync, after which the queue refuses
+// every change.  What had been committed before then is still on disk
+int phwal_failed(void *ow);
+
+// Writes out and syncs every waiting change.  Returns 1 on success, and 0 on a write failure
+int phwal_commit(void *ow);
+
+// Writes the queue out as a new snapshot and starts an empty log.  This is done by itself
+// when the log outgrows the queue.  Returns 1 on success, and 0 on a write failure
+int phwal_compact(void *ow);
+
+// Passes back counts of the log bytes written, fsync() calls made, and compactions done
+// since the queue was opened, any of which may be NULL
+void phwal_io_stats(void *ow, uint64_t *bytes, uint64_t *syncs, uint64_t *compactions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,394 @@
+// Paired Heap Durable Queue Test Framework
+//
+// Checks that phwal.c brings a queue back whole after it is closed, after its log has a
+// torn frame at its end, and after compaction, that a change the log fails to write is
+// reported as such and not as empty or refused, and then measures the throughput of a
+// hold model workload on the queue under each sync policy, along with how long the
+// queue takes to replay on opening
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <string.h>
+#include        <fcntl.h>
+#include        <unistd.h>
+#include        <time.h>
+#include	<signal.h>
+#include	<sys/stat.h>
+#include	<sys/resource.h>
+#include	"phwal.h"
+
+static char	wl_path[4096];
+static uint64_t	*wl_ids;		// IDs of the live entries, by slot
+static uint64_t	*wl_keys;		// Their keys
+static uint64_t	*wl_data;		// And data
+static intptr_t	wl_nlive;
+static intptr_t	*wl_slot;		// Slot of each live entry, by ID
+static uint64_t	wl_nslot;
+static intptr_t	wl_changes;		// Changes made by wl_hold()
+
+
+double
+wl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // wl_now
+
+
+static inline uint64_t
+wl_random(void)
+{
+	static uint64_t x = 88172645463325252ULL;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+} // wl_random
+
+
+static void
+wl_unlink(void)
+{
+	char name[4200];
+
+	snprintf(name, sizeof(name), "%s.snap", wl_path);
+	unlink(name);
+	snprintf(name, sizeof(name), "%s.log", wl_path);
+	unlink(name);
+} // wl_unlink
+
+
+// Inserts key with some data, keeping the live entry arrays in step
+static int
+wl_insert(void *q, uint64_t key, uint64_t data)
+{
+	uint64_t id;
+	intptr_t *slot;
+
+	if ((id = phwal_insert(q, key, data)) == 0)
+		return 0;
+	if (id >= wl_nslot) {
+		if ((slot = (intptr_t *)realloc(wl_slot, 2 * id * sizeof(intptr_t))) == NULL)
+			return 0;
+		wl_slot = slot;
+		wl_nslot = 2 * id;
+	}
+	wl_slot[id] = wl_nlive;
+	wl_ids[wl_nlive] = id;
+	wl_keys[wl_nlive] = key;
+	wl_data[wl_nlive++] = data;
+	return 1;
+} // wl_insert
+
+
+// Drops the entry in the given slot from the live arrays
+static void
+wl_drop(intptr_t slot)
+{
+	wl_ids[slot] = wl_ids[--wl_nlive];
+	wl_keys[slot] = wl_keys[wl_nlive];
+	wl_data[slot] = wl_data[wl_nlive];
+	wl_slot[wl_ids[slot]] = slot;
+} // wl_drop
+
+
+// Fills the queue with size entries, and then runs ops rounds of the hold model, each a
+// delete min and an insert, with every fourth round also changing a random entry's key,
+// and every sixteenth deleting a random entry and putting another in its place
+static int
+wl_hold(void *q, intptr_t size, intptr_t ops)
+{
+	uint64_t key, data, id;
+	intptr_t i, slot;
+
+	for (i = 0; i < size; i++)
+		if (!wl_insert(q, wl_random() >> 24, wl_random()))
+			return 0;
+	wl_changes += size + ops * 2 + (ops + 3) / 4 + 2 * ((ops + 15) / 16);
+	for (i = 0; i < ops; i++) {
+		if ((phwal_delete_min(q, &key, &data, &id) != 1) || (wl_keys[wl_slot[id]] != key) || (wl_data[wl_slot[id]] != data))
+			return 0;
+		wl_drop(wl_slot[id]);
+		if (!wl_insert(q, key + (wl_random() >> 40), wl_random()))
+			return 0;
+		if ((i & 3) == 0) {
+			slot = wl_random() % wl_nlive;
+			wl_keys[slot] = wl_random() >> 24;
+			if (phwal_change_key(q, wl_ids[slot], wl_keys[slot]) != 1)
+				return 0;
+		}
+		if ((i & 15) == 0) {
+			slot = wl_random() % wl_nlive;
+			if (phwal_delete(q, wl_ids[slot]) != 1)
+				return 0;
+			wl_drop(slot);
+			if (!wl_insert(q, wl_random() >> 24, wl_random()))
+				return 0;
+		}
+	}
+	return phwal_commit(q);
+} // wl_hold
+
+
+// Reopens the queue and checks that it holds exactly the live entries
+static int
+wl_verify(char *what, int sync)
+{
+	uint64_t key, data, last = 0;
+	intptr_t i, n;
+	double t;
+	void *q;
+
+	t = wl_now();
+	if ((q = phwal_open(wl_path, sync, 1)) == NULL) {
+		printf("%s FAILED - Unable to reopen the queue\n", what);
+		return 0;
+	}
+	t = wl_now() - t;
+	if ((intptr_t)phwal_count(q) != wl_nlive) {
+		printf("%s FAILED - %ld entries replayed, expected %ld\n", what, (long)phwal_count(q), (long)wl_nlive);
+		phwal_close(q);
+		return 0;
+	}
+	for (i = 0; i < wl_nlive; i++) {
+		if (!phwal_lookup(q, wl_ids[i], &key, &data) || (key != wl_keys[i]) || (data != wl_data[i])) {
+			printf("%s FAILED - Entry %lu is wrong or missing\n", what, (unsigned long)wl_ids[i]);
+			phwal_close(q);
+			return 0;
+		}
+	}
+	phwal_close(q);
+
+	// Drain it to check the order
+	q = phwal_open(wl_path, PHWAL_SYNC_NONE, 1);
+	for (n = 0; (phwal_delete_min(q, &key, NULL, NULL) == 1) && (key >= last); n++)
+		last = key;
+	phwal_close(q);
+	if (n != wl_nlive) {
+		printf("%s FAILED - Drain out of order\n", what);
+		return 0;
+	}
+	printf("%s PASSED - %ld entries replayed in %.3fms\n", what, (long)wl_nlive, t * 1000.0);
+	return 1;
+} // wl_verify
+
+
+// wl_verify() drains the queue, so its entries are put back from the live arrays
+static int
+wl_refill(void)
+{
+	intptr_t i, n = wl_nlive;
+	void *q;
+
+	wl_unlink();
+	if ((q = phwal_open(wl_path, PHWAL_SYNC_NONE, 1)) == NULL)
+		return 0;
+	for (wl_nlive = 0, i = 0; i < n; i++)
+		wl_insert(q, wl_keys[i], wl_data[i]);
+	phwal_close(q);
+	return 1;
+} // wl_refill
+
+
+// Caps the size of files this process may write at the log's present size, so that the
+// next write to the log fails, or lifts the cap again if on is zero
+static int
+wl_cap_log(int on)
+{
+	static struct rlimit old;
+	struct rlimit lim;
+	struct stat st;
+	char name[4200];
+
+	if (!on)
+		return (setrlimit(RLIMIT_FSIZE, &old) == 0);
+	snprintf(name, sizeof(name), "%s.log", wl_path);
+	if ((stat(name, &st) != 0) || (getrlimit(RLIMIT_FSIZE, &old) != 0))
+		return 0;
+	signal(SIGXFSZ, SIG_IGN);
+	lim = old;
+	lim.rlim_cur = st.st_size;
+	return (setrlimit(RLIMIT_FSIZE, &lim) == 0);
+} // wl_cap_log
+
+
+// Makes the log fail under a delete min, and then under an insert.  The delete min must
+// say that it took the entry out, and the insert must give back the ID of the entry that
+// it added, and then every later change must be refused.  Neither change reached the log,
+// so reopening finds the queue as it was
+static int
+wl_fail(void)
+{
+	uint64_t key, id, i, n = 100;
+	int r, bad = 0, pass;
+	void *q;
+
+	wl_unlink();
+	if ((q = phwal_open(wl_path, PHWAL_SYNC_EACH, 1)) == NULL)
+		return 0;
+	for (i = 0; i < n; i++)
+		bad += (phwal_insert(q, 1000 + i, i) == 0);
+	phwal_close(q);
+
+	for (pass = 0; pass < 2; pass++) {
+		if ((q = phwal_open(wl_path, PHWAL_SYNC_EACH, 1)) == NULL)
+			return 0;
+		bad += (phwal_count(q) != n);
+		if (!wl_cap_log(1)) {
+			phwal_close(q);
+			return 0;
+		}
+		if (pass == 0) {
+			key = 0;
+			r = phwal_delete_min(q, &key, NULL, NULL);
+			bad += (r != PHWAL_ENOSYNC) || (key != 1000) || (phwal_count(q) != n - 1);
+			bad += (phwal_insert(q, 1, 1) != 0);
+		} else {
+			id = phwal_insert(q, 1, 1);
+			bad += (id == 0) || !phwal_lookup(q, id, &key, NULL) || (key != 1);
+			bad += (phwal_delete_min(q, &key, NULL, NULL) != PHWAL_EIO);
+		}
+		bad += !phwal_failed(q);
+		bad += (phwal_change_key(q, 1, 5) != PHWAL_EIO);
+		wl_cap_log(0);
+		phwal_close(q);
+	}
+
+	if ((q = phwal_open(wl_path, PHWAL_SYNC_EACH, 1)) == NULL)
+		return 0;
+	bad += (phwal_count(q) != n) || (phwal_get_min(q, &key, NULL, NULL) != 1) || (key != 1000);
+	phwal_close(q);
+	if (bad) {
+		printf("LOG FAILURE FAILED - %d bad results\n", bad);
+		return 0;
+	}
+	printf("LOG FAILURE PASSED\n");
+	return 1;
+} // wl_fail
+
+
+static int
+wl_tests(intptr_t size, intptr_t ops)
+{
+	char name[4200];
+	void *q;
+	int fd;
+
+	// Plain close and reopen
+	wl_unlink();
+	wl_nlive = 0;
+	if (((q = phwal_open(wl_path, PHWAL_SYNC_GROUP, 64)) == NULL) || !wl_hold(q, size, ops)) {
+		printf("REOPEN FAILED - Unable to run the workload\n");
+		return 0;
+	}
+	phwal_close(q);
+	if (!wl_verify("REOPEN", PHWAL_SYNC_GROUP))
+		return 0;
+
+	// A torn frame on the end of the log is dropped, and the log appended to after it
+	if (!wl_refill() || ((q = phwal_open(wl_path, PHWAL_SYNC_EACH, 1)) == NULL) || !wl_hold(q, 0, 1000))
+		return 0;
+	phwal_close(q);
+	snprintf(name, sizeof(name), "%s.log", wl_path);
+	if ((fd = open(name, O_WRONLY | O_APPEND)) < 0)
+		return 0;
+	if (write(fd, "\x40\x00\x00\x00\x12\x34\x56\x78\x01\x02\x03", 11) != 11) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	if (((q = phwal_open(wl_path, PHWAL_SYNC_EACH, 1)) == NULL) || !wl_hold(q, 0, 1000)) {
+		printf("TORN FRAME FAILED - Unable to run the workload\n");
+		return 0;
+	}
+	phwal_close(q);
+	if (!wl_verify("TORN FRAME", PHWAL_SYNC_EACH))
+		return 0;
+
+	// Explicit compaction, then more changes in the new log
+	if (!wl_refill() || ((q = phwal_open(wl_path, PHWAL_SYNC_NONE, 1)) == NULL) || !wl_hold(q, 0, ops))
+		return 0;
+	if (!phwal_compact(q) || !wl_hold(q, 0, ops / 4)) {
+		printf("COMPACT FAILED - Unable to compact the queue\n");
+		return 0;
+	}
+	phwal_close(q);
+	if (!wl_verify("COMPACT", PHWAL_SYNC_NONE))
+		return 0;
+	return wl_fail();
+} // wl_tests
+
+
+static void
+wl_bench(char *name, int sync, unsigned batch, intptr_t size, intptr_t ops)
+{
+	uint64_t bytes, syncs, compactions;
+	double t;
+	void *q;
+
+	wl_unlink();
+	wl_nlive = 0;
+	wl_changes = 0;
+	if ((q = phwal_open(wl_path, sync, batch)) == NULL) {
+		printf("%-12s unable to open %s\n", name, wl_path);
+		return;
+	}
+	t = wl_now();
+	if (!wl_hold(q, size, ops)) {
+		printf("%-12s FAILED\n", name);
+		phwal_close(q);
+		return;
+	}
+	t = wl_now() - t;
+	phwal_io_stats(q, &bytes, &syncs, &compactions);
+	phwal_close(q);
+
+	printf("%-12s %10ld %12.0f %10.1f %12.2f %10lu %8lu\n", name, (long)wl_changes, wl_changes / t,
+		t * 1e9 / wl_changes, (double)bytes / wl_changes, (unsigned long)syncs, (unsigned long)compactions);
+} // wl_bench
+
+
+int
+main(int argc, char *argv[])
+{
+	intptr_t ops = 200000, size = 10000, i;
+	char *dir = "/tmp";
+	char name[32];
+
+	if (argc > 1)
+		ops = atol(argv[1]);
+	if (argc > 2)
+		dir = argv[2];
+	if (ops < 1) {
+		fprintf(stderr, "Usage: %s [ops [dir]]\n", argv[0]);
+		return 1;
+	}
+	snprintf(wl_path, sizeof(wl_path), "%s/phwl.%d", dir, (int)getpid());
+	wl_ids = (uint64_t *)malloc((size + 4) * sizeof(uint64_t));
+	wl_keys = (uint64_t *)malloc((size + 4) * sizeof(uint64_t));
+	wl_data = (uint64_t *)malloc((size + 4) * sizeof(uint64_t));
+	if ((wl_ids == NULL) || (wl_keys == NULL) || (wl_data == NULL))
+		return 1;
+
+	if (!wl_tests(size, ops)) {
+		wl_unlink();
+		return 1;
+	}
+
+	// Syncing every change is far slower than the rest, so it runs for fewer rounds
+	printf("\n%-12s %10s %12s %10s %12s %10s %8s\n", "POLICY", "CHANGES", "CHANGES/S", "NS/CHANGE",
+		"BYTES/CHANGE", "FSYNCS", "COMPACT");
+	wl_bench("EACH", PHWAL_SYNC_EACH, 1, size / 10, (ops / 100) ? ops / 100 : 1);
+	for (i = 16; i <= 4096; i *= 16) {
+		snprintf(name, sizeof(name), "GROUP %ld", (long)i);
+		wl_bench(name, PHWAL_SYNC_GROUP, i, size, ops);
+	}
+	wl_bench("NONE", PHWAL_SYNC_NONE, 1, size, ops);
+
+	wl_unlink();
+	return 0;
+} // main
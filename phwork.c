@@ -0,0 +1,599 @@
+// Paired Heap Workload Test Framework
+//
+// Drives the ph.h API with the classic priority queue workloads: the hold model,
+// Dijkstra's shortest paths with decrease key on road-like and random graphs, a
+// discrete event simulation of a queueing system, and A* search on a grid.  Each
+// reports ns per heap operation, and comparisons per heap operation when ph.c is
+// built with __PH_STATS (as it is for phwork_stats).  When built with __PH_LATENCY
+// (as it is for phwork_lat) it also prints the latency percentiles of each call
+
+#include        <stdio.h>
+#include        <stdlib.h>
+#include        <stdint.h>
+#include        <string.h>
+#include        <math.h>
+#include        <time.h>
+#include	"ph.h"
+
+struct graph {
+	intptr_t	n;			// Number of vertices
+	intptr_t	*first;			// Edges of vertex v are first[v] to first[v + 1] - 1
+	intptr_t	*to;
+	intptr_t	*w;
+};
+
+
+double
+work_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} // work_now
+
+
+#define	WORK_MAX	16			// Most workload runs per pairing strategy
+
+static const int work_pairings[] = { PH_PAIR_CHUNKED, PH_PAIR_TWOPASS, PH_PAIR_MULTIPASS,
+				     PH_PAIR_FRONTBACK, PH_PAIR_AUXTWOPASS };
+static const char *work_pnames[] = { "chunked", "twopass", "multipass", "frontback", "auxtwopass" };
+#define	WORK_NPAIRINGS	5
+
+static int		work_pairing;		// PH_PAIR_* strategy of the heaps made
+static uint64_t		work_seed;		// State of work_random()
+static double		work_nsop[WORK_MAX];	// ns per op of each run with work_pairing
+static const char	*work_names[WORK_MAX];
+static intptr_t		work_sizes[WORK_MAX];
+static int		work_nruns;
+
+
+static inline uint64_t
+work_random(void)
+{
+	uint64_t x = work_seed;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (work_seed = x);
+} // work_random
+
+
+// Exponentially distributed random number with the given mean
+static inline double
+work_exp(double mean)
+{
+	return -mean * log(((work_random() >> 11) + 1) * (1.0 / 9007199254740993.0));
+} // work_exp
+
+
+// Prints the latency percentiles of every call that was timed, if ph.c was built
+// with __PH_LATENCY (as it is for phwork_lat)
+void
+work_latency(void *heap)
+{
+	static const char *names[PH_LAT_OPS] = { "insert", "delete_min", "delete", "change_key", "destroy" };
+	struct pheap_latency lat;
+	int op;
+
+	if (!pheap_latency_snapshot(heap, &lat))
+		return;
+	for (op = 0; op < PH_LAT_OPS; op++) {
+		if (lat.count[op] == 0)
+			continue;
+		fprintf(stderr, "    %-12s %10lu calls  p50 %6lu  p99 %6lu  p99.9 %7lu  p99.99 %8lu  max %9lu ns\n",
+			names[op], lat.count[op], pheap_latency_percentile(&lat, op, 50.0),
+			pheap_latency_percentile(&lat, op, 99.0), pheap_latency_percentile(&lat, op, 99.9),
+			pheap_latency_percentile(&lat, op, 99.99), lat.max_ns[op]);
+	}
+} // work_latency
+
+
+// Prints one result line from the time taken and the heap's statistics
+void
+work_report(const char *name, intptr_t size, intptr_t ops, double taken, void *heap, const char *verdict)
+{
+	struct pheap_stats st;
+
+	if (work_nruns < WORK_MAX) {
+		work_names[work_nruns] = name;
+		work_sizes[work_nruns] = size;
+		work_nsop[work_nruns++] = taken * 1000000000.0 / ops;
+	}
+	fprintf(stderr, "%-24s %10ld %12ld %9.1f ", name, size, ops, taken * 1000000000.0 / ops);
+	if (pheap_stats(heap, &st))
+		fprintf(stderr, "%9.2f", (double)st.comparisons / ops);
+	else
+		fprintf(stderr, "%9s", "-");
+	fprintf(stderr, "   %s\n", verdict);
+	work_latency(heap);
+} // work_report
+
+
+// Hold model - a queue of n holds is kept at a steady size while each operation
+// deletes the least key t, and inserts t plus a random exponential increment
+void
+work_hold(intptr_t n, intptr_t holds)
+{
+	void *heap;
+	intptr_t i, key, last = 0, bad = 0;
+	double start, taken;
+
+	if ((heap = pheap_create_ex(NULL, PH_OPT_POOL | work_pairing)) == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		pheap_insert(heap, (void *)(intptr_t)work_exp(1000000.0), NULL);
+	pheap_delete_min(heap, (void **)&key, NULL);
+	pheap_insert(heap, (void *)key, NULL);
+	pheap_stats_reset(heap);
+
+	start = work_now();
+	for (i = 0; i < holds; i++) {
+		pheap_delete_min(heap, (void **)&key, NULL);
+		if (key < last)
+			bad++;
+		last = key;
+		pheap_insert(heap, (void *)(key + (intptr_t)work_exp(1000000.0)), NULL);
+	}
+	taken = work_now() - start;
+
+	work_report("HOLD", n, holds * 2, taken, heap, bad ? "FAILED" : "PASSED");
+	pheap_destroy(heap, NULL);
+} // work_hold
+
+
+void
+graph_free(struct graph *g)
+{
+	free(g->first);
+	free(g->to);
+	free(g->w);
+	memset(g, 0, sizeof(struct graph));
+} // graph_free
+
+
+// Builds a graph in g from m directed edges in the from, to and w arrays
+// Returns 1 on success
+int
+graph_build(struct graph *g, intptr_t n, intptr_t m, intptr_t *from, intptr_t *to, intptr_t *w)
+{
+	intptr_t i, *pos;
+
+	g->n = n;
+	g->first = (intptr_t *)calloc(n + 1, sizeof(intptr_t));
+	g->to = (intptr_t *)malloc(m * sizeof(intptr_t));
+	g->w = (intptr_t *)malloc(m * sizeof(intptr_t));
+	pos = (intptr_t *)malloc((n + 1) * sizeof(intptr_t));
+	if ((g->first == NULL) || (g->to == NULL) || (g->w == NULL) || (pos == NULL)) {
+		free(pos);
+		graph_free(g);
+		return 0;
+	}
+	for (i = 0; i < m; i++)
+		g->first[from[i] + 1]++;
+	for (i = 0; i < n; i++)
+		g->first[i + 1] += g->first[i];
+	memcpy(pos, g->first, (n + 1) * sizeof(intptr_t));
+	for (i = 0; i < m; i++) {
+		g->to[pos[from[i]]] = to[i];
+		g->w[pos[from[i]]++] = w[i];
+	}
+	free(pos);
+	return 1;
+} // graph_build
+
+
+// Adds edges both ways between v and u of length len
+static inline void
+graph_edge(intptr_t *from, intptr_t *to, intptr_t *w, intptr_t *m, intptr_t v, intptr_t u, intptr_t len)
+{
+	from[*m] = v, to[*m] = u, w[(*m)++] = len;
+	from[*m] = u, to[*m] = v, w[(*m)++] = len;
+} // graph_edge
+
+
+// A road-like graph - a side x side grid with both way edges between neighbours
+// with random lengths, and a few longer and faster highway edges
+int
+graph_road(struct graph *g, intptr_t side)
+{
+	intptr_t n = side * side, m = 0, x, y, v, u, i;
+	intptr_t *from, *to, *w;
+	int ok;
+
+	from = (intptr_t *)malloc(6 * n * sizeof(intptr_t));
+	to = (intptr_t *)malloc(6 * n * sizeof(intptr_t));
+	w = (intptr_t *)malloc(6 * n * sizeof(intptr_t));
+	if ((from == NULL) || (to == NULL) || (w == NULL)) {
+		free(from);
+		free(to);
+		free(w);
+		return 0;
+	}
+	for (y = 0; y < side; y++) {
+		for (x = 0; x < side; x++) {
+			v = y * side + x;
+			if (x + 1 < side) {
+				u = v + 1;
+				graph_edge(from, to, w, &m, v, u, 50 + work_random() % 100);
+			}
+			if (y + 1 < side) {
+				u = v + side;
+				graph_edge(from, to, w, &m, v, u, 50 + work_random() % 100);
+			}
+		}
+	}
+	for (i = 0; i < n / 50; i++) {
+		v = work_random() % n;
+		x = (v % side) + (work_random() % 21) - 10;
+		y = (v / side) + (work_random() % 21) - 10;
+		if ((x < 0) || (x >= side) || (y < 0) || (y >= side))
+			continue;
+		u = y * side + x;
+		graph_edge(from, to, w, &m, v, u, 30 * (labs(x - v % side) + labs(y - v / side)));
+	}
+	ok = graph_build(g, n, m, from, to, w);
+	free(from);
+	free(to);
+	free(w);
+	return ok;
+} // graph_road
+
+
+// A random graph of n vertices with degree random out edges each
+int
+graph_random(struct graph *g, intptr_t n, intptr_t degree)
+{
+	intptr_t m = n * degree, i;
+	intptr_t *from, *to, *w;
+	int ok;
+
+	from = (intptr_t *)malloc(m * sizeof(intptr_t));
+	to = (intptr_t *)malloc(m * sizeof(intptr_t));
+	w = (intptr_t *)malloc(m * sizeof(intptr_t));
+	if ((from == NULL) || (to == NULL) || (w == NULL)) {
+		free(from);
+		free(to);
+		free(w);
+		return 0;
+	}
+	for (i = 0; i < m; i++) {
+		from[i] = i / degree;
+		to[i] = work_random() % n;
+		w[i] = 1 + work_random() % 1000;
+	}
+	ok = graph_build(g, n, m, from, to, w);
+	free(from);
+	free(to);
+	free(w);
+	return ok;
+} // graph_random
+
+
+// Reference shortest path distances, by Dijkstra with a binary heap of (distance,
+// vertex) pairs, where stale entries are skipped when they are popped
+void
+graph_reference(struct graph *g, intptr_t src, intptr_t *dist)
+{
+	intptr_t *hd, *hv, hn = 0, i, c, p, d, v, e, nd;
+
+	hd = (intptr_t *)malloc(g->first[g->n] * sizeof(intptr_t) + sizeof(intptr_t));
+	hv = (intptr_t *)malloc(g->first[g->n] * sizeof(intptr_t) + sizeof(intptr_t));
+	for (i = 0; i < g->n; i++)
+		dist[i] = INTPTR_MAX;
+	dist[src] = 0;
+	hd[0] = 0, hv[0] = src, hn = 1;
+	while (hn) {
+		d = hd[0], v = hv[0];
+		hn--;
+		for (i = 0; (c = 2 * i + 1) < hn; i = c) {
+			if ((c + 1 < hn) && (hd[c + 1] < hd[c]))
+				c++;
+			if (hd[hn] <= hd[c])
+				break;
+			hd[i] = hd[c], hv[i] = hv[c];
+		}
+		hd[i] = hd[hn], hv[i] = hv[hn];
+		if (d > dist[v])
+			continue;
+		for (e = g->first[v]; e < g->first[v + 1]; e++) {
+			if ((nd = d + g->w[e]) >= dist[g->to[e]])
+				continue;
+			dist[g->to[e]] = nd;
+			for (i = hn++; (i > 0) && (hd[p = (i - 1) / 2] > nd); i = p)
+				hd[i] = hd[p], hv[i] = hv[p];
+			hd[i] = nd, hv[i] = g->to[e];
+		}
+	}
+	free(hd);
+	free(hv);
+} // graph_reference
+
+
+// Dijkstra with one heap node per reached vertex, and pheap_change_key() for
+// every decrease key.  Checks the distances against graph_reference()
+void
+work_dijkstra(const char *name, struct graph *g)
+{
+	void *heap, **node;
+	intptr_t *dist, *ref, v, e, d, nd, u, ops = 0, bad = 0;
+	double start, taken;
+
+	heap = pheap_create_ex(NULL, PH_OPT_POOL | work_pairing);
+	node = (void **)calloc(g->n, sizeof(void *));
+	dist = (intptr_t *)malloc(g->n * sizeof(intptr_t));
+	ref = (intptr_t *)malloc(g->n * sizeof(intptr_t));
+	if ((heap == NULL) || (node == NULL) || (dist == NULL) || (ref == NULL)) {
+		fprintf(stderr, "%-24s FAILED - Out of memory\n", name);
+		goto dijkstra_cleanup;
+	}
+	for (v = 0; v < g->n; v++)
+		dist[v] = INTPTR_MAX;
+
+	start = work_now();
+	dist[0] = 0;
+	node[0] = pheap_insert(heap, (void *)0, (void *)0);
+	ops++;
+	while (pheap_delete_min(heap, (void **)&d, (void **)&v)) {
+		ops++;
+		node[v] = NULL;
+		for (e = g->first[v]; e < g->first[v + 1]; e++) {
+			u = g->to[e];
+			if ((nd = d + g->w[e]) >= dist[u])
+				continue;
+			if (node[u])
+				pheap_change_key(heap, node[u], (void *)nd);
+			else
+				node[u] = pheap_insert(heap, (void *)nd, (void *)u);
+			dist[u] = nd;
+			ops++;
+		}
+	}
+	taken = work_now() - start;
+
+	graph_reference(g, 0, ref);
+	for (v = 0; v < g->n; v++)
+		if (dist[v] != ref[v])
+			bad++;
+	work_report(name, g->n, ops, taken, heap, bad ? "FAILED" : "PASSED");
+
+dijkstra_cleanup:
+	pheap_destroy(heap, NULL);
+	free(node);
+	free(dist);
+	free(ref);
+} // work_dijkstra
+
+
+// Discrete event simulation of a bank of servers with one shared queue.  Events
+// are customer arrivals and service completions, keyed on their time in ns
+#define	DES_ARRIVE	0
+#define	DES_DEPART	1
+
+void
+work_des(intptr_t customers, int servers)
+{
+	void *heap;
+	intptr_t ops = 0, arrived = 0, served = 0, queued = 0, bad = 0;
+	uint64_t now = 0, last = 0, key;
+	intptr_t type;
+	int busy = 0;
+	double start, taken;
+
+	if ((heap = pheap_create_ex(NULL, PH_KEY_U64 | PH_OPT_POOL | work_pairing)) == NULL)
+		return;
+
+	start = work_now();
+	// Mean service time is 90% of servers * mean arrival gap, so queues build up
+	pheap_insert(heap, (void *)(uint64_t)work_exp(1000.0), (void *)DES_ARRIVE);
+	ops++;
+	while (pheap_delete_min(heap, (void **)&key, (void **)&type)) {
+		ops++;
+		now = key;
+		if (now < last)
+			bad++;
+		last = now;
+		if (type == DES_ARRIVE) {
+			arrived++;
+			if (arrived < customers) {
+				pheap_insert(heap, (void *)(now + 1 + (uint64_t)work_exp(1000.0)), (void *)DES_ARRIVE);
+				ops++;
+			}
+			if (busy < servers) {
+				busy++;
+				pheap_insert(heap, (void *)(now + 1 + (uint64_t)work_exp(900.0 * servers)), (void *)DES_DEPART);
+				ops++;
+			} else {
+				queued++;
+			}
+		} else {
+			served++;
+			if (queued) {
+				queued--;
+				pheap_insert(heap, (void *)(now + 1 + (uint64_t)work_exp(900.0 * servers)), (void *)DES_DEPART);
+				ops++;
+			} else {
+				busy--;
+			}
+		}
+	}
+	taken = work_now() - start;
+
+	work_report("DES QUEUEING", customers, ops, taken, heap, (bad || (served != customers)) ? "FAILED" : "PASSED");
+	pheap_destroy(heap, NULL);
+} // work_des
+
+
+// A* from one corner of a side x side grid to the other, moving in 4 directions
+// past random walls, with a Manhattan distance heuristic.  Nodes are keyed on the
+// estimated total path length, and improved paths use pheap_change_key().  Checks
+// the path length against a breadth first search
+void
+work_astar(intptr_t side)
+{
+	intptr_t n = side * side, v, u, x, y, g, i, ops = 0, head, tail, best = -1, bfs;
+	intptr_t *gs = NULL, *q = NULL;
+	static const int dx[4] = { 1, -1, 0, 0 }, dy[4] = { 0, 0, 1, -1 };
+	void *heap, **node = NULL;
+	char *wall = NULL, *closed = NULL;
+	double start, taken;
+
+	heap = pheap_create_ex(NULL, PH_OPT_POOL | work_pairing);
+	gs = (intptr_t *)malloc(n * sizeof(intptr_t));
+	q = (intptr_t *)malloc(n * sizeof(intptr_t));
+	node = (void **)calloc(n, sizeof(void *));
+	wall = (char *)malloc(n);
+	closed = (char *)calloc(n, 1);
+	if ((heap == NULL) || (gs == NULL) || (q == NULL) || (node == NULL) || (wall == NULL) || (closed == NULL)) {
+		fprintf(stderr, "%-24s FAILED - Out of memory\n", "A* GRID");
+		goto astar_cleanup;
+	}
+	for (v = 0; v < n; v++) {
+		wall[v] = (work_random() % 100) < 25;
+		gs[v] = INTPTR_MAX;
+	}
+	wall[0] = wall[n - 1] = 0;
+
+	start = work_now();
+	gs[0] = 0;
+	node[0] = pheap_insert(heap, (void *)(2 * (side - 1)), (void *)0);
+	ops++;
+	while (pheap_delete_min(heap, NULL, (void **)&v)) {
+		ops++;
+		node[v] = NULL;
+		closed[v] = 1;
+		if (v == n - 1) {
+			best = gs[v];
+			break;
+		}
+		for (i = 0; i < 4; i++) {
+			x = v % side + dx[i];
+			y = v / side + dy[i];
+			if ((x < 0) || (x >= side) || (y < 0) || (y >= side))
+				continue;
+			u = y * side + x;
+			if (wall[u] || closed[u] || ((g = gs[v] + 1) >= gs[u]))
+				continue;
+			gs[u] = g;
+			g += (side - 1 - x) + (side - 1 - y);
+			if (node[u])
+				pheap_change_key(heap, node[u], (void *)g);
+			else
+				node[u] = pheap_insert(heap, (void *)g, (void *)u);
+			ops++;
+		}
+	}
+	taken = work_now() - start;
+
+	// Breadth first search for the true shortest path length
+	for (v = 0; v < n; v++)
+		gs[v] = -1;
+	gs[0] = 0, q[0] = 0, head = 0, tail = 1;
+	while (head < tail) {
+		v = q[head++];
+		for (i = 0; i < 4; i++) {
+			x = v % side + dx[i];
+			y = v / side + dy[i];
+			if ((x < 0) || (x >= side) || (y < 0) || (y >= side))
+				continue;
+			u = y * side + x;
+			if (!wall[u] && (gs[u] < 0)) {
+				gs[u] = gs[v] + 1;
+				q[tail++] = u;
+			}
+		}
+	}
+	bfs = gs[n - 1];
+	work_report("A* GRID", n, ops, taken, heap, (best == bfs) ? "PASSED" : "FAILED");
+
+astar_cleanup:
+	pheap_destroy(heap, NULL);
+	free(gs);
+	free(q);
+	free(node);
+	free(wall);
+	free(closed);
+} // work_astar
+
+
+// Runs every workload with heaps of the current work_pairing strategy
+void
+work_all(intptr_t scale)
+{
+	struct graph g;
+	intptr_t n;
+
+	work_seed = 0x9e3779b97f4a7c15ULL;
+	work_nruns = 0;
+	fprintf(stderr, "%-24s %10s %12s %9s %9s\n", "WORKLOAD", "SIZE", "HEAP OPS", "NS/OP", "CMPS/OP");
+	for (n = 1000; n <= scale; n *= 10)
+		work_hold(n, scale);
+
+	n = (intptr_t)sqrt((double)scale);
+	memset(&g, 0, sizeof(g));
+	if (graph_road(&g, n)) {
+		work_dijkstra("DIJKSTRA ROAD GRID", &g);
+		graph_free(&g);
+	}
+	if (graph_random(&g, scale, 8)) {
+		work_dijkstra("DIJKSTRA RANDOM", &g);
+		graph_free(&g);
+	}
+	work_des(scale, 16);
+	work_astar(n);
+} // work_all
+
+
+int
+main(int argc, char *argv[])
+{
+	static double nsop[WORK_NPAIRINGS][WORK_MAX];
+	struct pheap_latency lat;
+	intptr_t scale = 1000000;
+	int p, first = 0, last = WORK_NPAIRINGS - 1, i;
+
+	if (argc > 3) {
+		fprintf(stderr, "Usage: %s [scale [chunked|twopass|multipass|frontback|auxtwopass]]\n", argv[0]);
+		return 0;
+	}
+	if ((argc >= 2) && ((scale = (intptr_t)atoi(argv[1])) < 1000)) {
+		fprintf(stderr, "%s: scale must be an integer of 1000 or greater\n", argv[0]);
+		return 0;
+	}
+	if (argc == 3) {
+		for (p = 0; (p < WORK_NPAIRINGS) && strcmp(argv[2], work_pnames[p]); p++);
+		if (p == WORK_NPAIRINGS) {
+			fprintf(stderr, "%s: unknown pairing strategy %s\n", argv[0], argv[2]);
+			return 0;
+		}
+		first = last = p;
+	}
+
+	// Every strategy sees the same random inputs
+	for (p = first; p <= last; p++) {
+		fprintf(stderr, "%sPAIRING STRATEGY %s\n", (p > first) ? "\n" : "", work_pnames[p]);
+		work_pairing = work_pairings[p];
+		work_all(scale);
+		memcpy(nsop[p], work_nsop, sizeof(work_nsop));
+	}
+
+	if (last > first) {
+		fprintf(stderr, "\nNS/OP BY PAIRING STRATEGY\n%-24s %10s", "WORKLOAD", "SIZE");
+		for (p = first; p <= last; p++)
+			fprintf(stderr, " %10s", work_pnames[p]);
+		for (i = 0; i < work_nruns; i++) {
+			fprintf(stderr, "\n%-24s %10ld", work_names[i], work_sizes[i]);
+			for (p = first; p <= last; p++)
+				fprintf(stderr, " %10.1f", nsop[p][i]);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	// Destroys are only seen in the histograms of every destroyed heap
+	if (pheap_latency_snapshot(NULL, &lat)) {
+		fprintf(stderr, "ALL HEAPS\n");
+		work_latency(NULL);
+	}
+	return 0;
+} // main